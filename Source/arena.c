@@ -0,0 +1,100 @@
+#include "arena.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+    * Allocate a new block able to hold at least size bytes and put it in front of the arena.
+    * INPUT: pointer to the arena, minimum size of the block
+    * OUTPUT: void
+*/
+static void arenaGrow(Arena * arena, size_t size)
+{
+    // blocks double so a long line only needs a few of them
+    size_t blockSize = arena->head ? arena->head->size * 2 : ARENA_BLOCK_SIZE;
+    while (blockSize < size)
+        blockSize *= 2;
+
+    ArenaBlock * block = malloc(sizeof(ArenaBlock) + blockSize);
+    if (!checkMemoryValid(block))
+        exit(EXIT_FAILURE);
+    block->size = blockSize;
+    block->used = 0;
+    block->next = arena->head;
+    arena->head = block;
+    arena->total += blockSize;
+}
+
+/*
+    * Prepare an empty arena, the first block is allocated on first use.
+    * INPUT: pointer to the arena
+    * OUTPUT: void
+*/
+void arenaInit(Arena * arena)
+{
+    arena->head = 0;
+    arena->total = 0;
+}
+
+/*
+    * Hand out size bytes aligned for any type.
+    * INPUT: pointer to the arena, number of bytes
+    * OUTPUT: pointer to the memory, valid until the next arenaReset()
+*/
+void * arenaAlloc(Arena * arena, size_t size)
+{
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if (!arena->head || arena->head->size - arena->head->used < size)
+        arenaGrow(arena, size);
+
+    void * p = arena->head->data + arena->head->used;
+    arena->head->used += size;
+    return p;
+}
+
+/*
+    * Copy len characters of a string into the arena and terminate it.
+    * INPUT: pointer to the arena, string, number of characters
+    * OUTPUT: the copy
+*/
+char * arenaStrndup(Arena * arena, const char * str, size_t len)
+{
+    char * copy = arenaAlloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = 0;
+    return copy;
+}
+
+/*
+    * Release everything allocated from the arena. When the line needed several blocks they are
+    * merged into one block of the total size, so the next lines fit in a single contiguous block.
+    * INPUT: pointer to the arena
+    * OUTPUT: void
+*/
+void arenaReset(Arena * arena)
+{
+    if (arena->head && arena->head->next)
+    {
+        size_t total = arena->total;
+        arenaFree(arena);
+        arenaGrow(arena, total);
+    }
+    else if (arena->head)
+        arena->head->used = 0;
+}
+
+/*
+    * Give every block back to the system.
+    * INPUT: pointer to the arena
+    * OUTPUT: void
+*/
+void arenaFree(Arena * arena)
+{
+    while (arena->head)
+    {
+        ArenaBlock * block = arena->head;
+        arena->head = block->next;
+        free(block);
+    }
+    arena->total = 0;
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <stddef.h>
+#define ARENA_BLOCK_SIZE 4096 // size of the first block of an arena
+
+/*
+ * Bump allocator for everything built from one command line. Memory is never freed piece by piece:
+ * the whole arena is released at once with arenaReset().
+*/
+typedef struct ArenaBlock {
+    struct ArenaBlock * next;
+    size_t size; // bytes available in data
+    size_t used; // bytes already handed out
+    char data[];
+} ArenaBlock;
+
+typedef struct Arena {
+    ArenaBlock * head; // block currently allocated from, older blocks follow
+    size_t total; // bytes available in all blocks
+} Arena;
+
+void arenaInit(Arena * arena);
+void * arenaAlloc(Arena * arena, size_t size);
+char * arenaStrndup(Arena * arena, const char * str, size_t len);
+void arenaReset(Arena * arena);
+void arenaFree(Arena * arena);
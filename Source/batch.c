@@ -0,0 +1,378 @@
+#define _GNU_SOURCE
+#include "batch.h"
+#include "launch.h"
+#include "expand.h"
+#include "options.h"
+#include "process.h"
+#include "timing.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+extern char ** environ;
+
+/*
+ * One exec of a command split in batches: the operands args[first, first + count) between the fixed words.
+*/
+typedef struct Batch {
+    int first;
+    int count;
+    pid_t pid; // 0 until launched
+    int status;
+    Timing timing;
+} Batch;
+
+/*
+ * A command being run in batches: its fixed words around the operands and the batches still to finish.
+*/
+typedef struct BatchRun {
+    char ** args;
+    int numArgs;
+    int first; // operands are args[first, end)
+    int end;
+    char ** argv; // scratch command line of one batch
+    Batch * batches;
+    int numBatches;
+    int capacity;
+} BatchRun;
+
+/*
+    * Bytes one string takes in the arguments of exec(): its characters, terminator and pointer.
+    * INPUT: the string
+    * OUTPUT: the size
+*/
+static long argSize(const char * arg)
+{
+    return strlen(arg) + 1 + sizeof(char *);
+}
+
+/*
+    * Bytes a NULL-terminated array of strings takes in exec().
+    * INPUT: the array, pointer receiving the length of its longest string (NULL if not needed)
+    * OUTPUT: the size, with the terminating pointer
+*/
+static long vectorSize(char ** strings, size_t * longest)
+{
+    long size = sizeof(char *);
+    for (; *strings; strings++)
+    {
+        size_t len = strlen(*strings);
+        size += len + 1 + sizeof(char *);
+        if (longest && len > *longest)
+            *longest = len;
+    }
+    return size;
+}
+
+/*
+    * Longest single argument exec() takes, terminator included (MAX_ARG_STRLEN of Linux).
+    * INPUT: void
+    * OUTPUT: limit in bytes
+*/
+static long argStringLimit()
+{
+    long page = sysconf(_SC_PAGESIZE);
+    return (page > 0 ? page : 4096) * BATCH_ARG_STRLEN_PAGES;
+}
+
+/*
+    * Room exec() leaves for the arguments of a command: ARG_MAX less the environment and BATCH_HEADROOM, or
+    * "set batchlimit=SIZE" when it is set.
+    * INPUT: void
+    * OUTPUT: limit in bytes
+*/
+long batchArgLimit()
+{
+    if (optBatchLimit > 0)
+        return optBatchLimit;
+    long max = sysconf(_SC_ARG_MAX);
+    if (max <= 0)
+        max = BATCH_DEFAULT_ARG_MAX;
+    return max - vectorSize(environ, 0) - BATCH_HEADROOM;
+}
+
+/*
+    * Check if the arguments of a command are too large for a single exec(), in total or one of them.
+    * INPUT: NULL-terminated arguments
+    * OUTPUT: 1 if they must be split, 0 otherwise
+*/
+int batchNeeded(char ** args)
+{
+    size_t longest = 0;
+    long size = vectorSize(args, &longest);
+    return size > batchArgLimit() || (long)longest + 1 > argStringLimit();
+}
+
+/*
+    * Insert a batch in the run, growing the array.
+    * INPUT: the run, position of the batch, its operands
+    * OUTPUT: void
+*/
+static void insertBatch(BatchRun * run, int at, int first, int count)
+{
+    if (run->numBatches == run->capacity)
+    {
+        run->capacity = run->capacity ? run->capacity * 2 : 16;
+        run->batches = realloc(run->batches, run->capacity * sizeof(Batch));
+        if (!checkMemoryValid(run->batches))
+            exit(EXIT_FAILURE);
+    }
+    memmove(run->batches + at + 1, run->batches + at, (run->numBatches - at) * sizeof(Batch));
+    run->numBatches++;
+
+    Batch * b = &run->batches[at];
+    memset(b, 0, sizeof(Batch));
+    b->first = first;
+    b->count = count;
+}
+
+/*
+    * Find the operands of a command: the words that came from its patterns, else everything after the command name
+    * and its leading options ("--" ends them). The words around the operands are repeated in every batch, so
+    * "cp *.c dest/" copies each batch into dest/.
+    * INPUT: the run, its args and numArgs filled
+    * OUTPUT: 1 if the command has operands, 0 otherwise
+*/
+static int findOperands(BatchRun * run)
+{
+    if (run->args == expandedArgs && expandedFirst > 0 && expandedEnd <= run->numArgs)
+    {
+        run->first = expandedFirst;
+        run->end = expandedEnd;
+        return 1;
+    }
+
+    run->first = 1;
+    while (run->first < run->numArgs && run->args[run->first][0] == '-')
+        if (strcmp(run->args[run->first++], "--") == 0)
+            break;
+    run->end = run->numArgs;
+    return run->first < run->end;
+}
+
+/*
+    * Cut the operands into the fewest batches that each fit in the limit, in their order.
+    * INPUT: the run with its operands found
+    * OUTPUT: 0 on success, -1 if one operand does not fit even alone or a word is longer than exec() takes
+*/
+static int planBatches(BatchRun * run)
+{
+    long limit = batchArgLimit();
+    long fixed = sizeof(char *);
+    long longest = argStringLimit() + sizeof(char *);
+    int i;
+    for (i = 0; i < run->numArgs; i++)
+    {
+        long s = argSize(run->args[i]);
+        if (s > longest)
+            return -1;
+        if (i < run->first || i >= run->end)
+            fixed += s;
+    }
+
+    long size = fixed;
+    int start = run->first;
+    for (i = run->first; i < run->end; i++)
+    {
+        long s = argSize(run->args[i]);
+        if (fixed + s > limit)
+            return -1;
+        if (size + s > limit)
+        {
+            insertBatch(run, run->numBatches, start, i - start);
+            start = i;
+            size = fixed;
+        }
+        size += s;
+    }
+    insertBatch(run, run->numBatches, start, run->end - start);
+    return 0;
+}
+
+/*
+    * Build the command line of a batch in the scratch array: the fixed words with the operands of the batch.
+    * INPUT: the run, the batch
+    * OUTPUT: the NULL-terminated arguments
+*/
+static char ** batchArgs(BatchRun * run, Batch * b)
+{
+    int n = run->first;
+    memcpy(run->argv, run->args, run->first * sizeof(char *));
+    memcpy(run->argv + n, run->args + b->first, b->count * sizeof(char *));
+    n += b->count;
+    memcpy(run->argv + n, run->args + run->end, (run->numArgs - run->end) * sizeof(char *));
+    n += run->numArgs - run->end;
+    run->argv[n] = 0;
+    return run->argv;
+}
+
+/*
+    * Make the redirections of a command, resolved once by the shell, a list every batch applies in its child: files are
+    * opened (and truncated) a single time, and batches writing the same file share its offset.
+    * INPUT: arena of the command line, resolved descriptors, the original list (descriptors above STDERR are kept from
+    *        it), array receiving the descriptors moved, -1 for none (closed by the caller)
+    * OUTPUT: the list
+*/
+static Redirects * sharedRedirects(Arena * arena, ShellRedirect * shell, const Redirects * redirects, int moved[3])
+{
+    Redirects * shared = arenaAlloc(arena, sizeof(Redirects));
+    shared->items = arenaAlloc(arena, (redirects->count + 3) * sizeof(Redirect));
+    shared->count = 0;
+    int fd;
+
+    // a source among 0..2 would be overwritten by an earlier copy: it is moved above them first
+    for (fd = 0; fd < 3; fd++)
+    {
+        moved[fd] = -1;
+        if (shell->fd[fd] < 0 || shell->fd[fd] > STDERR_FILENO || shell->fd[fd] == fd)
+            continue;
+        moved[fd] = fcntl(shell->fd[fd], F_DUPFD_CLOEXEC, 3);
+        if (moved[fd] != -1)
+            shell->fd[fd] = moved[fd];
+    }
+    for (fd = 0; fd < 3; fd++)
+    {
+        if (shell->fd[fd] == fd)
+            continue;
+        Redirect * r = &shared->items[shared->count++];
+        r->fd = fd;
+        r->flags = 0;
+        r->source = shell->fd[fd];
+        r->path = 0;
+    }
+    for (fd = 0; fd < redirects->count; fd++)
+        if (redirects->items[fd].fd > STDERR_FILENO)
+            shared->items[shared->count++] = redirects->items[fd];
+    return shared;
+}
+
+/*
+    * Wait for a launched batch.
+    * INPUT: the run, the batch
+    * OUTPUT: void
+*/
+static void reapBatch(BatchRun * run, Batch * b)
+{
+    struct rusage usage;
+    int status = 0;
+    while (wait4(b->pid, &status, 0, &usage) < 0)
+    {
+        if (errno != EINTR)
+        {
+            b->status = W_EXITCODE(1, 0);
+            return;
+        }
+    }
+    b->status = status;
+    if (timingEnabled())
+        timingReportChild(run->args[0], 0, &b->timing, &usage);
+}
+
+/*
+    * Run a command whose arguments are too large for exec() the way xargs would: its operands are split into the
+    * fewest batches that fit, and every batch is one exec of the command with the same fixed words and redirections.
+    * Up to optBatchJobs batches run at once; they are reaped in their order. A batch exec() still refuses is split in
+    * two, down to a single operand.
+    * INPUT: arena of the command line, array of command's arguments, input and output descriptors (-1 for the shell's
+    *        own), redirections
+    * OUTPUT: status of the first batch that failed, 0 if all succeeded; BATCH_STATUS_TOO_LONG if an operand can not be
+    *         passed even alone
+*/
+int runBatched(Arena * arena, char ** args, int fdIn, int fdOut, const Redirects * redirects)
+{
+    BatchRun run;
+    ShellRedirect shell;
+    const Redirects * childRedirects = redirects;
+    int moved[3] = {-1, -1, -1};
+    int status = 0, stop = 0;
+    int i, next = 0, done = 0, running = 0;
+
+    memset(&run, 0, sizeof(run));
+    run.args = args;
+    run.numArgs = getNumArgs(args);
+    if (!findOperands(&run) || planBatches(&run) == -1)
+    {
+        fprintf(stderr, "[Error] Argument list too long.\n");
+        free(run.batches);
+        return BATCH_STATUS_TOO_LONG;
+    }
+
+    long jobs = optBatchJobs > 0 ? optBatchJobs : sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs < 1)
+        jobs = 1;
+
+    // files are opened once for all the batches
+    shell.numOpened = 0;
+    if (redirects && redirects->count > 0)
+    {
+        if (redirectOpen(arena, redirects, fdIn, fdOut, &shell) == -1)
+        {
+            free(run.batches);
+            return 1;
+        }
+        childRedirects = sharedRedirects(arena, &shell, redirects, moved);
+        fdIn = fdOut = -1;
+    }
+    run.argv = arenaAlloc(arena, (run.numArgs + 1) * sizeof(char *));
+
+    while (done < run.numBatches)
+    {
+        while (!stop && next < run.numBatches && running < jobs)
+        {
+            Batch * b = &run.batches[next];
+            timingStart(&b->timing);
+            b->pid = spawnCommand(batchArgs(&run, b), fdIn, fdOut, -1, childRedirects);
+            if (b->pid >= 0)
+            {
+                next++;
+                running++;
+                continue;
+            }
+            int err = errno;
+            if (b->pid == -1 && err == E2BIG && b->count > 1)
+            {
+                // the estimate missed (a single string over the per-argument limit, an environment grown meanwhile)
+                int half = b->count / 2;
+                b->count -= half;
+                insertBatch(&run, next + 1, b->first + b->count, half);
+                continue;
+            }
+
+            if (b->pid == SPAWN_REDIRECT_FAILED)
+                fprintf(stderr, "[Error] Redirect failed: %s\n", strerror(err));
+            else if (err == E2BIG)
+                fprintf(stderr, "[Error] Argument list too long.\n");
+            else if (err == ENOENT || err == EACCES || err == ENOEXEC || err == ENOTDIR)
+                fprintf(stderr, "[Error] Invalid command.\n");
+            else
+                fprintf(stderr, "[Error] Can not create child process. Failed to execute command.\n");
+            if (!status)
+                status = b->pid == SPAWN_REDIRECT_FAILED ? 1 : err == E2BIG ? BATCH_STATUS_TOO_LONG : 127;
+            stop = 1;
+        }
+        if (done == next)
+            break;
+
+        Batch * b = &run.batches[done++];
+        reapBatch(&run, b);
+        running--;
+        // like xargs, a batch killed by a signal ends the run: no new batch is started
+        if (WIFSIGNALED(b->status))
+            stop = 1;
+        if (!status && decodeStatus(b->status) != 0)
+            status = decodeStatus(b->status);
+    }
+
+    for (i = 0; i < 3; i++)
+        if (moved[i] != -1)
+            close(moved[i]);
+    redirectRelease(&shell);
+    free(run.batches);
+    return status;
+}
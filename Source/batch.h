@@ -0,0 +1,11 @@
+#pragma once
+#include "arena.h"
+#include "redirect.h"
+#define BATCH_HEADROOM 2048 // bytes of ARG_MAX left unused by a batch: auxiliary vector, rounding of the kernel
+#define BATCH_DEFAULT_ARG_MAX 131072 // ARG_MAX assumed when sysconf() does not know it
+#define BATCH_ARG_STRLEN_PAGES 32 // pages a single argument may take (MAX_ARG_STRLEN of Linux)
+#define BATCH_STATUS_TOO_LONG 126 // status of a command that can not be run even with a single operand
+
+long batchArgLimit();
+int batchNeeded(char ** args);
+int runBatched(Arena * arena, char ** args, int fdIn, int fdOut, const Redirects * redirects);
@@ -0,0 +1,957 @@
+#define _GNU_SOURCE
+#include "builtins.h"
+#include "process.h"
+#include "utils.h"
+#include "launch.h"
+#include "options.h"
+#include "hash.h"
+#include "jobs.h"
+#include "parallel.h"
+#include "history.h"
+#include "cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+extern char ** environ;
+
+/*
+ * Buffered output of a builtin to its STDOUT descriptor: one write() per BUILTIN_BUFFER bytes instead of one per piece.
+*/
+typedef struct Output {
+    int fd;
+    int error; // errno of the first failed write, 0 while everything went out
+    size_t len;
+    char buf[BUILTIN_BUFFER];
+} Output;
+
+static void outInit(Output * o, int fd)
+{
+    o->fd = fd;
+    o->error = 0;
+    o->len = 0;
+}
+
+/*
+    * Write the buffered bytes. After a failure the output is dropped, the error is kept for outFinish().
+    * INPUT: the output
+    * OUTPUT: void
+*/
+static void outFlush(Output * o)
+{
+    size_t done = 0;
+    while (done < o->len && !o->error)
+    {
+        ssize_t w = write(o->fd, o->buf + done, o->len - done);
+        if (w < 0)
+        {
+            if (errno != EINTR)
+                o->error = errno;
+            continue;
+        }
+        done += w;
+    }
+    o->len = 0;
+}
+
+static void outBytes(Output * o, const char * bytes, size_t len)
+{
+    while (len > 0)
+    {
+        if (o->len == BUILTIN_BUFFER)
+            outFlush(o);
+        size_t n = BUILTIN_BUFFER - o->len;
+        if (n > len)
+            n = len;
+        memcpy(o->buf + o->len, bytes, n);
+        o->len += n;
+        bytes += n;
+        len -= n;
+    }
+}
+
+static void outStr(Output * o, const char * str)
+{
+    outBytes(o, str, strlen(str));
+}
+
+static void outChar(Output * o, char c)
+{
+    outBytes(o, &c, 1);
+}
+
+/*
+    * printf() into the output, through the stack for short results.
+    * INPUT: the output, format and its arguments
+    * OUTPUT: void
+*/
+static void outPrintf(Output * o, const char * format, ...)
+{
+    char small[256];
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(small, sizeof(small), format, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+    if ((size_t)n < sizeof(small))
+    {
+        outBytes(o, small, n);
+        return;
+    }
+
+    char * big = malloc(n + 1);
+    if (!checkMemoryValid(big))
+        exit(EXIT_FAILURE);
+    va_start(ap, format);
+    vsnprintf(big, n + 1, format, ap);
+    va_end(ap);
+    outBytes(o, big, n);
+    free(big);
+}
+
+/*
+    * Flush the output and turn a write failure into the builtin's exit status.
+    * INPUT: the output, name of the builtin for the message
+    * OUTPUT: 0 if everything was written, 141 when the reader went away (as for a process killed by SIGPIPE), 1 otherwise
+*/
+static int outFinish(Output * o, const char * name)
+{
+    outFlush(o);
+    if (!o->error)
+        return 0;
+    if (o->error == EPIPE)
+        return 128 + SIGPIPE;
+    fprintf(stderr, "[Error] %s: write error: %s\n", name, strerror(o->error));
+    return 1;
+}
+
+/*
+    * Write the character of one backslash escape (\n, \t, \\, \0NNN or \NNN, \xHH...).
+    * INPUT: the output, string just after the backslash, 1 if octal needs a leading 0 (echo, %b), pointer set to 1 by \c
+    * OUTPUT: number of characters consumed after the backslash
+*/
+static size_t outEscape(Output * o, const char * s, int zeroOctal, int * stop)
+{
+    static const char simple[] = "a\ab\be\033f\fn\nr\rt\tv\v\\\\";
+    const char * hit;
+    size_t n = 0;
+    int value = 0;
+
+    if (*s == 'c')
+    {
+        *stop = 1;
+        return 1;
+    }
+    if (*s == 'x' && isxdigit((unsigned char)s[1]))
+    {
+        for (n = 1; n <= 2 && isxdigit((unsigned char)s[n]); n++)
+            value = value * 16 + (isdigit((unsigned char)s[n]) ? s[n] - '0' : (tolower((unsigned char)s[n]) - 'a' + 10));
+        outChar(o, (char)value);
+        return n;
+    }
+    if (*s >= '0' && *s <= '7' && (!zeroOctal || *s == '0'))
+    {
+        size_t start = zeroOctal ? 1 : 0;
+        for (n = start; n < start + 3 && s[n] >= '0' && s[n] <= '7'; n++)
+            value = value * 8 + (s[n] - '0');
+        outChar(o, (char)value);
+        return n;
+    }
+    if (*s && (hit = strchr(simple, *s)) && (hit - simple) % 2 == 0)
+    {
+        outChar(o, hit[1]);
+        return 1;
+    }
+
+    // unknown escape (or a trailing backslash): kept as written
+    outChar(o, '\\');
+    return 0;
+}
+
+/*
+    * Write a string with its backslash escapes interpreted, the way "echo -e" and "printf %b" do.
+    * INPUT: the output, the string, pointer set to 1 when \c stops the output
+    * OUTPUT: void
+*/
+static void outEscaped(Output * o, const char * str, int * stop)
+{
+    while (*str && !*stop)
+    {
+        const char * slash = strchr(str, '\\');
+        if (!slash)
+        {
+            outStr(o, str);
+            return;
+        }
+        outBytes(o, str, slash - str);
+        str = slash + 1;
+        str += outEscape(o, str, 1, stop);
+    }
+}
+
+/*
+    * "cd [dir|-]": change the working directory, to $HOME without argument, to the previous one ($OLDPWD) with "-".
+    * PWD and OLDPWD are set from getcwd(), whatever their length, so they also hold when the shell started without them.
+    * INPUT: array of command's arguments, output descriptor
+    * OUTPUT: exit status
+*/
+static int runCd(char ** args, int out)
+{
+    char * path;
+
+    // set the correct path
+    if (args[1] == NULL) {
+        // cd without arguments jumps to the home directory
+        path = getenv("HOME");
+        if (!path) {
+            fprintf(stderr, "[Error] cd: HOME not set\n");
+            return 1;
+        }
+    }
+    else if (strcmp(args[1], "-") == 0) {
+        // cd - returns to the previous working directory
+        path = getenv("OLDPWD");
+        if (!path || path[0] == 0) {
+            fprintf(stderr, "[Error] No previous working directory.\n");
+            return 1; // cd unsucessful
+        }
+        dprintf(out, "%s\n", path); // echo the previous path
+    }
+    else path = args[1];
+
+    // the directory being left, from the kernel; $PWD only if it has been removed
+    char * oldPwd = getcwd(NULL, 0);
+    if (!oldPwd && getenv("PWD"))
+        oldPwd = strdup(getenv("PWD"));
+
+    // call chdir()
+    if (chdir(path) != 0) {
+        fprintf(stderr, "[Error] cd: %s: %s\n", path, strerror(errno));
+        free(oldPwd);
+        return 1; // cd unsuccessful
+    }
+    if (oldPwd)
+        setenv("OLDPWD", oldPwd, 1);
+    free(oldPwd);
+
+    char * newPwd = getcwd(NULL, 0);
+    if (newPwd)
+        setenv("PWD", newPwd, 1);
+    free(newPwd);
+    return 0; // cd successful
+}
+
+/*
+    * "pwd": print the working directory.
+    * INPUT: array of command's arguments, output descriptor
+    * OUTPUT: exit status
+*/
+static int runPwd(char ** args, int out)
+{
+    char path[PATH_MAX];
+    Output o;
+
+    if (!getcwd(path, sizeof(path)))
+    {
+        fprintf(stderr, "[Error] pwd: %s\n", strerror(errno));
+        return 1;
+    }
+    outInit(&o, out);
+    outStr(&o, path);
+    outChar(&o, '\n');
+    return outFinish(&o, "pwd");
+}
+
+static int runTrue(char ** args, int out)
+{
+    return 0;
+}
+
+static int runFalse(char ** args, int out)
+{
+    return 1;
+}
+
+/*
+    * "echo [-neE] [words...]": print the words separated by spaces. -n drops the newline, -e interprets escapes.
+    * INPUT: array of command's arguments, output descriptor
+    * OUTPUT: exit status
+*/
+static int runEcho(char ** args, int out)
+{
+    int newline = 1, escapes = 0, stop = 0;
+    int i = 1, first;
+    Output o;
+
+    // only words made entirely of n, e and E are options, anything else ("-", "-x") is printed
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++)
+    {
+        const char * p = args[i] + 1;
+        if (p[strspn(p, "neE")] != 0)
+            break;
+        for (; *p; p++)
+        {
+            if (*p == 'n')
+                newline = 0;
+            else
+                escapes = *p == 'e';
+        }
+    }
+
+    outInit(&o, out);
+    for (first = i; args[i] && !stop; i++)
+    {
+        if (i > first)
+            outChar(&o, ' ');
+        if (escapes)
+            outEscaped(&o, args[i], &stop);
+        else
+            outStr(&o, args[i]);
+    }
+    if (newline && !stop)
+        outChar(&o, '\n');
+    return outFinish(&o, "echo");
+}
+
+/*
+    * Numeric argument of printf: decimal, octal (0...), hex (0x...) or the code of a character ('c).
+    * INPUT: string of the argument (NULL when missing), pointer to the value, pointer to the exit status
+    * OUTPUT: void, the status is set to 1 for an invalid number
+*/
+static void printfInteger(const char * arg, long long * value, int * status)
+{
+    char * end;
+    *value = 0;
+    if (!arg || !*arg)
+        return;
+    if ((arg[0] == '\'' || arg[0] == '"') && arg[1])
+    {
+        *value = (unsigned char)arg[1];
+        return;
+    }
+    errno = 0;
+    *value = strtoll(arg, &end, 0);
+    if (errno == ERANGE && arg[0] != '-')
+    {
+        errno = 0;
+        *value = (long long)strtoull(arg, &end, 0);
+    }
+    if (*end || errno)
+    {
+        fprintf(stderr, "[Error] printf: %s: invalid number\n", arg);
+        *status = 1;
+    }
+}
+
+static void printfDouble(const char * arg, double * value, int * status)
+{
+    char * end;
+    *value = 0;
+    if (!arg || !*arg)
+        return;
+    errno = 0;
+    *value = strtod(arg, &end);
+    if (*end || errno)
+    {
+        fprintf(stderr, "[Error] printf: %s: invalid number\n", arg);
+        *status = 1;
+    }
+}
+
+/*
+    * One pass of printf over its format, consuming arguments as conversions need them.
+    * INPUT: the output, the format, pointer to the next argument, pointer to the exit status
+    * OUTPUT: 1 when the output must stop (\c or an invalid directive), 0 otherwise
+*/
+static int printfFormat(Output * o, const char * format, char *** argp, int * status)
+{
+    const char * p;
+    int stop = 0;
+
+    for (p = format; *p && !stop; p++)
+    {
+        if (*p == '\\')
+        {
+            p += outEscape(o, p + 1, 0, &stop);
+            continue;
+        }
+        if (*p != '%')
+        {
+            const char * next = strpbrk(p, "\\%");
+            size_t len = next ? (size_t)(next - p) : strlen(p);
+            outBytes(o, p, len);
+            p += len - 1;
+            continue;
+        }
+        if (p[1] == '%')
+        {
+            outChar(o, '%');
+            p++;
+            continue;
+        }
+
+        // copy the directive, resolving '*' widths from the arguments
+        char spec[64];
+        size_t n = 0;
+        spec[n++] = *p++;
+        while (*p && strchr("-+ #0", *p) && n < 8)
+            spec[n++] = *p++;
+        for (int part = 0; part < 2; part++)
+        {
+            if (part == 1)
+            {
+                if (*p != '.')
+                    break;
+                spec[n++] = *p++;
+            }
+            if (*p == '*')
+            {
+                long long width;
+                printfInteger(**argp, &width, status);
+                if (**argp)
+                    (*argp)++;
+                n += snprintf(spec + n, 16, "%d", (int)width);
+                p++;
+            }
+            else
+                while (isdigit((unsigned char)*p) && n < 40)
+                    spec[n++] = *p++;
+        }
+
+        char * arg = **argp;
+        if (arg && *p && strchr("diouxXcsbeEfFgGaA", *p))
+            (*argp)++;
+
+        switch (*p)
+        {
+        case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+        {
+            long long value;
+            printfInteger(arg, &value, status);
+            spec[n++] = 'l';
+            spec[n++] = 'l';
+            spec[n++] = *p;
+            spec[n] = 0;
+            outPrintf(o, spec, value);
+            break;
+        }
+        case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+        {
+            double value;
+            printfDouble(arg, &value, status);
+            spec[n++] = *p;
+            spec[n] = 0;
+            outPrintf(o, spec, value);
+            break;
+        }
+        case 'c':
+            spec[n++] = 'c';
+            spec[n] = 0;
+            outPrintf(o, spec, arg ? arg[0] : 0);
+            break;
+        case 's':
+            spec[n++] = 's';
+            spec[n] = 0;
+            outPrintf(o, spec, arg ? arg : "");
+            break;
+        case 'b':
+            if (arg)
+                outEscaped(o, arg, &stop);
+            break;
+        default:
+            fprintf(stderr, "[Error] printf: %%%c: invalid directive\n", *p ? *p : ' ');
+            *status = 1;
+            return 1;
+        }
+    }
+    return stop;
+}
+
+/*
+    * "printf format [args...]": formatted output. The format is reused while arguments remain.
+    * INPUT: array of command's arguments, output descriptor
+    * OUTPUT: exit status
+*/
+static int runPrintf(char ** args, int out)
+{
+    char ** next;
+    int status = 0;
+    Output o;
+
+    if (!args[1])
+    {
+        fprintf(stderr, "[Error] Usage: printf format [arguments...]\n");
+        return 2;
+    }
+
+    outInit(&o, out);
+    next = args + 2;
+    while (1)
+    {
+        char ** before = next;
+        if (printfFormat(&o, args[1], &next, &status))
+            break;
+        // another pass only if this one consumed arguments and some are left
+        if (!*next || next == before)
+            break;
+    }
+    return outFinish(&o, "printf") ? 1 : status;
+}
+
+/*
+ * Recursive descent over the arguments of test: or := and (-o and)*, and := not (-a not)*, not := ! not | primary.
+*/
+typedef struct TestParser {
+    char ** argv;
+    int pos;
+    int end;
+    int error;
+} TestParser;
+
+static int testOr(TestParser * t);
+
+static int isTestBinary(const char * op)
+{
+    static const char * ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef", 0};
+    int i;
+    for (i = 0; ops[i]; i++)
+        if (strcmp(op, ops[i]) == 0)
+            return 1;
+    return 0;
+}
+
+static int isTestUnary(const char * op)
+{
+    return op[0] == '-' && op[1] && !op[2] && strchr("bcdefghkLnOpGrsStuwxz", op[1]);
+}
+
+static long long testInteger(TestParser * t, const char * str)
+{
+    char * end;
+    errno = 0;
+    long long value = strtoll(str, &end, 10);
+    if (end == str || *end || errno)
+    {
+        fprintf(stderr, "[Error] test: %s: integer expression expected\n", str);
+        t->error = 1;
+    }
+    return value;
+}
+
+/*
+    * Evaluate "left op right".
+    * INPUT: the parser, the operands and the binary operator
+    * OUTPUT: 1 if true, 0 otherwise
+*/
+static int testBinary(TestParser * t, const char * left, const char * op, const char * right)
+{
+    struct stat a, b;
+    int haveA, haveB;
+
+    if (op[0] != '-')
+    {
+        int cmp = strcmp(left, right);
+        if (op[0] == '<')
+            return cmp < 0;
+        if (op[0] == '>')
+            return cmp > 0;
+        return op[0] == '!' ? cmp != 0 : cmp == 0;
+    }
+
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0)
+    {
+        haveA = stat(left, &a) == 0;
+        haveB = stat(right, &b) == 0;
+        if (op[1] == 'e')
+            return haveA && haveB && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+        if (op[1] == 'o')
+        {
+            const char * s = left;
+            left = right;
+            right = s;
+            struct stat tmp = a;
+            a = b;
+            b = tmp;
+            int h = haveA;
+            haveA = haveB;
+            haveB = h;
+        }
+        if (!haveA)
+            return 0;
+        if (!haveB)
+            return 1;
+        return a.st_mtim.tv_sec > b.st_mtim.tv_sec ||
+            (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec > b.st_mtim.tv_nsec);
+    }
+
+    long long x = testInteger(t, left), y = testInteger(t, right);
+    if (strcmp(op, "-eq") == 0) return x == y;
+    if (strcmp(op, "-ne") == 0) return x != y;
+    if (strcmp(op, "-lt") == 0) return x < y;
+    if (strcmp(op, "-le") == 0) return x <= y;
+    if (strcmp(op, "-gt") == 0) return x > y;
+    return x >= y;
+}
+
+/*
+    * Evaluate "-op operand".
+    * INPUT: the parser, the operator letter and the operand
+    * OUTPUT: 1 if true, 0 otherwise
+*/
+static int testUnary(TestParser * t, char op, const char * arg)
+{
+    struct stat st;
+
+    switch (op)
+    {
+    case 'z': return arg[0] == 0;
+    case 'n': return arg[0] != 0;
+    case 't': return isatty((int)testInteger(t, arg));
+    case 'h': case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    case 'r': return faccessat(AT_FDCWD, arg, R_OK, AT_EACCESS) == 0;
+    case 'w': return faccessat(AT_FDCWD, arg, W_OK, AT_EACCESS) == 0;
+    case 'x': return faccessat(AT_FDCWD, arg, X_OK, AT_EACCESS) == 0;
+    }
+
+    if (stat(arg, &st) != 0)
+        return 0;
+    switch (op)
+    {
+    case 'e': return 1;
+    case 'f': return S_ISREG(st.st_mode);
+    case 'd': return S_ISDIR(st.st_mode);
+    case 'b': return S_ISBLK(st.st_mode);
+    case 'c': return S_ISCHR(st.st_mode);
+    case 'p': return S_ISFIFO(st.st_mode);
+    case 'S': return S_ISSOCK(st.st_mode);
+    case 's': return st.st_size > 0;
+    case 'g': return (st.st_mode & S_ISGID) != 0;
+    case 'u': return (st.st_mode & S_ISUID) != 0;
+    case 'k': return (st.st_mode & S_ISVTX) != 0;
+    case 'O': return st.st_uid == geteuid();
+    case 'G': return st.st_gid == getegid();
+    }
+    return 0;
+}
+
+static int testPrimary(TestParser * t)
+{
+    char ** argv = t->argv;
+
+    if (t->pos >= t->end)
+    {
+        fprintf(stderr, "[Error] test: argument expected\n");
+        t->error = 1;
+        return 0;
+    }
+
+    // a binary operator in second position wins, so that "test ( = (" and "test -f = x" compare strings
+    if (t->pos + 2 < t->end && isTestBinary(argv[t->pos + 1]))
+    {
+        t->pos += 3;
+        return testBinary(t, argv[t->pos - 3], argv[t->pos - 2], argv[t->pos - 1]);
+    }
+    if (strcmp(argv[t->pos], "(") == 0 && t->pos + 1 < t->end)
+    {
+        t->pos++;
+        int value = testOr(t);
+        if (t->pos >= t->end || strcmp(argv[t->pos], ")") != 0)
+        {
+            fprintf(stderr, "[Error] test: ')' expected\n");
+            t->error = 1;
+            return 0;
+        }
+        t->pos++;
+        return value;
+    }
+    if (isTestUnary(argv[t->pos]) && t->pos + 1 < t->end)
+    {
+        t->pos += 2;
+        return testUnary(t, argv[t->pos - 2][1], argv[t->pos - 1]);
+    }
+
+    // a lone word is true when not empty
+    return argv[t->pos++][0] != 0;
+}
+
+static int testNot(TestParser * t)
+{
+    if (t->pos + 1 < t->end && strcmp(t->argv[t->pos], "!") == 0)
+    {
+        t->pos++;
+        return !testNot(t);
+    }
+    return testPrimary(t);
+}
+
+static int testAnd(TestParser * t)
+{
+    int value = testNot(t);
+    while (!t->error && t->pos < t->end && strcmp(t->argv[t->pos], "-a") == 0)
+    {
+        t->pos++;
+        value = testNot(t) && value;
+    }
+    return value;
+}
+
+static int testOr(TestParser * t)
+{
+    int value = testAnd(t);
+    while (!t->error && t->pos < t->end && strcmp(t->argv[t->pos], "-o") == 0)
+    {
+        t->pos++;
+        value = testAnd(t) || value;
+    }
+    return value;
+}
+
+/*
+    * "test expression" and "[ expression ]": file, string and integer checks.
+    * INPUT: array of command's arguments, output descriptor
+    * OUTPUT: 0 if the expression is true, 1 if it is false, 2 on a syntax error
+*/
+static int runTest(char ** args, int out)
+{
+    TestParser t;
+
+    t.argv = args;
+    t.pos = 1;
+    t.end = getNumArgs(args);
+    t.error = 0;
+    if (strcmp(args[0], "[") == 0)
+    {
+        if (t.end < 2 || strcmp(args[t.end - 1], "]") != 0)
+        {
+            fprintf(stderr, "[Error] [: missing ]\n");
+            return 2;
+        }
+        t.end--;
+    }
+
+    if (t.pos == t.end)
+        return 1; // no expression is false
+    int value = testOr(&t);
+    if (!t.error && t.pos != t.end)
+    {
+        fprintf(stderr, "[Error] test: %s: unexpected argument\n", args[t.pos]);
+        t.error = 1;
+    }
+    return t.error ? 2 : !value;
+}
+
+/*
+    * "exec command [args...]": replace the shell with the command, keeping its descriptors (and redirections).
+    * INPUT: array of command's arguments, output descriptor
+    * OUTPUT: exit status when the command could not be executed (the shell goes on), does not return otherwise
+*/
+static int runExec(char ** args, int out)
+{
+    struct sigaction savedTtou, savedChld;
+    sigset_t savedMask;
+
+    if (!args[1])
+        return 0;
+    char * path = hashLookup(args[1]);
+    if (!path)
+    {
+        fprintf(stderr, "[Error] exec: %s: command not found\n", args[1]);
+        return 127;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    sigaction(SIGTTOU, 0, &savedTtou);
+    sigaction(SIGCHLD, 0, &savedChld);
+    sigprocmask(SIG_SETMASK, 0, &savedMask);
+    resetChildSignals();
+    execve(path, args + 1, environ);
+
+    // still here: put the shell's own signal setup back
+    int err = errno;
+    sigaction(SIGTTOU, &savedTtou, 0);
+    sigaction(SIGCHLD, &savedChld, 0);
+    sigprocmask(SIG_SETMASK, &savedMask, 0);
+    if (path != args[1])
+        hashForget(args[1]);
+    fprintf(stderr, "[Error] exec: %s: %s\n", args[1], strerror(err));
+    return err == ENOENT ? 127 : 126;
+}
+
+/*
+    * "pipestatus": print the exit status of every stage of the last pipeline.
+    * INPUT: array of command's arguments, output descriptor
+    * OUTPUT: exit status
+*/
+static int runPipeStatus(char ** args, int out)
+{
+    Output o;
+    int i;
+    outInit(&o, out);
+    for (i = 0; i < numPipeStatus; i++)
+        outPrintf(&o, i ? " %d" : "%d", pipeStatus[i]);
+    outChar(&o, '\n');
+    return outFinish(&o, "pipestatus");
+}
+
+/*
+    * "hash [-r]": list the remembered command paths, -r forgets them.
+    * INPUT: array of command's arguments, output descriptor
+    * OUTPUT: exit status
+*/
+static int runHash(char ** args, int out)
+{
+    if (args[1] && strcmp(args[1], "-r") == 0)
+        hashClear();
+    else
+        hashPrint();
+    return 0;
+}
+
+/*
+    * "set [name=value...]": without arguments list the options, otherwise apply every name=value.
+    * INPUT: array of command's arguments, output descriptor
+    * OUTPUT: exit status
+*/
+static int runSet(char ** args, int out)
+{
+    int i;
+    if (args[1] == NULL) {
+        printOptions();
+        return 0;
+    }
+    for (i = 1; args[i]; i++)
+        if (!setOption(args[i]))
+            return 1;
+    return 0;
+}
+
+// the jobs, bg, kill and history builtins report 1 on success
+static int runJobs(char ** args, int out) { return !builtinJobs(args); }
+static int runBg(char ** args, int out) { return !builtinBg(args); }
+static int runKill(char ** args, int out) { return !builtinKill(args); }
+static int runHistory(char ** args, int out) { return !builtinHistory(args); }
+
+static int runEnable(char ** args, int out);
+
+/*
+ * Every builtin of the shell.
+*/
+static Builtin builtins[] = {
+    {"cd", runCd, 0, 0}, {"pwd", runPwd, 1, 0}, {"echo", runEcho, 1, 0}, {"printf", runPrintf, 1, 0},
+    {"true", runTrue, 1, 0}, {"false", runFalse, 1, 0}, {":", runTrue, 1, 0}, {"test", runTest, 1, 0},
+    {"[", runTest, 1, 0}, {"exec", runExec, 0, 0}, {"enable", runEnable, 0, 0}, {"pipestatus", runPipeStatus, 0, 0},
+    {"hash", runHash, 0, 0}, {"set", runSet, 0, 0}, {"jobs", runJobs, 0, 0}, {"wait", builtinWait, 0, 0},
+    {"fg", builtinFg, 0, 0}, {"bg", runBg, 0, 0}, {"kill", runKill, 0, 0}, {"parallel", builtinParallel, 0, 0},
+    {"history", runHistory, 0, 0}, {"cache", cacheCommand, 0, 0},
+    {0, 0, 0, 0}
+};
+
+/*
+ * Perfect hash of the builtin names: slot = hash(seed, name), with a seed chosen by builtinsInit() so that no two
+ * names share a slot. A lookup is one hash and at most one strcmp, whatever the name.
+*/
+static Builtin * slots[BUILTIN_SLOTS];
+static unsigned int slotSeed;
+
+static unsigned int slotOf(unsigned int seed, const char * name)
+{
+    unsigned int h = 2166136261u ^ seed;
+    while (*name)
+    {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return (h ^ (h >> 15)) & (BUILTIN_SLOTS - 1);
+}
+
+/*
+    * Search a seed for which every builtin name lands in its own slot, and fill the table.
+    * INPUT: void
+    * OUTPUT: void
+    * NOTE: Called once by shInit(); the names are fixed, so the search always ends after a few dozen seeds.
+*/
+void builtinsInit()
+{
+    unsigned int seed;
+    for (seed = 0; ; seed++)
+    {
+        Builtin * b;
+        memset(slots, 0, sizeof(slots));
+        for (b = builtins; b->name; b++)
+        {
+            unsigned int slot = slotOf(seed, b->name);
+            if (slots[slot])
+                break;
+            slots[slot] = b;
+        }
+        if (!b->name)
+            break;
+    }
+    slotSeed = seed;
+}
+
+static Builtin * lookupBuiltin(const char * name)
+{
+    Builtin * b = slots[slotOf(slotSeed, name)];
+    return b && strcmp(b->name, name) == 0 ? b : 0;
+}
+
+/*
+    * Find the builtin of a command name.
+    * INPUT: string of the name
+    * OUTPUT: the builtin, NULL if there is none or it was disabled with "enable -n"
+*/
+Builtin * findBuiltin(const char * name)
+{
+    Builtin * b = lookupBuiltin(name);
+    return b && !b->disabled ? b : 0;
+}
+
+/*
+    * "enable [-n] [name...]": -n disables builtins so that the names run the external commands, without -n they are
+    * enabled again. Without names, list every builtin with its state.
+    * INPUT: array of command's arguments, output descriptor
+    * OUTPUT: exit status
+*/
+static int runEnable(char ** args, int out)
+{
+    int disable = 0, status = 0, i = 1;
+    Output o;
+
+    if (args[1] && strcmp(args[1], "-n") == 0)
+    {
+        disable = 1;
+        i++;
+    }
+    if (!args[i])
+    {
+        Builtin * b;
+        outInit(&o, out);
+        for (b = builtins; b->name; b++)
+            outPrintf(&o, "enable %s%s\n", b->disabled ? "-n " : "", b->name);
+        return outFinish(&o, "enable");
+    }
+
+    for (; args[i]; i++)
+    {
+        Builtin * b = lookupBuiltin(args[i]);
+        if (!b)
+        {
+            fprintf(stderr, "[Error] enable: %s: not a shell builtin\n", args[i]);
+            status = 1;
+            continue;
+        }
+        b->disabled = disable;
+    }
+    return status;
+}
@@ -0,0 +1,17 @@
+#pragma once
+#define BUILTIN_SLOTS 64 // size of the perfect-hash dispatch table (a power of two)
+#define BUILTIN_BUFFER 4096 // bytes of output a builtin collects before each write()
+
+/*
+ * A command run inside the shell process. run() gets the arguments and the descriptor standing for its STDOUT,
+ * and returns an exit status like an external command would.
+*/
+typedef struct Builtin {
+    const char * name;
+    int (*run)(char ** args, int out);
+    int pure; // touches no shell state and writes only to out: may run on a helper thread inside a pipeline
+    int disabled; // set by "enable -n": the name falls through to the external binary
+} Builtin;
+
+void builtinsInit();
+Builtin * findBuiltin(const char * name);
@@ -0,0 +1,538 @@
+#define _GNU_SOURCE
+#include "cache.h"
+#include "sha256.h"
+#include "builtins.h"
+#include "process.h"
+#include "options.h"
+#include "mover.h"
+#include "hash.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define HEX_SIZE (2 * SHA256_SIZE + 1)
+#define CACHE_DIR_MAX (PATH_MAX - 128) // room left in a path for /objects/ and a name
+
+/*
+ * An object of the store, as seen by the eviction scan.
+*/
+typedef struct CacheObject {
+    char name[HEX_SIZE];
+    struct timespec used; // mtime, refreshed on every hit
+    long long size;
+} CacheObject;
+
+static char cacheDir[CACHE_DIR_MAX]; // empty until the store is opened
+static long long cacheBytes = 0; // size of every object of the store, as last counted plus what this shell added
+
+static unsigned long cacheHits = 0;
+static unsigned long cacheMisses = 0;
+static unsigned long cacheBypassed = 0; // commands that could not be keyed, run without the cache
+static unsigned long cacheStored = 0;
+static unsigned long cacheEvicted = 0;
+static long long cacheServed = 0; // bytes served from the store
+
+/*
+    * Create a directory unless it exists.
+    * INPUT: path
+    * OUTPUT: 1 if the directory is there, 0 otherwise
+*/
+static int makeDir(const char * path)
+{
+    if (mkdir(path, 0700) == 0 || errno == EEXIST)
+        return 1;
+    fprintf(stderr, "[Error] cache: %s: %s\n", path, strerror(errno));
+    return 0;
+}
+
+/*
+    * Open the store on first use: $PLTSH_CACHE_DIR, $XDG_CACHE_HOME/pltsh or ~/.cache/pltsh, with its objects/ and
+    * keys/ directories, and add up the size of the objects already there.
+    * INPUT: void
+    * OUTPUT: 1 if the store can be used, 0 otherwise
+*/
+static int cacheOpen()
+{
+    char path[CACHE_DIR_MAX], sub[PATH_MAX];
+    char * dir;
+
+    if (cacheDir[0])
+        return 1;
+
+    if ((dir = getenv("PLTSH_CACHE_DIR")) && *dir)
+        snprintf(path, sizeof(path), "%s", dir);
+    else if ((dir = getenv("XDG_CACHE_HOME")) && *dir)
+        snprintf(path, sizeof(path), "%s/" CACHE_DIR, dir);
+    else if ((dir = getenv("HOME")) && *dir)
+    {
+        snprintf(path, sizeof(path), "%s/.cache", dir);
+        if (!makeDir(path))
+            return 0;
+        snprintf(path, sizeof(path), "%s/.cache/" CACHE_DIR, dir);
+    }
+    else
+    {
+        fprintf(stderr, "[Error] cache: no store directory, set PLTSH_CACHE_DIR\n");
+        return 0;
+    }
+
+    snprintf(sub, sizeof(sub), "%s/objects", path);
+    if (!makeDir(path) || !makeDir(sub))
+        return 0;
+    snprintf(sub, sizeof(sub), "%s/keys", path);
+    if (!makeDir(sub))
+        return 0;
+
+    snprintf(sub, sizeof(sub), "%s/objects", path);
+    DIR * d = opendir(sub);
+    struct dirent * entry;
+    struct stat st;
+    cacheBytes = 0;
+    while (d && (entry = readdir(d)))
+        if (entry->d_name[0] != '.' && fstatat(dirfd(d), entry->d_name, &st, 0) == 0)
+            cacheBytes += st.st_size;
+    if (d)
+        closedir(d);
+
+    strcpy(cacheDir, path);
+    return 1;
+}
+
+/*
+    * Feed the identity of a file into the key: a rewrite, a replacement or a touch changes it.
+    * INPUT: the key computation, status of the file
+    * OUTPUT: void
+*/
+static void hashIdentity(Sha256 * s, struct stat * st)
+{
+    long long id[7] = {
+        (long long)st->st_dev, (long long)st->st_ino, (long long)st->st_size,
+        (long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec, (long long)st->st_ctim.tv_sec, st->st_ctim.tv_nsec
+    };
+    sha256Update(s, id, sizeof(id));
+}
+
+/*
+    * Key of a command: working directory, the command's binary, the arguments with the identity of those naming a
+    * file, the selected environment variables and the identity of STDIN when it is a file ("<" redirection).
+    * INPUT: array of command's arguments, buffer receiving the key in hex
+    * OUTPUT: 1 if the command can be keyed, 0 if its result depends on something the key can not capture
+    *         (STDIN is a pipe, the command does not exist)
+*/
+static int cacheKey(char ** args, char key[HEX_SIZE])
+{
+    unsigned char digest[SHA256_SIZE];
+    char cwd[PATH_MAX];
+    struct stat st;
+    Sha256 s;
+    int i;
+
+    sha256Init(&s);
+    sha256Update(&s, "pltsh-cache-1", 14);
+
+    // relative names, and commands without operands, depend on the working directory
+    if (getcwd(cwd, sizeof(cwd)))
+        sha256Update(&s, cwd, strlen(cwd) + 1);
+
+    // a builtin by name, an external command by the identity of its binary: an upgrade changes the key
+    if (!findBuiltin(args[0]))
+    {
+        char * path = hashLookup(args[0]);
+        if (!path || stat(path, &st) != 0)
+            return 0;
+        sha256Update(&s, path, strlen(path) + 1);
+        hashIdentity(&s, &st);
+    }
+
+    for (i = 0; args[i]; i++)
+    {
+        sha256Update(&s, args[i], strlen(args[i]) + 1);
+        if (i > 0 && stat(args[i], &st) == 0)
+            hashIdentity(&s, &st);
+        else
+            sha256Update(&s, "", 1);
+    }
+
+    const char * names = getenv("PLTSH_CACHE_ENV");
+    if (!names)
+        names = CACHE_ENV;
+    while (*names)
+    {
+        const char * colon = strchrnul(names, ':');
+        char name[256];
+        snprintf(name, sizeof(name), "%.*s", (int)(colon - names), names);
+        char * value = getenv(name);
+        sha256Update(&s, name, strlen(name) + 1);
+        if (value)
+            sha256Update(&s, value, strlen(value) + 1);
+        else
+            sha256Update(&s, "\1unset", 7);
+        names = *colon ? colon + 1 : colon;
+    }
+
+    // a file is keyed by identity and read offset, a terminal or /dev/null by device; a pipe can not be keyed
+    if (fstat(STDIN_FILENO, &st) == 0)
+    {
+        if (S_ISREG(st.st_mode))
+        {
+            long long offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+            hashIdentity(&s, &st);
+            sha256Update(&s, &offset, sizeof(offset));
+        }
+        else if (S_ISCHR(st.st_mode))
+            sha256Update(&s, &st.st_rdev, sizeof(st.st_rdev));
+        else
+            return 0;
+    }
+
+    sha256Final(&s, digest);
+    sha256Hex(digest, key);
+    return 1;
+}
+
+/*
+    * Read the entry of a key: "status object".
+    * INPUT: key in hex, pointers to the status and the object name
+    * OUTPUT: 1 if the key is in the store, 0 otherwise
+*/
+static int cacheLookup(const char * key, int * status, char object[HEX_SIZE])
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/keys/%s", cacheDir, key);
+    FILE * f = fopen(path, "re");
+    if (!f)
+        return 0;
+    int found = fscanf(f, "%d %64s", status, object) == 2 && strlen(object) == HEX_SIZE - 1;
+    fclose(f);
+    return found;
+}
+
+/*
+    * Content address of the output: SHA-256 of the file.
+    * INPUT: descriptor of the file, buffer receiving the hex digest
+    * OUTPUT: 1 if successful, 0 on a read error
+*/
+static int hashFile(int fd, char hex[HEX_SIZE])
+{
+    unsigned char digest[SHA256_SIZE];
+    char * buffer = malloc(READ_CHUNK);
+    off_t offset = 0;
+    Sha256 s;
+    ssize_t n;
+
+    if (!checkMemoryValid(buffer))
+        exit(EXIT_FAILURE);
+    sha256Init(&s);
+    while ((n = pread(fd, buffer, READ_CHUNK, offset)) != 0)
+    {
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            free(buffer);
+            return 0;
+        }
+        sha256Update(&s, buffer, n);
+        offset += n;
+    }
+    free(buffer);
+    sha256Final(&s, digest);
+    sha256Hex(digest, hex);
+    return 1;
+}
+
+static int compareUse(const void * a, const void * b)
+{
+    const struct timespec * x = &((const CacheObject *)a)->used;
+    const struct timespec * y = &((const CacheObject *)b)->used;
+    if (x->tv_sec != y->tv_sec)
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+    return x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec;
+}
+
+/*
+    * Remove the least recently used objects until the store fits in optCacheSize, then the keys left without object.
+    * INPUT: void
+    * OUTPUT: void
+*/
+static void cacheEvict()
+{
+    char path[PATH_MAX];
+    CacheObject * objects = 0;
+    size_t count = 0, capacity = 0, i;
+    struct dirent * entry;
+    struct stat st;
+    DIR * d;
+
+    snprintf(path, sizeof(path), "%s/objects", cacheDir);
+    if (!(d = opendir(path)))
+        return;
+    cacheBytes = 0; // recounted: other shells share the store
+    while ((entry = readdir(d)))
+    {
+        if (entry->d_name[0] == '.' || strlen(entry->d_name) != HEX_SIZE - 1 || fstatat(dirfd(d), entry->d_name, &st, 0) != 0)
+            continue;
+        if (count == capacity)
+        {
+            capacity = capacity ? 2 * capacity : 64;
+            objects = realloc(objects, capacity * sizeof(CacheObject));
+            if (!checkMemoryValid(objects))
+                exit(EXIT_FAILURE);
+        }
+        strcpy(objects[count].name, entry->d_name);
+        objects[count].used = st.st_mtim;
+        objects[count].size = st.st_size;
+        cacheBytes += st.st_size;
+        count++;
+    }
+
+    qsort(objects, count, sizeof(CacheObject), compareUse);
+    int evicted = 0;
+    for (i = 0; i < count && cacheBytes > optCacheSize; i++)
+    {
+        if (unlinkat(dirfd(d), objects[i].name, 0) == 0)
+        {
+            cacheBytes -= objects[i].size;
+            cacheEvicted++;
+            evicted = 1;
+        }
+    }
+    free(objects);
+
+    // keys whose object went away
+    if (evicted)
+    {
+        char keys[PATH_MAX];
+        DIR * k;
+        snprintf(keys, sizeof(keys), "%s/keys", cacheDir);
+        if ((k = opendir(keys)))
+        {
+            while ((entry = readdir(k)))
+            {
+                char object[HEX_SIZE];
+                int status;
+                if (entry->d_name[0] == '.')
+                    continue;
+                if (!cacheLookup(entry->d_name, &status, object) || faccessat(dirfd(d), object, F_OK, 0) != 0)
+                    unlinkat(dirfd(k), entry->d_name, 0);
+            }
+            closedir(k);
+        }
+    }
+    closedir(d);
+}
+
+/*
+    * Add the output of a command to the store under its content address, and point the key at it.
+    * INPUT: descriptor and path of the temporary file holding the output, key in hex, exit status
+    * OUTPUT: void (the temporary name is gone afterwards, the descriptor stays open)
+*/
+static void cacheStore(int fd, const char * tmpPath, const char * key, int status)
+{
+    char object[HEX_SIZE], path[PATH_MAX], keyTmp[PATH_MAX];
+    struct stat st;
+
+    if (!hashFile(fd, object) || fstat(fd, &st) != 0)
+    {
+        unlink(tmpPath);
+        return;
+    }
+
+    // identical output already stored: keep that copy, marked as just used
+    snprintf(path, sizeof(path), "%s/objects/%s", cacheDir, object);
+    if (utimensat(AT_FDCWD, path, 0, 0) == 0)
+        unlink(tmpPath);
+    else if (rename(tmpPath, path) == 0)
+        cacheBytes += st.st_size;
+    else
+    {
+        unlink(tmpPath);
+        return;
+    }
+
+    // the key entry is written aside and renamed: a reader never sees half of it
+    snprintf(keyTmp, sizeof(keyTmp), "%s/keys/.tmp.XXXXXX", cacheDir);
+    int keyFd = mkostemp(keyTmp, O_CLOEXEC);
+    if (keyFd == -1)
+        return;
+    dprintf(keyFd, "%d %s\n", status, object);
+    close(keyFd);
+    snprintf(path, sizeof(path), "%s/keys/%s", cacheDir, key);
+    if (rename(keyTmp, path) == 0)
+        cacheStored++;
+    else
+        unlink(keyTmp);
+
+    if (cacheBytes > optCacheSize)
+        cacheEvict();
+}
+
+/*
+    * Send an object to the output with moveData (sendfile, splice or copy_file_range), and mark it as just used.
+    * INPUT: object name in hex, output descriptor, pointer set to the exit status of the copy
+    * OUTPUT: 1 if served, 0 if the object is missing
+*/
+static int cacheServe(const char * object, int out, int * status)
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/objects/%s", cacheDir, object);
+    if (utimensat(AT_FDCWD, path, 0, 0) != 0 || stat(path, &st) != 0)
+        return 0;
+
+    char * files[] = {path, 0};
+    fflush(stdout);
+    *status = catFiles(files, STDIN_FILENO, out);
+    if (*status == 0)
+        cacheServed += st.st_size;
+    return 1;
+}
+
+/*
+    * Remove every object and key.
+    * INPUT: void
+    * OUTPUT: void
+*/
+static void cacheClear()
+{
+    const char * subs[] = {"objects", "keys"};
+    int i;
+    for (i = 0; i < 2; i++)
+    {
+        char path[PATH_MAX];
+        struct dirent * entry;
+        DIR * d;
+        snprintf(path, sizeof(path), "%s/%s", cacheDir, subs[i]);
+        if (!(d = opendir(path)))
+            continue;
+        while ((entry = readdir(d)))
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+                unlinkat(dirfd(d), entry->d_name, 0);
+        closedir(d);
+    }
+    cacheBytes = 0;
+}
+
+/*
+    * Print the store and the counters of the session.
+    * INPUT: output descriptor
+    * OUTPUT: void
+*/
+static void cacheStats(int out)
+{
+    char path[PATH_MAX];
+    struct dirent * entry;
+    struct stat st;
+    long objects = 0, keys = 0;
+    DIR * d;
+
+    // counted on disk: other shells share the store
+    cacheBytes = 0;
+    snprintf(path, sizeof(path), "%s/objects", cacheDir);
+    if ((d = opendir(path)))
+    {
+        while ((entry = readdir(d)))
+        {
+            if (entry->d_name[0] != '.' && fstatat(dirfd(d), entry->d_name, &st, 0) == 0)
+            {
+                objects++;
+                cacheBytes += st.st_size;
+            }
+        }
+        closedir(d);
+    }
+    snprintf(path, sizeof(path), "%s/keys", cacheDir);
+    if ((d = opendir(path)))
+    {
+        while ((entry = readdir(d)))
+            keys += entry->d_name[0] != '.';
+        closedir(d);
+    }
+
+    dprintf(out, "store: %s\n", cacheDir);
+    dprintf(out, "objects: %ld, %lld of %ld bytes\n", objects, cacheBytes, optCacheSize);
+    dprintf(out, "keys: %ld\n", keys);
+    dprintf(out, "hits: %lu (%lld bytes served)\n", cacheHits, cacheServed);
+    dprintf(out, "misses: %lu, stored: %lu, evicted: %lu, uncacheable: %lu\n", cacheMisses, cacheStored, cacheEvicted, cacheBypassed);
+}
+
+/*
+    * "cache command [args...]": serve the stdout and exit status of a read-only command from the store when its key
+    * (see cacheKey) was seen before, otherwise run it, store the result and serve it. STDERR is not stored.
+    * "cache stats" reports the store, "cache clear" empties it, "cache -- stats" runs a command named stats.
+    * INPUT: array of command's arguments, output descriptor
+    * OUTPUT: exit status of the command (stored or fresh)
+    * NOTE: the output of a miss reaches the output once the command is done, from the store.
+*/
+int cacheCommand(char ** args, int out)
+{
+    char key[HEX_SIZE], object[HEX_SIZE];
+    int status;
+
+    if (!args[1])
+    {
+        fprintf(stderr, "[Error] Usage: cache [stats|clear|--] command [args...]\n");
+        return 2;
+    }
+    if (!cacheOpen())
+        return processSimpleCommand(args + 1, -1);
+    if (strcmp(args[1], "stats") == 0 && !args[2])
+    {
+        cacheStats(out);
+        return 0;
+    }
+    if (strcmp(args[1], "clear") == 0 && !args[2])
+    {
+        cacheClear();
+        return 0;
+    }
+    args += strcmp(args[1], "--") == 0 ? 2 : 1;
+    if (!args[0])
+        return 0;
+
+    if (!cacheKey(args, key))
+    {
+        cacheBypassed++;
+        return processSimpleCommand(args, -1);
+    }
+
+    int stored;
+    if (cacheLookup(key, &stored, object) && cacheServe(object, out, &status))
+    {
+        cacheHits++;
+        return status ? status : stored;
+    }
+    cacheMisses++;
+
+    // run the command with its STDOUT in a new file of the store
+    char tmpPath[PATH_MAX];
+    snprintf(tmpPath, sizeof(tmpPath), "%s/objects/.tmp.XXXXXX", cacheDir);
+    int fd = mkostemp(tmpPath, O_CLOEXEC);
+    if (fd == -1)
+    {
+        fprintf(stderr, "[Error] cache: %s: %s\n", tmpPath, strerror(errno));
+        return processSimpleCommand(args, -1);
+    }
+    status = processSimpleCommand(args, fd);
+
+    // a command that could not run or was killed is not a result: pass the output on, keep nothing
+    if (status < 126)
+        cacheStore(fd, tmpPath, key, status);
+    else
+        unlink(tmpPath);
+
+    // serve from the descriptor: the file may have been renamed, deduplicated or evicted meanwhile
+    char * fromFile[] = {"-", 0};
+    lseek(fd, 0, SEEK_SET);
+    int copied = catFiles(fromFile, fd, out);
+    close(fd);
+    return copied ? copied : status;
+}
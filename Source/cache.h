@@ -0,0 +1,6 @@
+#pragma once
+#define CACHE_DEFAULT_SIZE (256L << 20) // bytes of stored output kept before the least recently used objects go
+#define CACHE_DIR "pltsh" // store under $XDG_CACHE_HOME or ~/.cache, unless $PLTSH_CACHE_DIR is set
+#define CACHE_ENV "PATH:LANG:LC_ALL:LC_COLLATE:LC_CTYPE:LC_NUMERIC:TZ" // variables in the key, unless $PLTSH_CACHE_ENV lists others
+
+int cacheCommand(char ** args, int out);
@@ -0,0 +1,904 @@
+#define _GNU_SOURCE
+#include "expand.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+/*
+ * Record of getdents64(), as the kernel writes it.
+*/
+typedef struct Dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} Dirent64;
+
+/*
+ * Entries of a directory but "." and "..": every entry is its d_type byte, the length of its name (at most 255), the
+ * name and a terminator. A listing of the cache also remembers the directory it was read from.
+*/
+typedef struct Listing {
+    char * data;
+    size_t size;
+    size_t cap;
+    char * path; // directory, set for a listing of the cache
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime; // modification time of the directory when it was read: the listing is valid while it is the same
+    unsigned long used; // lookup clock of the last use, the smallest is evicted
+    int refs; // expansions going through the listing: it is not evicted meanwhile
+} Listing;
+
+/*
+ * One pattern being expanded and the paths it matched so far. Every walker thread of a "**" has its own copy.
+*/
+typedef struct Glob {
+    char ** segments; // pattern split at '/', empty segments left out
+    int numSegments;
+    int dirsOnly; // the pattern ends with '/': only directories match, written with their '/'
+    int walking; // a "**" is being walked by threads: a "**" met inside it is walked on the thread that meets it
+    Arena * arena; // receives the paths
+    char ** matches; // malloc'd
+    int numMatches;
+    int capMatches;
+    char * dents; // getdents64() buffer of the thread, GLOB_DENTS_SIZE bytes
+} Glob;
+
+/*
+ * Directories left to walk by the threads of a "**", with the number of directories queued or being walked.
+*/
+typedef struct WalkQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    char ** dirs; // malloc'd paths
+    int count;
+    int cap;
+    int pending;
+    int seg; // first segment after the "**"
+} WalkQueue;
+
+/*
+ * A helper thread of a "**" walk, with its own pattern state and arena.
+*/
+typedef struct Walker {
+    Glob glob;
+    Arena arena;
+    WalkQueue * queue;
+    pthread_t thread;
+} Walker;
+
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER; // the cache and its counters, shared by the walker threads
+static Listing * listingCache[GLOB_CACHE_DIRS];
+static int numCached = 0;
+static size_t cachedBytes = 0;
+static unsigned long listingClock = 0;
+static char * shellDents = 0;
+
+unsigned long globCacheHits = 0;
+unsigned long globCacheMisses = 0;
+char ** expandedArgs = 0;
+int expandedFirst = 0;
+int expandedEnd = 0;
+
+static void expandSegment(Glob * g, const char * path, int seg);
+
+/*
+    * Match one byte against a bracket expression: "[abc]", "[a-z]", "[!...]" or "[^...]". A "]" right after the
+    * opening bracket (or its negation) is a member.
+    * INPUT: the expression, starting at its '[', the byte
+    * OUTPUT: length of the expression if the byte matches, minus its length if not, 0 when the bracket is not closed
+*/
+static int matchBracket(const char * p, unsigned char c)
+{
+    int i = 1, negate = 0, found = 0;
+    if (p[i] == '!' || p[i] == '^')
+    {
+        negate = 1;
+        i++;
+    }
+
+    int first = i;
+    while (p[i] && (p[i] != ']' || i == first))
+    {
+        unsigned char lo = p[i];
+        if (lo == '\\' && p[i+1])
+            lo = p[++i];
+        unsigned char hi = lo;
+        if (p[i+1] == '-' && p[i+2] && p[i+2] != ']')
+        {
+            i += 2;
+            hi = p[i];
+            if (hi == '\\' && p[i+1])
+                hi = p[++i];
+        }
+        if (c >= lo && c <= hi)
+            found = 1;
+        i++;
+    }
+    if (!p[i])
+        return 0;
+    i++; // the closing bracket
+    return found != negate ? i : -i;
+}
+
+/*
+    * Match a name against one segment of a pattern: "*" is any string, "?" any byte, "[...]" a set of bytes and a
+    * backslash makes the next byte literal. A "*" that fails is retried one byte further, never recursively.
+    * INPUT: the pattern, the name
+    * OUTPUT: 1 if the name matches, 0 otherwise
+*/
+int globMatch(const char * pattern, const char * name)
+{
+    const char * p = pattern, * s = name;
+    const char * starP = 0, * starS = 0;
+    while (*s)
+    {
+        int step; // bytes of the pattern matching *s, 0 on a mismatch
+        if (*p == '*')
+        {
+            starP = ++p;
+            starS = s;
+            continue;
+        }
+        if (*p == '?')
+            step = 1;
+        else if (*p == '[' && (step = matchBracket(p, *s)) != 0)
+            step = step > 0 ? step : 0;
+        else if (*p == '\\' && p[1])
+            step = p[1] == *s ? 2 : 0;
+        else
+            step = *p == *s;
+
+        if (step)
+        {
+            p += step;
+            s++;
+            continue;
+        }
+        if (!starP)
+            return 0;
+        p = starP;
+        s = ++starS;
+    }
+    while (*p == '*')
+        p++;
+    return !*p;
+}
+
+/*
+    * Check if a segment of a pattern has a wildcard.
+    * INPUT: the segment
+    * OUTPUT: 1 if it has, 0 if it is a plain name
+*/
+static int hasMeta(const char * s)
+{
+    for (; *s; s++)
+    {
+        if (*s == '\\' && s[1])
+            s++;
+        else if (*s == '*' || *s == '?' || *s == '[')
+            return 1;
+    }
+    return 0;
+}
+
+/*
+    * Turn a word into a glob pattern: quotes are removed and the quoted bytes special to a pattern are escaped.
+    * INPUT: arena of the command line, the word, pointer set to 1 when the word has an unquoted "*", "?" or "["
+    * OUTPUT: the pattern
+*/
+static char * toPattern(Arena * arena, const char * word, int * meta)
+{
+    char * out = arenaAlloc(arena, 2 * strlen(word) + 1);
+    char * p = out;
+    char quote = 0;
+
+    *meta = 0;
+    for (; *word; word++)
+    {
+        char c = *word;
+        int literal = quote != 0; // quoted or escaped
+        if (quote != '\'' && c == '\\' && word[1] && (!quote || strchr("\"\\$`", word[1])))
+        {
+            c = *++word;
+            literal = 1;
+        }
+        else if (quote == '\'' ? c == '\'' : c == '"' || (c == '\'' && !quote))
+        {
+            quote = quote ? 0 : c;
+            continue;
+        }
+        else if (!quote && (c == '*' || c == '?' || c == '['))
+        {
+            *meta = 1;
+            *p++ = c;
+            continue;
+        }
+        if (literal && strchr("*?[]\\", c))
+            *p++ = '\\';
+        *p++ = c;
+    }
+    *p = 0;
+    return out;
+}
+
+/*
+    * Remove the backslashes of a plain segment.
+    * INPUT: arena, the segment
+    * OUTPUT: the name it stands for
+*/
+static char * unescape(Arena * arena, const char * s)
+{
+    char * out = arenaAlloc(arena, strlen(s) + 1);
+    char * p = out;
+    for (; *s; s++)
+    {
+        if (*s == '\\' && s[1])
+            s++;
+        *p++ = *s;
+    }
+    *p = 0;
+    return out;
+}
+
+/*
+    * Append a name to a directory path.
+    * INPUT: arena, the directory ("" for the current one), the name
+    * OUTPUT: the path
+*/
+static char * joinPath(Arena * arena, const char * dir, const char * name)
+{
+    size_t lenDir = strlen(dir), lenName = strlen(name);
+    char * out = arenaAlloc(arena, lenDir + lenName + 2);
+    memcpy(out, dir, lenDir);
+    if (lenDir > 0 && dir[lenDir-1] != '/')
+        out[lenDir++] = '/';
+    memcpy(out + lenDir, name, lenName + 1);
+    return out;
+}
+
+/*
+    * Append a path to the results of a pattern.
+    * INPUT: pattern state, the path
+    * OUTPUT: void
+*/
+static void pushMatch(Glob * g, char * path)
+{
+    if (g->numMatches == g->capMatches)
+    {
+        g->capMatches = g->capMatches ? g->capMatches * 2 : 64;
+        g->matches = realloc(g->matches, g->capMatches * sizeof(char *));
+        if (!checkMemoryValid(g->matches))
+            exit(EXIT_FAILURE);
+    }
+    g->matches[g->numMatches++] = path;
+}
+
+/*
+    * Add a matched path to the results of a pattern, with a '/' when the pattern asks for directories.
+    * INPUT: pattern state, the path (allocated from its arena)
+    * OUTPUT: void
+*/
+static void addMatch(Glob * g, char * path)
+{
+    pushMatch(g, g->dirsOnly ? joinPath(g->arena, path, "") : path);
+}
+
+/*
+    * Read the entries of a directory with getdents64(): large batches, and the type of every entry without a stat().
+    * INPUT: directory, listing to fill (its buffer is reused), getdents64() buffer, pointer to receive the state of
+    *        the directory (or NULL)
+    * OUTPUT: 0 on success, -1 otherwise
+*/
+static int readListing(const char * dir, Listing * listing, char * dents, struct stat * st)
+{
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    long n;
+    if (fd == -1)
+        return -1;
+    if (st && fstat(fd, st) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    listing->size = 0;
+    while ((n = syscall(SYS_getdents64, fd, dents, GLOB_DENTS_SIZE)) > 0)
+    {
+        long off;
+        for (off = 0; off < n; off += ((Dirent64 *)(dents + off))->d_reclen)
+        {
+            Dirent64 * d = (Dirent64 *)(dents + off);
+            const char * name = d->d_name;
+            if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+                continue;
+
+            size_t len = strlen(name);
+            while (listing->size + len + 3 > listing->cap)
+            {
+                listing->cap = listing->cap ? listing->cap * 2 : 4096;
+                listing->data = realloc(listing->data, listing->cap);
+                if (!checkMemoryValid(listing->data))
+                    exit(EXIT_FAILURE);
+            }
+            listing->data[listing->size] = d->d_type;
+            listing->data[listing->size + 1] = (char)len;
+            memcpy(listing->data + listing->size + 2, name, len + 1);
+            listing->size += len + 3;
+        }
+    }
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
+
+/*
+    * Free a listing, removing it from the cache if it is there (the cache is then locked by the caller).
+    * INPUT: the listing
+    * OUTPUT: void
+*/
+static void freeListing(Listing * listing)
+{
+    int i;
+    for (i = 0; listing->path && i < numCached; i++)
+    {
+        if (listingCache[i] == listing)
+        {
+            listingCache[i] = listingCache[--numCached];
+            cachedBytes -= listing->cap;
+            break;
+        }
+    }
+    free(listing->path);
+    free(listing->data);
+    free(listing);
+}
+
+/*
+    * Keep a listing in the cache, evicting the least recently used ones to make room.
+    * INPUT: the listing, its directory, the state of the directory when it was read
+    * OUTPUT: 1 if the listing is kept, 0 if there is no room for it
+    * NOTE: the cache is locked by the caller.
+*/
+static int cacheListing(Listing * listing, const char * dir, const struct stat * st)
+{
+    // the buffer is trimmed to the entries
+    if (listing->size < listing->cap)
+    {
+        char * data = realloc(listing->data, listing->size ? listing->size : 1);
+        if (data)
+        {
+            listing->data = data;
+            listing->cap = listing->size ? listing->size : 1;
+        }
+    }
+
+    while (numCached == GLOB_CACHE_DIRS || cachedBytes + listing->cap > GLOB_CACHE_MAX_BYTES)
+    {
+        Listing * oldest = 0;
+        int i;
+        for (i = 0; i < numCached; i++)
+            if (listingCache[i]->refs == 0 && (!oldest || listingCache[i]->used < oldest->used))
+                oldest = listingCache[i];
+        if (!oldest)
+            return 0;
+        freeListing(oldest);
+    }
+
+    listing->path = strdup(dir);
+    if (!checkMemoryValid(listing->path))
+        exit(EXIT_FAILURE);
+    listing->dev = st->st_dev;
+    listing->ino = st->st_ino;
+    listing->mtime = st->st_mtim;
+    listingCache[numCached++] = listing;
+    cachedBytes += listing->cap;
+    return 1;
+}
+
+/*
+    * Find the cached listing of a directory. The cache is locked by the caller.
+    * INPUT: the directory
+    * OUTPUT: the listing, NULL if the directory is not cached
+*/
+static Listing * findListing(const char * dir)
+{
+    int i;
+    for (i = 0; i < numCached; i++)
+        if (strcmp(listingCache[i]->path, dir) == 0)
+            return listingCache[i];
+    return 0;
+}
+
+/*
+    * Get the entries of a directory. They come from the cache while the directory keeps the same inode and modification
+    * time; a directory modified in the last second is read again every time, as it could still change within the same
+    * timestamp. The walker threads of a "**" share the cache with the shell's thread, under cacheLock.
+    * INPUT: pattern state, the directory ("" for the current one)
+    * OUTPUT: the listing, to give back with closeListing(); NULL if the directory can not be read
+*/
+static Listing * openListing(Glob * g, const char * dir)
+{
+    const char * key = *dir ? dir : ".";
+    struct stat st;
+
+    if (stat(key, &st) == -1)
+        return 0;
+    pthread_mutex_lock(&cacheLock);
+    Listing * cached = findListing(key);
+    if (cached && cached->dev == st.st_dev && cached->ino == st.st_ino && cached->mtime.tv_sec == st.st_mtim.tv_sec
+        && cached->mtime.tv_nsec == st.st_mtim.tv_nsec)
+    {
+        globCacheHits++;
+        cached->used = ++listingClock;
+        cached->refs++;
+        pthread_mutex_unlock(&cacheLock);
+        return cached;
+    }
+    globCacheMisses++;
+    pthread_mutex_unlock(&cacheLock);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    Listing * listing = calloc(1, sizeof(Listing));
+    if (!checkMemoryValid(listing))
+        exit(EXIT_FAILURE);
+    if (readListing(key, listing, g->dents, &st) == -1)
+    {
+        freeListing(listing);
+        return 0;
+    }
+    if (st.st_mtim.tv_sec >= now.tv_sec - 1)
+        return listing;
+
+    // the new listing replaces a stale one (looked up again: another thread may have replaced it meanwhile), unless an
+    // expansion still goes through it
+    pthread_mutex_lock(&cacheLock);
+    cached = findListing(key);
+    if (!cached || cached->refs == 0)
+    {
+        if (cached)
+            freeListing(cached);
+        if (cacheListing(listing, key, &st))
+        {
+            listing->used = ++listingClock;
+            listing->refs = 1;
+        }
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return listing;
+}
+
+/*
+    * Give back a listing from openListing().
+    * INPUT: the listing
+    * OUTPUT: void
+*/
+static void closeListing(Listing * listing)
+{
+    pthread_mutex_lock(&cacheLock);
+    int cached = listing->path != 0;
+    if (cached)
+        listing->refs--;
+    pthread_mutex_unlock(&cacheLock);
+    if (!cached)
+        freeListing(listing);
+}
+
+/*
+    * Check if an entry of a listing is a directory. Only the entries of unknown type (and the symbolic links, when they
+    * are followed) cost a stat().
+    * INPUT: pattern state, directory of the entry, its name, its d_type, 1 to follow a symbolic link
+    * OUTPUT: 1 if it is, 0 otherwise
+*/
+static int isDirectory(Glob * g, const char * dir, const char * name, unsigned char type, int follow)
+{
+    struct stat st;
+    if (type == DT_DIR)
+        return 1;
+    if (type != DT_UNKNOWN && !(follow && type == DT_LNK))
+        return 0;
+    char * path = joinPath(g->arena, dir, name);
+    return (follow ? stat(path, &st) : lstat(path, &st)) == 0 && S_ISDIR(st.st_mode);
+}
+
+/*
+    * Match the entries of a directory against a segment of the pattern, going on with the next segment in the
+    * matching directories. Hidden entries only match a segment starting with '.'.
+    * INPUT: pattern state, the directory, index of the segment, listing of the directory
+    * OUTPUT: void
+*/
+static void matchListing(Glob * g, const char * dir, int seg, const Listing * listing)
+{
+    const char * pattern = g->segments[seg];
+    int last = seg == g->numSegments - 1;
+    const char * e;
+    for (e = listing->data; e < listing->data + listing->size; e += (unsigned char)e[1] + 3)
+    {
+        const char * name = e + 2;
+        if ((name[0] == '.' && pattern[0] != '.') || !globMatch(pattern, name))
+            continue;
+        if ((!last || g->dirsOnly) && !isDirectory(g, dir, name, e[0], 1))
+            continue;
+
+        char * path = joinPath(g->arena, dir, name);
+        if (last)
+            addMatch(g, path);
+        else
+            expandSegment(g, path, seg + 1);
+    }
+}
+
+/*
+    * Visit one directory of a "**" walk: match the rest of the pattern in it, or take every entry when the pattern
+    * ends with the "**".
+    * INPUT: pattern state, the directory, first segment after the "**", listing of the directory
+    * OUTPUT: void
+*/
+static void visitDirectory(Glob * g, const char * dir, int seg, const Listing * listing)
+{
+    if (seg < g->numSegments)
+    {
+        matchListing(g, dir, seg, listing);
+        return;
+    }
+
+    const char * e;
+    for (e = listing->data; e < listing->data + listing->size; e += (unsigned char)e[1] + 3)
+        if (e[2] != '.' && (!g->dirsOnly || isDirectory(g, dir, e + 2, e[0], 0)))
+            addMatch(g, joinPath(g->arena, dir, e + 2));
+}
+
+/*
+    * Walk a tree for a "**" on one thread, depth first. Hidden directories and symbolic links are not entered.
+    * INPUT: pattern state, the top directory, first segment after the "**"
+    * OUTPUT: void
+*/
+static void walkSequential(Glob * g, const char * dir, int seg)
+{
+    Listing * listing = openListing(g, dir);
+    if (!listing)
+        return;
+    visitDirectory(g, dir, seg, listing);
+
+    const char * e;
+    for (e = listing->data; e < listing->data + listing->size; e += (unsigned char)e[1] + 3)
+        if (e[2] != '.' && isDirectory(g, dir, e + 2, e[0], 0))
+            walkSequential(g, joinPath(g->arena, dir, e + 2), seg);
+    closeListing(listing);
+}
+
+/*
+    * Queue the subdirectories of a directory for the walker threads.
+    * INPUT: pattern state of the caller, the queue, the directory, its listing
+    * OUTPUT: number of directories queued
+*/
+static int queueSubdirectories(Glob * g, WalkQueue * q, const char * dir, const Listing * listing)
+{
+    int queued = 0;
+    const char * e;
+    for (e = listing->data; e < listing->data + listing->size; e += (unsigned char)e[1] + 3)
+    {
+        if (e[2] == '.' || !isDirectory(g, dir, e + 2, e[0], 0))
+            continue;
+
+        // the path outlives the arena of the thread that found it
+        size_t lenDir = strlen(dir), lenName = (unsigned char)e[1];
+        char * path = malloc(lenDir + lenName + 2);
+        if (!checkMemoryValid(path))
+            exit(EXIT_FAILURE);
+        memcpy(path, dir, lenDir);
+        if (lenDir > 0 && dir[lenDir-1] != '/')
+            path[lenDir++] = '/';
+        memcpy(path + lenDir, e + 2, lenName + 1);
+
+        pthread_mutex_lock(&q->lock);
+        if (q->count == q->cap)
+        {
+            q->cap = q->cap ? q->cap * 2 : 256;
+            q->dirs = realloc(q->dirs, q->cap * sizeof(char *));
+            if (!checkMemoryValid(q->dirs))
+                exit(EXIT_FAILURE);
+        }
+        q->dirs[q->count++] = path;
+        q->pending++;
+        pthread_cond_signal(&q->ready);
+        pthread_mutex_unlock(&q->lock);
+        queued++;
+    }
+    return queued;
+}
+
+/*
+    * Take directories from the queue until every directory is walked. The last queued is taken first: the walk stays
+    * close to depth first and the queue short.
+    * INPUT: pattern state of the thread, the queue
+    * OUTPUT: void
+*/
+static void walkQueue(Glob * g, WalkQueue * q)
+{
+    pthread_mutex_lock(&q->lock);
+    while (1)
+    {
+        while (q->count == 0 && q->pending > 0)
+            pthread_cond_wait(&q->ready, &q->lock);
+        if (q->count == 0)
+            break;
+        char * dir = q->dirs[--q->count];
+        pthread_mutex_unlock(&q->lock);
+
+        Listing * listing = openListing(g, dir);
+        if (listing)
+        {
+            visitDirectory(g, dir, q->seg, listing);
+            queueSubdirectories(g, q, dir, listing);
+            closeListing(listing);
+        }
+        free(dir);
+
+        pthread_mutex_lock(&q->lock);
+        if (--q->pending == 0)
+            pthread_cond_broadcast(&q->ready);
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+    * Body of a walker thread. Signals are blocked: they are for the shell's own thread.
+    * INPUT: the walker
+    * OUTPUT: NULL
+*/
+static void * runWalker(void * arg)
+{
+    Walker * w = arg;
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, 0);
+    walkQueue(&w->glob, w->queue);
+    return 0;
+}
+
+/*
+    * Walk a tree for a "**". The top directory is read on the shell's thread; when it has subdirectories, they are
+    * walked by up to GLOB_MAX_THREADS threads (one per CPU), the shell's thread included. Each thread collects its
+    * matches in its own arena, copied into the pattern's arena at the end.
+    * INPUT: pattern state, the top directory, first segment after the "**"
+    * OUTPUT: void
+*/
+static void walkTree(Glob * g, const char * dir, int seg)
+{
+    long numWalkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numWalkers > GLOB_MAX_THREADS)
+        numWalkers = GLOB_MAX_THREADS;
+    // a "**" reached inside a walk, or a single CPU
+    if (g->walking || numWalkers < 2)
+    {
+        walkSequential(g, dir, seg);
+        return;
+    }
+
+    Listing * listing = openListing(g, dir);
+    if (!listing)
+        return;
+    visitDirectory(g, dir, seg, listing);
+
+    WalkQueue q;
+    memset(&q, 0, sizeof(q));
+    pthread_mutex_init(&q.lock, 0);
+    pthread_cond_init(&q.ready, 0);
+    q.seg = seg;
+    int queued = queueSubdirectories(g, &q, dir, listing);
+    closeListing(listing);
+
+    if (queued > 0)
+    {
+        Walker * walkers = calloc(numWalkers - 1, sizeof(Walker));
+        if (!checkMemoryValid(walkers))
+            exit(EXIT_FAILURE);
+        int i, started;
+        for (started = 0; started < numWalkers - 1; started++)
+        {
+            Walker * w = &walkers[started];
+            arenaInit(&w->arena);
+            w->glob = *g;
+            w->glob.arena = &w->arena;
+            w->glob.walking = 1;
+            w->glob.matches = 0;
+            w->glob.numMatches = w->glob.capMatches = 0;
+            w->glob.dents = malloc(GLOB_DENTS_SIZE);
+            if (!checkMemoryValid(w->glob.dents))
+                exit(EXIT_FAILURE);
+            w->queue = &q;
+            if (pthread_create(&w->thread, 0, runWalker, w) != 0)
+            {
+                free(w->glob.dents);
+                arenaFree(&w->arena);
+                break;
+            }
+        }
+
+        g->walking = 1;
+        walkQueue(g, &q);
+        g->walking = 0;
+
+        for (i = 0; i < started; i++)
+        {
+            Walker * w = &walkers[i];
+            int j;
+            pthread_join(w->thread, 0);
+            for (j = 0; j < w->glob.numMatches; j++)
+                pushMatch(g, arenaStrndup(g->arena, w->glob.matches[j], strlen(w->glob.matches[j])));
+            free(w->glob.matches);
+            free(w->glob.dents);
+            arenaFree(&w->arena);
+        }
+        free(walkers);
+    }
+
+    free(q.dirs);
+    pthread_mutex_destroy(&q.lock);
+    pthread_cond_destroy(&q.ready);
+}
+
+/*
+    * Expand the pattern from one segment on, in one directory.
+    * INPUT: pattern state, the directory ("" for the current one), index of the segment
+    * OUTPUT: void
+*/
+static void expandSegment(Glob * g, const char * dir, int seg)
+{
+    const char * pattern = g->segments[seg];
+    if (strcmp(pattern, "**") == 0)
+    {
+        walkTree(g, dir, seg + 1);
+        return;
+    }
+
+    // a plain name is not looked up in the listing, only checked once the path is complete
+    if (!hasMeta(pattern))
+    {
+        char * path = joinPath(g->arena, dir, unescape(g->arena, pattern));
+        struct stat st;
+        if (seg < g->numSegments - 1)
+            expandSegment(g, path, seg + 1);
+        else if (lstat(path, &st) == 0 && (!g->dirsOnly || (stat(path, &st) == 0 && S_ISDIR(st.st_mode))))
+            addMatch(g, path);
+        return;
+    }
+
+    Listing * listing = openListing(g, dir);
+    if (!listing)
+        return;
+    matchListing(g, dir, seg, listing);
+    closeListing(listing);
+}
+
+/*
+    * Order of the matches of a pattern: byte order, as "ls" in the C locale.
+*/
+static int compareMatches(const void * a, const void * b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+    * Expand the words of a command once they are final. A word with an unquoted "*", "?" or "[" is a pattern: it is
+    * replaced by the sorted paths it matches, and stays as it is (without its quotes) when nothing matches. A "**"
+    * segment matches any number of directories. Other words only lose their quotes.
+    * INPUT: arena of the command line, NULL-terminated words (modified in place)
+    * OUTPUT: the expanded words: args itself unless a pattern matched
+    * NOTE: when a pattern matched, expandedArgs is the result and [expandedFirst, expandedEnd) the words from the first
+    *       to the last matching pattern, the ones an oversized command is split on.
+*/
+char ** expandArgs(Arena * arena, char ** args)
+{
+    int numArgs = getNumArgs(args);
+    int i, total = 0, globbed = 0;
+    char *** results = 0;
+    int * counts = 0;
+
+    expandedArgs = 0;
+
+    for (i = 0; i < numArgs; i++)
+    {
+        int meta = 0;
+        char * pattern = strpbrk(args[i], "*?[") ? toPattern(arena, args[i], &meta) : 0;
+        if (!meta)
+        {
+            args[i] = unquoteWord(arena, args[i]);
+            total++;
+            continue;
+        }
+
+        Glob g;
+        memset(&g, 0, sizeof(g));
+        g.arena = arena;
+        if (!shellDents)
+        {
+            shellDents = malloc(GLOB_DENTS_SIZE);
+            if (!checkMemoryValid(shellDents))
+                exit(EXIT_FAILURE);
+        }
+        g.dents = shellDents;
+
+        size_t len = strlen(pattern);
+        char * save;
+        char * segment;
+        g.dirsOnly = len > 1 && pattern[len-1] == '/';
+        g.segments = arenaAlloc(arena, (len / 2 + 1) * sizeof(char *));
+        const char * top = pattern[0] == '/' ? "/" : "";
+        // consecutive "**" are one
+        for (segment = strtok_r(pattern, "/", &save); segment; segment = strtok_r(0, "/", &save))
+            if (strcmp(segment, "**") != 0 || g.numSegments == 0 || strcmp(g.segments[g.numSegments-1], "**") != 0)
+                g.segments[g.numSegments++] = segment;
+
+        if (g.numSegments > 0)
+            expandSegment(&g, top, 0);
+        if (g.numMatches == 0)
+        {
+            args[i] = unquoteWord(arena, args[i]);
+            total++;
+            continue;
+        }
+
+        if (!results)
+        {
+            results = arenaAlloc(arena, numArgs * sizeof(char **));
+            counts = arenaAlloc(arena, numArgs * sizeof(int));
+            memset(counts, 0, numArgs * sizeof(int));
+        }
+        qsort(g.matches, g.numMatches, sizeof(char *), compareMatches);
+        results[i] = arenaAlloc(arena, g.numMatches * sizeof(char *));
+        memcpy(results[i], g.matches, g.numMatches * sizeof(char *));
+        counts[i] = g.numMatches;
+        total += g.numMatches;
+        globbed = 1;
+        free(g.matches);
+    }
+    if (!globbed)
+        return args;
+
+    expandedFirst = -1;
+    char ** expanded = arenaAlloc(arena, (total + 1) * sizeof(char *));
+    int n = 0;
+    for (i = 0; i < numArgs; i++)
+    {
+        if (counts[i] == 0)
+            expanded[n++] = args[i];
+        else
+        {
+            if (expandedFirst == -1)
+                expandedFirst = n;
+            expandedEnd = n + counts[i];
+            memcpy(expanded + n, results[i], counts[i] * sizeof(char *));
+            n += counts[i];
+        }
+    }
+    expanded[n] = 0;
+    expandedArgs = expanded;
+    return expanded;
+}
+
+/*
+    * Forget every cached directory listing.
+    * INPUT: void
+    * OUTPUT: void
+*/
+void globCacheClear()
+{
+    pthread_mutex_lock(&cacheLock);
+    while (numCached > 0)
+        freeListing(listingCache[numCached - 1]);
+    cachedBytes = 0;
+    pthread_mutex_unlock(&cacheLock);
+}
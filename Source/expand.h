@@ -0,0 +1,16 @@
+#pragma once
+#include "arena.h"
+#define GLOB_DENTS_SIZE (1 << 20) // bytes asked from getdents64() at a time
+#define GLOB_CACHE_DIRS 64 // directory listings kept, the least recently used goes first
+#define GLOB_CACHE_MAX_BYTES (64 << 20) // total size of the listings kept
+#define GLOB_MAX_THREADS 8 // threads walking the directories of a "**"
+
+extern unsigned long globCacheHits;
+extern unsigned long globCacheMisses;
+extern char ** expandedArgs; // last expansion where a pattern matched
+extern int expandedFirst; // its words that came from patterns: [expandedFirst, expandedEnd)
+extern int expandedEnd;
+
+char ** expandArgs(Arena * arena, char ** args);
+int globMatch(const char * pattern, const char * name);
+void globCacheClear();
@@ -0,0 +1,369 @@
+#define _GNU_SOURCE
+#include "forkserver.h"
+#include "launch.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+extern char ** environ;
+
+/*
+ * Header of a launch request. It travels with the descriptors (SCM_RIGHTS), the strings follow on the stream:
+ * path, argc arguments and envc environment entries, each terminated by a NUL byte, length bytes in all.
+*/
+typedef struct ForkRequest {
+    pid_t pgid; // process group to join, 0 to lead a new one, -1 to stay in the shell's
+    unsigned int argc;
+    unsigned int envc;
+    unsigned int length;
+} ForkRequest;
+
+/*
+ * Answer of the server: pid of the command, and the errno of a failed launch (0 once exec succeeded).
+*/
+typedef struct ForkReply {
+    pid_t pid;
+    int err;
+} ForkReply;
+
+static int serverSock = -1; // shell side of the socket, -1 when the server is not running
+static pid_t serverPid = -1;
+
+/*
+    * Send or receive exactly len bytes on the socket.
+    * INPUT: socket, buffer, length
+    * OUTPUT: 1 if done, 0 if the peer went away or on error
+*/
+static int sendAll(int sock, const void * buf, size_t len)
+{
+    const char * p = buf;
+    while (len > 0)
+    {
+        ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static int receiveAll(int sock, void * buf, size_t len)
+{
+    char * p = buf;
+    while (len > 0)
+    {
+        ssize_t n = recv(sock, p, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/*
+    * Clone the command from the server. With CLONE_PARENT it becomes a child of the shell, which waits for it
+    * (and sets its process group) like for any command it spawned itself.
+    * INPUT: path, arguments and environment of the command, its descriptors, process group
+    * OUTPUT: the reply to send back
+*/
+static ForkReply launch(char * path, char ** argv, char ** envp, int * fds, pid_t pgid)
+{
+    ForkReply reply = {-1, 0};
+    int report[2];
+
+    // the child writes the errno of a failed exec here; a successful exec closes it empty
+    if (pipe2(report, O_CLOEXEC) == -1)
+    {
+        reply.err = errno;
+        return reply;
+    }
+
+    pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+    if (pid == 0)
+    {
+        int i, err;
+        if (pgid != -1)
+            setpgid(0, pgid);
+        for (i = 0; i < 3; i++)
+            dup2(fds[i], i);
+        if (fchdir(fds[3]) == 0)
+            execve(path, argv, envp);
+        err = errno;
+        (void)!write(report[1], &err, sizeof(err));
+        _exit(127);
+    }
+
+    close(report[1]);
+    if (pid < 0)
+        reply.err = errno;
+    else
+    {
+        int err;
+        ssize_t n;
+        while ((n = read(report[0], &err, sizeof(err))) < 0 && errno == EINTR);
+        if (n == sizeof(err))
+            reply.err = err;
+        reply.pid = pid;
+    }
+    close(report[0]);
+    return reply;
+}
+
+/*
+    * Main loop of the fork server: receive a request, launch the command, answer, until the shell closes the socket.
+    * INPUT: descriptor of the server side of the socket
+    * OUTPUT: exit status of the server
+    * NOTE: Called by main() for "PLTsh --fork-server FD". The process only ever runs this loop, so it stays tiny
+    *       and its clone() does not depend on how large the shell has grown.
+*/
+int forkServerMain(int sock)
+{
+    char * payload = 0;
+    char ** vector = 0;
+    size_t payloadSize = 0, vectorSize = 0;
+
+    resetChildSignals();
+    // inherited through exec, the socket must not reach the commands
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+    while (1)
+    {
+        ForkRequest req;
+        int fds[FORK_SERVER_FDS];
+        union {
+            char buf[CMSG_SPACE(sizeof(fds))];
+            struct cmsghdr align;
+        } control;
+        struct iovec iov = {&req, sizeof(req)};
+        struct msghdr msg;
+        struct cmsghdr * cmsg;
+        ssize_t n;
+        int i;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+        if (n == 0)
+            return 0; // the shell is gone
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (n != sizeof(req) || !cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+            return 1;
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+        // the strings: path, arguments, environment
+        if (req.length > payloadSize)
+        {
+            payloadSize = req.length;
+            payload = realloc(payload, payloadSize);
+            if (!checkMemoryValid(payload))
+                exit(EXIT_FAILURE);
+        }
+        if (req.argc + req.envc + 2 > vectorSize)
+        {
+            vectorSize = req.argc + req.envc + 2;
+            vector = realloc(vector, vectorSize * sizeof(char *));
+            if (!checkMemoryValid(vector))
+                exit(EXIT_FAILURE);
+        }
+        if (req.length == 0 || !receiveAll(sock, payload, req.length) || payload[req.length - 1] != 0)
+            return 1;
+
+        char * p = payload + strlen(payload) + 1;
+        char * end = payload + req.length;
+        for (i = 0; i < (int)(req.argc + req.envc + 1); i++)
+        {
+            if (i == (int)req.argc)
+            {
+                vector[i] = 0;
+                continue;
+            }
+            if (p >= end)
+                return 1;
+            vector[i] = p;
+            p += strlen(p) + 1;
+        }
+        vector[req.argc + req.envc + 1] = 0;
+
+        ForkReply reply = launch(payload, vector, vector + req.argc + 1, fds, req.pgid);
+        for (i = 0; i < FORK_SERVER_FDS; i++)
+            close(fds[i]);
+        if (!sendAll(sock, &reply, sizeof(reply)))
+            return 1;
+    }
+}
+
+/*
+    * Start the fork server: a fresh copy of the shell binary that only runs forkServerMain(), and select it as spawn engine.
+    * INPUT: void
+    * OUTPUT: 1 if the server runs, 0 otherwise
+*/
+int forkServerStart()
+{
+    int sv[2];
+    char fdArg[16];
+
+    if (serverSock != -1)
+        return 1;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+    {
+        perror("[Error] Fork server");
+        return 0;
+    }
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+
+    snprintf(fdArg, sizeof(fdArg), "%d", sv[1]);
+    char * argv[] = {"PLTsh", FORK_SERVER_FLAG, fdArg, 0};
+    int err = posix_spawn(&serverPid, "/proc/self/exe", 0, 0, argv, environ);
+    close(sv[1]);
+    if (err != 0)
+    {
+        fprintf(stderr, "[Error] Fork server: %s\n", strerror(err));
+        close(sv[0]);
+        return 0;
+    }
+
+    serverSock = sv[0];
+    spawnEngine = SPAWN_ENGINE_SERVER;
+    return 1;
+}
+
+/*
+    * Stop the fork server and go back to posix_spawn.
+    * INPUT: void
+    * OUTPUT: void
+*/
+void forkServerStop()
+{
+    if (serverSock == -1)
+        return;
+    close(serverSock); // the server sees end of file and exits
+    serverSock = -1;
+    waitpid(serverPid, 0, 0);
+    serverPid = -1;
+    spawnEngine = SPAWN_ENGINE_POSIX;
+}
+
+/*
+    * Forget the fork server in a forked subshell: its commands must be its own children, and the socket belongs to the shell.
+    * INPUT: void
+    * OUTPUT: void
+    * NOTE: the subshell's copy of the socket is left open; closing it would not stop the server, the shell still holds it.
+*/
+void forkServerDetach()
+{
+    serverSock = -1;
+    serverPid = -1;
+    if (spawnEngine == SPAWN_ENGINE_SERVER)
+        spawnEngine = SPAWN_ENGINE_POSIX;
+}
+
+/*
+    * Launch a command through the fork server: the strings go over the socket, STDIN/STDOUT/STDERR and the working
+    * directory as descriptors, so the command starts with the shell's current redirections and directory.
+    * INPUT: resolved path, array of command's arguments, input and output descriptors (-1 to inherit), process group
+    * OUTPUT: pid of the child, -1 with errno set on failure. If the server is lost, it is stopped and errno is EAGAIN.
+*/
+pid_t forkServerSpawn(char * path, char ** args, int fdIn, int fdOut, pid_t pgid)
+{
+    static char * payload = 0;
+    static size_t payloadSize = 0;
+    ForkRequest req;
+    ForkReply reply;
+    int fds[FORK_SERVER_FDS];
+    size_t len = 0;
+    char ** strings[2] = {args, environ};
+    int i, j;
+
+    // path, arguments and environment, packed one after the other
+    req.pgid = pgid;
+    req.argc = getNumArgs(args);
+    req.envc = getNumArgs(environ);
+    size_t need = strlen(path) + 1;
+    for (i = 0; i < 2; i++)
+        for (j = 0; strings[i][j]; j++)
+            need += strlen(strings[i][j]) + 1;
+    if (need > payloadSize)
+    {
+        payloadSize = need;
+        payload = realloc(payload, payloadSize);
+        if (!checkMemoryValid(payload))
+            exit(EXIT_FAILURE);
+    }
+    len = strlen(path) + 1;
+    memcpy(payload, path, len);
+    for (i = 0; i < 2; i++)
+    {
+        for (j = 0; strings[i][j]; j++)
+        {
+            size_t n = strlen(strings[i][j]) + 1;
+            memcpy(payload + len, strings[i][j], n);
+            len += n;
+        }
+    }
+    req.length = len;
+
+    fds[0] = fdIn == -1 ? STDIN_FILENO : fdIn;
+    fds[1] = fdOut == -1 ? STDOUT_FILENO : fdOut;
+    fds[2] = STDERR_FILENO;
+    fds[3] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fds[3] == -1)
+        return -1;
+
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {&req, sizeof(req)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t sent;
+    while ((sent = sendmsg(serverSock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+    int ok = sent == sizeof(req) && sendAll(serverSock, payload, len) && receiveAll(serverSock, &reply, sizeof(reply));
+    close(fds[3]);
+
+    if (!ok)
+    {
+        fprintf(stderr, "[Error] Fork server lost, back to posix_spawn\n");
+        forkServerStop();
+        errno = EAGAIN;
+        return -1;
+    }
+    if (reply.err != 0)
+    {
+        // the child that failed to exec is ours: reap it before reporting
+        if (reply.pid > 0)
+            while (waitpid(reply.pid, 0, 0) < 0 && errno == EINTR);
+        errno = reply.err;
+        return -1;
+    }
+    return reply.pid;
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include <sys/types.h>
+
+#define FORK_SERVER_FLAG "--fork-server" // argv[1] of the helper, argv[2] is its socket descriptor
+#define FORK_SERVER_FDS 4 // descriptors sent with every request: STDIN, STDOUT, STDERR and the working directory
+
+int forkServerMain(int sock);
+int forkServerStart();
+void forkServerStop();
+void forkServerDetach();
+pid_t forkServerSpawn(char * path, char ** args, int fdIn, int fdOut, pid_t pgid);
@@ -0,0 +1,201 @@
+#include "hash.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * One remembered command: name -> absolute path, chained by bucket.
+*/
+typedef struct HashEntry {
+    char * name;
+    char * path;
+    unsigned long hits;
+    struct HashEntry * next;
+} HashEntry;
+
+static HashEntry * table[HASH_BUCKETS];
+static char * cachedPath = 0; // value of PATH the table was filled with
+
+unsigned long hashHits = 0;
+unsigned long hashMisses = 0;
+
+/*
+    * FNV-1a hash of a command name.
+    * INPUT: string of the name
+    * OUTPUT: bucket index
+*/
+static unsigned int bucketOf(const char * name)
+{
+    unsigned int h = 2166136261u;
+    while (*name)
+    {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h % HASH_BUCKETS;
+}
+
+/*
+    * Empty the table when PATH is not the one it was filled with.
+    * INPUT: void
+    * OUTPUT: void
+*/
+static void checkPath()
+{
+    char * path = getenv("PATH");
+    if (!path)
+        path = "";
+    if (cachedPath && strcmp(cachedPath, path) == 0)
+        return;
+
+    hashClear();
+    cachedPath = strdup(path);
+    if (!checkMemoryValid(cachedPath))
+        exit(EXIT_FAILURE);
+}
+
+/*
+    * Walk the PATH directories once, as execvp would, and find the executable for a name.
+    * INPUT: command name (without '/')
+    * OUTPUT: newly allocated absolute path, NULL if the command is not found
+*/
+static char * searchPath(const char * name)
+{
+    const char * dir = cachedPath;
+    size_t nameLen = strlen(name);
+
+    while (1)
+    {
+        const char * end = strchr(dir, ':');
+        size_t dirLen = end ? (size_t)(end - dir) : strlen(dir);
+
+        // an empty entry means the current directory
+        char * candidate = malloc(dirLen + nameLen + 3);
+        if (!checkMemoryValid(candidate))
+            exit(EXIT_FAILURE);
+        if (dirLen == 0)
+            strcpy(candidate, "./");
+        else
+        {
+            memcpy(candidate, dir, dirLen);
+            candidate[dirLen] = '/';
+            candidate[dirLen + 1] = 0;
+        }
+        strcat(candidate, name);
+
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0)
+            return candidate;
+        free(candidate);
+
+        if (!end)
+            return 0;
+        dir = end + 1;
+    }
+}
+
+/*
+    * Resolve a command name to the path to execute, remembering the answer.
+    * INPUT: command name
+    * OUTPUT: path to execute (owned by the table, or the name itself when it contains '/'), NULL if not found
+*/
+char * hashLookup(char * name)
+{
+    if (strchr(name, '/'))
+        return name;
+
+    checkPath();
+    unsigned int b = bucketOf(name);
+    HashEntry * e;
+    for (e = table[b]; e; e = e->next)
+    {
+        if (strcmp(e->name, name) == 0)
+        {
+            e->hits++;
+            hashHits++;
+            return e->path;
+        }
+    }
+
+    hashMisses++;
+    char * path = searchPath(name);
+    if (!path)
+        return 0;
+
+    e = malloc(sizeof(HashEntry));
+    if (!checkMemoryValid(e))
+        exit(EXIT_FAILURE);
+    e->name = strdup(name);
+    if (!checkMemoryValid(e->name))
+        exit(EXIT_FAILURE);
+    e->path = path;
+    e->hits = 0;
+    e->next = table[b];
+    table[b] = e;
+    return path;
+}
+
+/*
+    * Drop one remembered command, e.g. when its path disappeared (ENOENT).
+    * INPUT: command name
+    * OUTPUT: void
+*/
+void hashForget(char * name)
+{
+    HashEntry ** link = &table[bucketOf(name)];
+    while (*link)
+    {
+        HashEntry * e = *link;
+        if (strcmp(e->name, name) == 0)
+        {
+            *link = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            return;
+        }
+        link = &e->next;
+    }
+}
+
+/*
+    * Forget every remembered command (hash -r).
+    * INPUT: void
+    * OUTPUT: void
+*/
+void hashClear()
+{
+    int i;
+    for (i = 0; i < HASH_BUCKETS; i++)
+    {
+        while (table[i])
+        {
+            HashEntry * e = table[i];
+            table[i] = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+    }
+    free(cachedPath);
+    cachedPath = 0;
+}
+
+/*
+    * Print the remembered commands with their hit count, then the hit/miss counters (hash).
+    * INPUT: void
+    * OUTPUT: void
+*/
+void hashPrint()
+{
+    int i;
+    HashEntry * e;
+    printf("hits\tcommand\n");
+    for (i = 0; i < HASH_BUCKETS; i++)
+        for (e = table[i]; e; e = e->next)
+            printf("%4lu\t%s\n", e->hits, e->path);
+    printf("lookups: %lu hits, %lu misses\n", hashHits, hashMisses);
+}
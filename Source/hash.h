@@ -0,0 +1,10 @@
+#pragma once
+#define HASH_BUCKETS 256 // buckets of the command-path table
+
+extern unsigned long hashHits;
+extern unsigned long hashMisses;
+
+char * hashLookup(char * name);
+void hashForget(char * name);
+void hashClear();
+void hashPrint();
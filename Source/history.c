@@ -0,0 +1,548 @@
+#define _GNU_SOURCE
+#include "history.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/*
+ * History file: append-only, one entry per line, shared by every shell of the user. It is mapped
+ * read-only and indexed lazily, so startup cost does not depend on its size.
+*/
+static int histFd = -1;
+static char * histMap = 0;
+static size_t histMapSize = 0;
+static size_t histIndexed = 0; // bytes of the mapping already indexed
+
+/*
+ * Index of the entries: offset of every line, and for !prefix a hash table from every prefix of up
+ * to HISTORY_PREFIX bytes to the latest entry starting with it. Entries sharing their first
+ * HISTORY_PREFIX bytes are chained (histPrev) for longer prefixes. Entry numbers start at 1.
+*/
+static size_t * histOffsets = 0;
+static uint32_t * histPrev = 0;
+static size_t histCount = 0, histCap = 0;
+static uint64_t * prefixKeys = 0;
+static uint32_t * prefixEntries = 0;
+static size_t prefixCap = 0, prefixUsed = 0;
+
+/*
+ * Substring index for !?substr?: every HISTORY_GRAM-byte substring (trigram) of the entries, in a hash table, with the
+ * entries holding it in increasing order. Built on the first substring lookup, then extended as entries are indexed.
+*/
+typedef struct Gram {
+    uint32_t key; // the bytes of the trigram
+    uint32_t count;
+    uint32_t cap; // 0 for a free slot
+    uint32_t * entries;
+} Gram;
+
+static Gram * grams = 0;
+static size_t gramCap = 0, gramUsed = 0;
+static int gramsBuilt = 0;
+
+/*
+ * Entries of this session, newest last, for !! and for shells without a history file.
+*/
+static char * ring[HISTORY_RING];
+static int ringStart = 0, ringLen = 0;
+
+/*
+    * Open (or create) the history file. Nothing is read yet.
+    * INPUT: 1 to append new entries to the file, 0 to keep them in memory only
+    * OUTPUT: void
+*/
+void historyInit(int persist)
+{
+    char path[4096];
+    char * file = getenv("PLTSH_HISTFILE");
+    char * home = getenv("HOME");
+
+    if (!persist)
+        return;
+    if (file)
+        snprintf(path, sizeof(path), "%s", file);
+    else if (home)
+        snprintf(path, sizeof(path), "%s/%s", home, HISTORY_FILE);
+    else
+        return;
+
+    histFd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+}
+
+/*
+    * Pack a prefix into a hash key: its bytes and its length.
+*/
+static uint64_t prefixKey(const char * str, size_t len)
+{
+    uint64_t key = (uint64_t)len << 56;
+    memcpy(&key, str, len); // len <= HISTORY_PREFIX < 8, the length byte is kept
+    return key;
+}
+
+/*
+    * Find the slot of a key in the prefix table (open addressing).
+*/
+static size_t prefixSlot(uint64_t key)
+{
+    size_t i = (key * 0x9E3779B97F4A7C15ULL) >> 20;
+    for (i &= prefixCap - 1; prefixEntries[i] && prefixKeys[i] != key; i = (i + 1) & (prefixCap - 1));
+    return i;
+}
+
+/*
+    * Set the latest entry for a prefix.
+    * INPUT: key of the prefix, entry number
+    * OUTPUT: previous entry for the prefix, 0 if there was none
+*/
+static uint32_t prefixSet(uint64_t key, uint32_t entry)
+{
+    // keep the table at most half full
+    if (2 * (prefixUsed + 1) > prefixCap)
+    {
+        uint64_t * oldKeys = prefixKeys;
+        uint32_t * oldEntries = prefixEntries;
+        size_t oldCap = prefixCap, i;
+
+        prefixCap = prefixCap ? prefixCap * 2 : 1024;
+        prefixKeys = calloc(prefixCap, sizeof(uint64_t));
+        prefixEntries = calloc(prefixCap, sizeof(uint32_t));
+        if (!checkMemoryValid(prefixKeys) || !checkMemoryValid(prefixEntries))
+            exit(EXIT_FAILURE);
+        for (i = 0; i < oldCap; i++)
+        {
+            if (oldEntries[i])
+            {
+                size_t slot = prefixSlot(oldKeys[i]);
+                prefixKeys[slot] = oldKeys[i];
+                prefixEntries[slot] = oldEntries[i];
+            }
+        }
+        free(oldKeys);
+        free(oldEntries);
+    }
+
+    size_t slot = prefixSlot(key);
+    uint32_t previous = prefixEntries[slot];
+    if (!previous)
+        prefixUsed++;
+    prefixKeys[slot] = key;
+    prefixEntries[slot] = entry;
+    return previous;
+}
+
+/*
+    * Latest entry starting with a prefix of at most HISTORY_PREFIX bytes.
+*/
+static uint32_t prefixGet(const char * str, size_t len)
+{
+    if (prefixCap == 0)
+        return 0;
+    return prefixEntries[prefixSlot(prefixKey(str, len))];
+}
+
+/*
+    * Pack the HISTORY_GRAM bytes of a trigram into a key.
+*/
+static uint32_t gramKey(const char * str)
+{
+    return (uint32_t)(unsigned char)str[0] << 16 | (uint32_t)(unsigned char)str[1] << 8 | (unsigned char)str[2];
+}
+
+/*
+    * Find the slot of a trigram in the substring index (open addressing).
+*/
+static size_t gramSlot(uint32_t key)
+{
+    size_t i = ((uint64_t)key * 0x9E3779B97F4A7C15ULL) >> 20;
+    for (i &= gramCap - 1; grams[i].cap && grams[i].key != key; i = (i + 1) & (gramCap - 1));
+    return i;
+}
+
+/*
+    * Record that an entry holds a trigram. Entries are added in increasing order, once per trigram.
+    * INPUT: key of the trigram, entry number
+    * OUTPUT: void
+*/
+static void gramAdd(uint32_t key, uint32_t entry)
+{
+    // keep the table at most half full
+    if (2 * (gramUsed + 1) > gramCap)
+    {
+        Gram * old = grams;
+        size_t oldCap = gramCap, i;
+        gramCap = gramCap ? gramCap * 2 : 4096;
+        grams = calloc(gramCap, sizeof(Gram));
+        if (!checkMemoryValid(grams))
+            exit(EXIT_FAILURE);
+        for (i = 0; i < oldCap; i++)
+            if (old[i].cap)
+                grams[gramSlot(old[i].key)] = old[i];
+        free(old);
+    }
+
+    Gram * g = &grams[gramSlot(key)];
+    if (!g->cap)
+    {
+        g->key = key;
+        g->cap = 4;
+        g->entries = malloc(g->cap * sizeof(uint32_t));
+        if (!checkMemoryValid(g->entries))
+            exit(EXIT_FAILURE);
+        gramUsed++;
+    }
+    else if (g->entries[g->count - 1] == entry)
+        return;
+    else if (g->count == g->cap)
+    {
+        g->cap *= 2;
+        g->entries = realloc(g->entries, g->cap * sizeof(uint32_t));
+        if (!checkMemoryValid(g->entries))
+            exit(EXIT_FAILURE);
+    }
+    g->entries[g->count++] = entry;
+}
+
+/*
+    * Add the trigrams of an entry to the substring index.
+    * INPUT: entry number, its line and length
+    * OUTPUT: void
+*/
+static void indexGrams(uint32_t entry, const char * line, size_t len)
+{
+    size_t i;
+    for (i = 0; i + HISTORY_GRAM <= len; i++)
+        gramAdd(gramKey(line + i), entry);
+}
+
+/*
+    * Add one line of the file to the index.
+    * INPUT: offset of the line in the file, length of the line
+    * OUTPUT: void
+*/
+static void indexEntry(size_t offset, size_t len)
+{
+    if (histCount == histCap)
+    {
+        histCap = histCap ? histCap * 2 : 1024;
+        histOffsets = realloc(histOffsets, histCap * sizeof(size_t));
+        histPrev = realloc(histPrev, histCap * sizeof(uint32_t));
+        if (!checkMemoryValid(histOffsets) || !checkMemoryValid(histPrev))
+            exit(EXIT_FAILURE);
+    }
+
+    uint32_t entry = ++histCount;
+    const char * line = histMap + offset;
+    size_t n, longest = len < HISTORY_PREFIX ? len : HISTORY_PREFIX;
+    histOffsets[entry - 1] = offset;
+    histPrev[entry - 1] = 0;
+    for (n = 1; n <= longest; n++)
+    {
+        uint32_t previous = prefixSet(prefixKey(line, n), entry);
+        if (n == HISTORY_PREFIX)
+            histPrev[entry - 1] = previous;
+    }
+    if (gramsBuilt)
+        indexGrams(entry, line, len);
+}
+
+/*
+    * Map what was appended to the file since the last call (by this shell or another one) and index its lines.
+    * INPUT: void
+    * OUTPUT: void
+*/
+static void historySync()
+{
+    struct stat st;
+    if (histFd == -1 || fstat(histFd, &st) == -1 || (size_t)st.st_size <= histMapSize)
+        return;
+
+    size_t size = st.st_size;
+    char * map = histMap ? mremap(histMap, histMapSize, size, MREMAP_MAYMOVE) : mmap(0, size, PROT_READ, MAP_SHARED, histFd, 0);
+    if (map == MAP_FAILED)
+        return;
+    histMap = map;
+    histMapSize = size;
+
+    // index every complete line
+    size_t pos = histIndexed;
+    while (pos < histMapSize)
+    {
+        char * nl = memchr(histMap + pos, '\n', histMapSize - pos);
+        if (!nl)
+            break;
+        size_t len = nl - (histMap + pos);
+        if (len > 0)
+            indexEntry(pos, len);
+        pos += len + 1;
+    }
+    histIndexed = pos;
+}
+
+/*
+    * Length of an indexed entry.
+*/
+static size_t entryLength(uint32_t entry)
+{
+    const char * line = histMap + histOffsets[entry - 1];
+    return (char *)memchr(line, '\n', histMapSize - histOffsets[entry - 1]) - line;
+}
+
+/*
+    * Newest entry containing a substring of at least HISTORY_GRAM bytes, through the substring index: the entries of its
+    * rarest trigram are the candidates, newest first, each confirmed with memmem(). A trigram no entry holds is a miss
+    * without reading the file.
+    * INPUT: the substring, its length
+    * OUTPUT: entry number, 0 if there is none
+*/
+static uint32_t gramFind(const char * needle, size_t len)
+{
+    size_t i;
+    Gram * rarest = 0;
+
+    // the index is built for the entries read so far, then kept up to date by indexEntry()
+    if (!gramsBuilt)
+    {
+        uint32_t entry;
+        gramsBuilt = 1;
+        for (entry = 1; entry <= histCount; entry++)
+            indexGrams(entry, histMap + histOffsets[entry - 1], entryLength(entry));
+    }
+    if (!grams)
+        return 0;
+
+    for (i = 0; i + HISTORY_GRAM <= len; i++)
+    {
+        Gram * g = &grams[gramSlot(gramKey(needle + i))];
+        if (!g->cap)
+            return 0;
+        if (!rarest || g->count < rarest->count)
+            rarest = g;
+    }
+
+    for (i = rarest->count; i > 0; i--)
+    {
+        uint32_t entry = rarest->entries[i - 1];
+        if (memmem(histMap + histOffsets[entry - 1], entryLength(entry), needle, len))
+            return entry;
+    }
+    return 0;
+}
+
+/*
+    * Copy an indexed entry into a new string.
+*/
+static char * entryCopy(uint32_t entry)
+{
+    size_t len = entryLength(entry);
+    char * str = malloc(len + 1);
+    if (!checkMemoryValid(str))
+        exit(EXIT_FAILURE);
+    memcpy(str, histMap + histOffsets[entry - 1], len);
+    str[len] = 0;
+    return str;
+}
+
+/*
+    * Record a command line: in the ring and, for a persistent history, appended to the file under an
+    * exclusive lock so that concurrent shells never interleave their lines.
+    * INPUT: the command line
+    * OUTPUT: void
+*/
+void historyAdd(char * line)
+{
+    if (line[0] == 0)
+        return;
+
+    int slot = (ringStart + ringLen) % HISTORY_RING;
+    if (ringLen == HISTORY_RING)
+    {
+        free(ring[ringStart]);
+        ringStart = (ringStart + 1) % HISTORY_RING;
+    }
+    else
+        ringLen++;
+    ring[slot] = strdup(line);
+    if (!checkMemoryValid(ring[slot]))
+        exit(EXIT_FAILURE);
+
+    if (histFd == -1)
+        return;
+    struct iovec iov[2] = {{line, strlen(line)}, {"\n", 1}};
+    flock(histFd, LOCK_EX);
+    if (writev(histFd, iov, 2) == -1)
+        perror("[Error] Can not write history");
+    flock(histFd, LOCK_UN);
+}
+
+/*
+    * Find the newest entry matching a designator: "!" (the previous command), a number, a negative
+    * number (counted back from the newest), a prefix, or "?substr" for an entry containing substr.
+    * INPUT: designator without the leading '!', its length
+    * OUTPUT: newly allocated entry, NULL if there is none
+*/
+static char * historyFind(const char * spec, size_t len)
+{
+    int i;
+
+    // !! is the previous command of this session, or the last one of the file
+    if (len == 1 && spec[0] == '!')
+    {
+        if (ringLen > 0)
+            return strdup(ring[(ringStart + ringLen - 1) % HISTORY_RING]);
+        historySync();
+        return histCount ? entryCopy(histCount) : 0;
+    }
+
+    // the session ring serves shells without a history file
+    historySync();
+    if (histFd == -1)
+    {
+        if ((spec[0] >= '0' && spec[0] <= '9') || (spec[0] == '-' && len > 1))
+        {
+            long n = strtol(spec, 0, 10);
+            if (n < 0)
+                n += ringLen + 1;
+            return n >= 1 && n <= ringLen ? strdup(ring[(ringStart + n - 1) % HISTORY_RING]) : 0;
+        }
+        for (i = ringLen - 1; i >= 0; i--)
+        {
+            char * entry = ring[(ringStart + i) % HISTORY_RING];
+            if (spec[0] == '?' ? memmem(entry, strlen(entry), spec + 1, len - 1) != 0 : strncmp(entry, spec, len) == 0)
+                return strdup(entry);
+        }
+        return 0;
+    }
+
+    // !n and !-n: direct access through the offsets
+    if ((spec[0] >= '0' && spec[0] <= '9') || (spec[0] == '-' && len > 1))
+    {
+        long n = strtol(spec, 0, 10);
+        if (n < 0)
+            n += histCount + 1;
+        return n >= 1 && (size_t)n <= histCount ? entryCopy(n) : 0;
+    }
+
+    // !?substr: the substring index, or for a needle shorter than a trigram a search of the file backwards from the
+    // newest entry, block by block
+    if (spec[0] == '?')
+    {
+        const char * needle = spec + 1;
+        size_t needleLen = len - 1, end = histIndexed, block = 1 << 20;
+        if (needleLen == 0)
+            return 0;
+        if (needleLen >= HISTORY_GRAM)
+        {
+            uint32_t entry = gramFind(needle, needleLen);
+            return entry ? entryCopy(entry) : 0;
+        }
+        while (end > 0)
+        {
+            size_t start = end > block ? end - block : 0;
+            const char * found = 0, * p = histMap + start;
+            while ((p = memmem(p, histMap + end - p, needle, needleLen)) != 0)
+                found = p++;
+            if (found)
+            {
+                // binary search of the entry holding the match
+                size_t offset = found - histMap, lo = 0, hi = histCount;
+                while (hi - lo > 1)
+                {
+                    size_t mid = (lo + hi) / 2;
+                    if (histOffsets[mid] <= offset)
+                        lo = mid;
+                    else
+                        hi = mid;
+                }
+                return entryCopy(lo + 1);
+            }
+            if (start == 0)
+                break;
+            end = start + needleLen - 1; // overlap so a match across blocks is not missed
+        }
+        return 0;
+    }
+
+    // !prefix: the prefix table answers short prefixes, the chain of the entries sharing the
+    // first HISTORY_PREFIX bytes answers longer ones
+    if (len <= HISTORY_PREFIX)
+    {
+        uint32_t entry = prefixGet(spec, len);
+        return entry ? entryCopy(entry) : 0;
+    }
+    uint32_t entry;
+    for (entry = prefixGet(spec, HISTORY_PREFIX); entry; entry = histPrev[entry - 1])
+        if (entryLength(entry) >= len && memcmp(histMap + histOffsets[entry - 1], spec, len) == 0)
+            return entryCopy(entry);
+    return 0;
+}
+
+/*
+    * Expand a history designator at the start of a line (!!, !n, !-n, !prefix, !?substr?); the rest of the line is kept.
+    * INPUT: the command line
+    * OUTPUT: newly allocated expanded line, NULL (with a message) if the event is not found. A line without
+    *         designator is returned as a copy.
+*/
+char * historyExpand(char * line)
+{
+    if (line[0] != '!' || line[1] == 0 || line[1] == ' ')
+        return strdup(line);
+
+    const char * spec = line + 1;
+    size_t len;
+    const char * rest;
+    if (spec[0] == '?')
+    {
+        const char * close = strchr(spec + 1, '?');
+        len = close ? (size_t)(close - spec) : strlen(spec);
+        rest = close ? close + 1 : spec + len;
+    }
+    else
+    {
+        len = strcspn(spec, " ");
+        rest = spec + len;
+    }
+
+    char * entry = historyFind(spec, len);
+    if (!entry)
+    {
+        fprintf(stderr, "[Error] %.*s: event not found\n", (int)len + 1, line);
+        return 0;
+    }
+
+    size_t entryLen = strlen(entry);
+    char * expanded = realloc(entry, entryLen + strlen(rest) + 1);
+    if (!checkMemoryValid(expanded))
+        exit(EXIT_FAILURE);
+    strcpy(expanded + entryLen, rest);
+    return expanded;
+}
+
+/*
+    * "history [n]": print the last n entries (the ring size by default) with their numbers.
+    * INPUT: array of command's arguments
+    * OUTPUT: 1
+*/
+int builtinHistory(char ** args)
+{
+    long n = args[1] ? atol(args[1]) : HISTORY_RING;
+    long i;
+
+    historySync();
+    if (histFd == -1)
+    {
+        for (i = ringLen > n ? ringLen - n : 0; i < ringLen; i++)
+            printf("%5ld  %s\n", i + 1, ring[(ringStart + i) % HISTORY_RING]);
+        return 1;
+    }
+    for (i = (long)histCount > n ? (long)histCount - n : 0; i < (long)histCount; i++)
+        printf("%5ld  %.*s\n", i + 1, (int)entryLength(i + 1), histMap + histOffsets[i]);
+    return 1;
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include <stddef.h>
+#define HISTORY_RING 1000 // entries of the current session kept in memory
+#define HISTORY_PREFIX 7 // longest prefix indexed directly for !prefix
+#define HISTORY_GRAM 3 // bytes of the substrings indexed for !?substr?, shorter needles scan the file
+#define HISTORY_FILE ".pltsh_history" // in $HOME, unless $PLTSH_HISTFILE is set
+
+void historyInit(int persist);
+void historyAdd(char * line);
+char * historyExpand(char * line);
+int builtinHistory(char ** args);
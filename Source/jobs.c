@@ -0,0 +1,396 @@
+#include "jobs.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/*
+ * Job table. It is only resized or compacted with SIGCHLD blocked, so the handler always sees a consistent array.
+*/
+static Job * jobTable = 0;
+static int numJobs = 0;
+static int capJobs = 0;
+
+/*
+    * Record a new wait status for a job.
+    * INPUT: pid of the job, raw wait status
+    * OUTPUT: void
+    * NOTE: async-signal-safe, called by the SIGCHLD handler and by code that reaps with waitpid(-1).
+*/
+void jobsUpdate(pid_t pid, int status)
+{
+    int i;
+    for (i = numJobs - 1; i >= 0; i--)
+    {
+        if (jobTable[i].pid == pid)
+        {
+            if (WIFSTOPPED(status))
+                jobTable[i].state = JOB_STOPPED;
+            else if (WIFCONTINUED(status))
+                jobTable[i].state = JOB_RUNNING;
+            else
+            {
+                jobTable[i].status = status;
+                jobTable[i].state = JOB_DONE;
+            }
+            return;
+        }
+    }
+}
+
+/*
+    * SIGCHLD handler: reap every child that changed state. SIGCHLD is blocked while the shell runs a
+    * command line, so only background jobs can be reaped here; foreground children are waited for explicitly.
+*/
+static void reapChildren(int sig)
+{
+    int savedErrno = errno;
+    int status;
+    pid_t pid;
+    (void)sig;
+    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0)
+        jobsUpdate(pid, status);
+    errno = savedErrno;
+}
+
+/*
+    * Install the SIGCHLD reaper.
+    * INPUT: void
+    * OUTPUT: void
+*/
+void jobsInit()
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = reapChildren;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, 0);
+}
+
+/*
+    * Block SIGCHLD while the shell launches and waits for foreground commands.
+    * INPUT: void
+    * OUTPUT: void
+*/
+void jobsBlock()
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, 0);
+}
+
+/*
+    * Unblock SIGCHLD: background jobs that ended in the meantime are reaped right away.
+    * INPUT: void
+    * OUTPUT: void
+*/
+void jobsUnblock()
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &set, 0);
+}
+
+/*
+    * Register a background command line.
+    * INPUT: pid of the subshell (leader of its process group), text of the command
+    * OUTPUT: id of the job
+    * NOTE: SIGCHLD must be blocked.
+*/
+int jobsAdd(pid_t pid, char * command)
+{
+    if (numJobs == capJobs)
+    {
+        capJobs = capJobs ? capJobs * 2 : 16;
+        jobTable = realloc(jobTable, capJobs * sizeof(Job));
+        if (!checkMemoryValid(jobTable))
+            exit(EXIT_FAILURE);
+    }
+
+    Job * job = &jobTable[numJobs];
+    job->id = numJobs ? jobTable[numJobs - 1].id + 1 : 1;
+    job->pid = pid;
+    job->command = strdup(command);
+    if (!checkMemoryValid(job->command))
+        exit(EXIT_FAILURE);
+    job->state = JOB_RUNNING;
+    job->status = 0;
+    numJobs++;
+    return job->id;
+}
+
+/*
+    * Describe the state of a job the way "jobs" prints it.
+    * INPUT: pointer to the job, buffer of at least 32 bytes
+    * OUTPUT: the buffer
+*/
+static char * describeJob(Job * job, char * buf)
+{
+    if (job->state == JOB_RUNNING)
+        strcpy(buf, "Running");
+    else if (job->state == JOB_STOPPED)
+        strcpy(buf, "Stopped");
+    else if (WIFSIGNALED(job->status))
+        sprintf(buf, "Killed (signal %d)", WTERMSIG(job->status));
+    else if (WEXITSTATUS(job->status) != 0)
+        sprintf(buf, "Exit %d", WEXITSTATUS(job->status));
+    else
+        strcpy(buf, "Done");
+    return buf;
+}
+
+/*
+    * Remove finished jobs from the table, printing a completion notice for each one.
+    * INPUT: 1 to print the notices (interactive shell), 0 to drop the jobs silently
+    * OUTPUT: void
+*/
+void jobsNotify(int verbose)
+{
+    char buf[32];
+    int i, n = 0;
+
+    jobsBlock();
+    for (i = 0; i < numJobs; i++)
+    {
+        if (jobTable[i].state == JOB_DONE)
+        {
+            if (verbose)
+                printf("[%d]  %-20s %s\n", jobTable[i].id, describeJob(&jobTable[i], buf), jobTable[i].command);
+            free(jobTable[i].command);
+        }
+        else
+            jobTable[n++] = jobTable[i];
+    }
+    numJobs = n;
+    jobsUnblock();
+    fflush(stdout);
+}
+
+/*
+    * Find a job from "%n", "%%"/"%+" (the last job) or a pid.
+    * INPUT: string of the job specification, NULL for the last job
+    * OUTPUT: pointer to the job, NULL (with a message) if there is none
+*/
+static Job * findJob(char * spec)
+{
+    int i;
+    if (!spec || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0)
+    {
+        if (numJobs > 0)
+            return &jobTable[numJobs - 1];
+        fprintf(stderr, "[Error] No current job\n");
+        return 0;
+    }
+
+    int byId = spec[0] == '%';
+    int n = atoi(spec + byId);
+    for (i = 0; i < numJobs; i++)
+        if ((byId && jobTable[i].id == n) || (!byId && jobTable[i].pid == n))
+            return &jobTable[i];
+
+    fprintf(stderr, "[Error] %s: no such job\n", spec);
+    return 0;
+}
+
+/*
+    * Wait in the foreground until a job stops or ends.
+    * INPUT: pointer to the job
+    * OUTPUT: exit status of the job, 128 + signal if it stopped
+    * NOTE: SIGCHLD is blocked while a command line runs, so the handler can not reap the job first.
+*/
+static int waitJob(Job * job)
+{
+    int status;
+    while (job->state == JOB_RUNNING)
+    {
+        pid_t pid = waitpid(job->pid, &status, WUNTRACED);
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            // already reaped by the handler
+            break;
+        }
+        jobsUpdate(pid, status);
+    }
+
+    if (job->state == JOB_STOPPED)
+    {
+        printf("\n[%d]+ Stopped %s\n", job->id, job->command);
+        return 128 + SIGTSTP;
+    }
+    if (WIFSIGNALED(job->status))
+        return 128 + WTERMSIG(job->status);
+    return WEXITSTATUS(job->status);
+}
+
+/*
+    * "jobs": list every job with its state.
+    * INPUT: array of command's arguments
+    * OUTPUT: 1
+*/
+int builtinJobs(char ** args)
+{
+    char buf[32];
+    int i;
+    (void)args;
+    for (i = 0; i < numJobs; i++)
+        printf("[%d]%c %-20s %s\n", jobTable[i].id, i == numJobs - 1 ? '+' : ' ', describeJob(&jobTable[i], buf), jobTable[i].command);
+    return 1;
+}
+
+/*
+    * "wait [%n|pid]...": wait for the given jobs, or every job without arguments.
+    * INPUT: array of command's arguments, output descriptor (unused)
+    * OUTPUT: exit status of the last job waited for (0 without arguments), 127 if a job does not exist
+*/
+int builtinWait(char ** args, int out)
+{
+    int status = 0, i;
+    if (!args[1])
+    {
+        for (i = 0; i < numJobs; i++)
+            if (jobTable[i].state == JOB_RUNNING)
+                waitJob(&jobTable[i]);
+        return 0;
+    }
+
+    for (i = 1; args[i]; i++)
+    {
+        Job * job = findJob(args[i]);
+        if (!job)
+            return 127;
+        status = waitJob(job);
+    }
+    return status;
+}
+
+/*
+    * "fg [%n]": continue a job in the foreground, with the terminal.
+    * INPUT: array of command's arguments, output descriptor (unused)
+    * OUTPUT: exit status of the job, 128 + signal if it stopped, 1 if there is no such job
+*/
+int builtinFg(char ** args, int out)
+{
+    Job * job = findJob(args[1]);
+    if (!job)
+        return 1;
+    if (job->state == JOB_DONE)
+        return waitJob(job);
+
+    printf("%s\n", job->command);
+    fflush(stdout);
+    int interactive = isatty(STDIN_FILENO);
+    if (interactive)
+        tcsetpgrp(STDIN_FILENO, job->pid);
+    job->state = JOB_RUNNING;
+    kill(-job->pid, SIGCONT);
+    int status = waitJob(job);
+    if (interactive)
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+    return status;
+}
+
+/*
+    * "bg [%n]": continue a stopped job in the background.
+    * INPUT: array of command's arguments
+    * OUTPUT: 1 if successful, 0 otherwise
+*/
+int builtinBg(char ** args)
+{
+    Job * job = findJob(args[1]);
+    if (!job)
+        return 0;
+    if (kill(-job->pid, SIGCONT) == -1)
+    {
+        perror("[Error] bg");
+        return 0;
+    }
+    job->state = JOB_RUNNING;
+    printf("[%d]+ %s &\n", job->id, job->command);
+    return 1;
+}
+
+/*
+ * Signals "kill" knows by name.
+*/
+static const struct { const char * name; int sig; } signalNames[] = {
+    {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL}, {"USR1", SIGUSR1},
+    {"USR2", SIGUSR2}, {"PIPE", SIGPIPE}, {"ALRM", SIGALRM}, {"TERM", SIGTERM}, {"CONT", SIGCONT},
+    {"STOP", SIGSTOP}, {"TSTP", SIGTSTP}, {0, 0}
+};
+
+/*
+    * Parse "-9", "-KILL" or "-SIGKILL".
+    * INPUT: string of the option (without '-')
+    * OUTPUT: signal number, -1 if unknown
+*/
+static int parseSignal(char * str)
+{
+    int i;
+    if (str[0] >= '0' && str[0] <= '9')
+        return atoi(str);
+    if (strncmp(str, "SIG", 3) == 0)
+        str += 3;
+    for (i = 0; signalNames[i].name; i++)
+        if (strcmp(str, signalNames[i].name) == 0)
+            return signalNames[i].sig;
+    return -1;
+}
+
+/*
+    * "kill [-SIG] %n|pid...": send a signal (SIGTERM by default) to a job's whole process group or to a pid.
+    * INPUT: array of command's arguments
+    * OUTPUT: 1 if every signal was sent, 0 otherwise
+*/
+int builtinKill(char ** args)
+{
+    int sig = SIGTERM;
+    int i = 1, ok = 1;
+
+    if (args[1] && args[1][0] == '-')
+    {
+        sig = parseSignal(args[1] + 1);
+        if (sig < 0)
+        {
+            fprintf(stderr, "[Error] kill: unknown signal %s\n", args[1]);
+            return 0;
+        }
+        i++;
+    }
+    if (!args[i])
+    {
+        fprintf(stderr, "[Error] Usage: kill [-SIG] %%n|pid...\n");
+        return 0;
+    }
+
+    for (; args[i]; i++)
+    {
+        pid_t target;
+        if (args[i][0] == '%')
+        {
+            Job * job = findJob(args[i]);
+            if (!job)
+            {
+                ok = 0;
+                continue;
+            }
+            target = -job->pid;
+        }
+        else
+            target = atoi(args[i]);
+
+        if (kill(target, sig) == -1)
+        {
+            perror("[Error] kill");
+            ok = 0;
+        }
+    }
+    return ok;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <sys/types.h>
+#include <signal.h>
+
+#define JOB_RUNNING 0
+#define JOB_STOPPED 1
+#define JOB_DONE 2
+
+/*
+ * A background command line. The subshell running it leads its own process group (pid == process group id).
+*/
+typedef struct Job {
+    int id;
+    pid_t pid;
+    char * command;
+    volatile sig_atomic_t state; // updated by the SIGCHLD handler
+    volatile sig_atomic_t status; // raw wait status once the job is done
+} Job;
+
+void jobsInit();
+void jobsBlock();
+void jobsUnblock();
+int jobsAdd(pid_t pid, char * command);
+void jobsUpdate(pid_t pid, int status);
+void jobsNotify(int verbose);
+int builtinJobs(char ** args);
+int builtinWait(char ** args, int out);
+int builtinFg(char ** args, int out);
+int builtinBg(char ** args);
+int builtinKill(char ** args);
@@ -0,0 +1,221 @@
+#include "launch.h"
+#include "hash.h"
+#include "forkserver.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <signal.h>
+
+extern char ** environ;
+
+int spawnEngine = SPAWN_ENGINE_POSIX;
+
+/*
+ * Number of descriptors other than STDIN, STDOUT and STDERR that launched commands must inherit (process substitutions).
+*/
+int spawnInheritFds = 0;
+
+/*
+ * CPUs and memory node of the commands launched while it is set (a "@cpus=" prefix, a pipeline stage under the
+ * affinity option), NULL to leave them to the kernel.
+*/
+const Placement * spawnPlacement = 0;
+
+/*
+    * Select the launch engine. PLTSH_SPAWN=fork forces the fork() fallback, PLTSH_SPAWN=server starts the fork server
+    * (like "set forkserver=on"), anything else keeps posix_spawn.
+    * INPUT: void
+    * OUTPUT: void
+    * NOTE: Called once by main() before the shell loop starts.
+*/
+void spawnInit()
+{
+    char * engine = getenv("PLTSH_SPAWN");
+    spawnEngine = SPAWN_ENGINE_POSIX;
+    if (engine && strcmp(engine, "fork") == 0)
+        spawnEngine = SPAWN_ENGINE_FORK;
+    else if (engine && strcmp(engine, "server") == 0)
+        forkServerStart();
+}
+
+/*
+    * Put the signals the shell handles for itself back to default in a freshly forked child.
+    * INPUT: void
+    * OUTPUT: void
+    * NOTE: every fork() site of the shell calls it in the child.
+*/
+void resetChildSignals()
+{
+    sigset_t empty;
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, 0);
+}
+
+/*
+    * Launch with fork() + execve(). The child wires fdIn/fdOut to STDIN/STDOUT, then applies the redirections before exec,
+    * and falls back to a PATH search with execvp() if the resolved path went stale.
+    * INPUT: resolved path, array of command's arguments, input and output descriptors (-1 to inherit), process group,
+    *        redirections (NULL for none)
+    * OUTPUT: pid of the child, -1 if fork failed
+*/
+static pid_t forkCommand(char * path, char ** args, int fdIn, int fdOut, pid_t pgid, const Redirects * redirects)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        if (pgid != -1)
+            setpgid(0, pgid);
+        resetChildSignals();
+        if (fdIn != -1 && fdIn != STDIN_FILENO)
+            dup2(fdIn, STDIN_FILENO);
+        if (fdOut != -1 && fdOut != STDOUT_FILENO)
+            dup2(fdOut, STDOUT_FILENO);
+        if (redirects && redirectApply(redirects) == -1)
+            exit(1);
+        execve(path, args, environ);
+        if (path != args[0])
+            execvp(args[0], args);
+        fprintf(stderr, "[Error] Invalid command.\n");
+        exit(1); // without it the child process would keep running the shell
+    }
+    return pid;
+}
+
+/*
+    * Launch with posix_spawnp(). glibc implements it with clone(CLONE_VM|CLONE_VFORK), so the shell's
+    * page tables are never copied and the cost stays flat as the heap grows. Descriptors are wired
+    * and redirection files opened through spawn file actions instead of code running in the child.
+    * INPUT: resolved path, array of command's arguments, input and output descriptors (-1 to inherit), process group,
+    *        redirections (NULL for none)
+    * OUTPUT: pid of the child, -1 with errno set on failure, SPAWN_REDIRECT_FAILED with errno set if a redirection failed
+*/
+static pid_t posixSpawnCommand(char * path, char ** args, int fdIn, int fdOut, pid_t pgid, const Redirects * redirects)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults, mask;
+    pid_t pid;
+    int err;
+
+    if ((err = posix_spawn_file_actions_init(&actions)) != 0)
+    {
+        errno = err;
+        return -1;
+    }
+    if ((err = posix_spawnattr_init(&attr)) != 0)
+    {
+        posix_spawn_file_actions_destroy(&actions);
+        errno = err;
+        return -1;
+    }
+
+    // signals the shell handles or blocks for itself must be back to default in the command
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGTTOU);
+    sigaddset(&defaults, SIGCHLD);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+
+    // the group is joined in the child, before exec: no window where a pipeline stage runs outside it
+    if (pgid != -1)
+    {
+        posix_spawnattr_setpgroup(&attr, pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    if (fdIn != -1 && fdIn != STDIN_FILENO)
+        posix_spawn_file_actions_adddup2(&actions, fdIn, STDIN_FILENO);
+    if (fdOut != -1 && fdOut != STDOUT_FILENO)
+        posix_spawn_file_actions_adddup2(&actions, fdOut, STDOUT_FILENO);
+    if (redirects)
+        err = redirectAddActions(&actions, redirects);
+
+    if (err == 0)
+        err = posix_spawn(&pid, path, &actions, &attr, args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (err != 0)
+    {
+        errno = err;
+        // the file actions fail with the same error numbers as exec: a runnable path means a redirection failed
+        if (redirects && redirects->count > 0 && err != ENOEXEC && err != E2BIG && access(path, X_OK) == 0)
+            return SPAWN_REDIRECT_FAILED;
+        return -1;
+    }
+    return pid;
+}
+
+/*
+    * Launch an external command with the selected engine, falling back to fork() when posix_spawn
+    * (or the fork server) is unavailable or runs out of resources. The command is resolved through the hash table and
+    * executed by path; a remembered path that no longer exists is forgotten and searched again.
+    * INPUT: array of command's arguments, input and output descriptors (-1 to inherit),
+    *        process group to join (0 to lead a new one, -1 to stay in the shell's), redirections applied in the child
+    *        after fdIn/fdOut (NULL for none)
+    * OUTPUT: pid of the child, -1 with errno set on failure (ENOENT, EACCES... when the command is invalid),
+    *         SPAWN_REDIRECT_FAILED with errno set when a redirection could not be applied
+*/
+static pid_t launchCommand(char ** args, int fdIn, int fdOut, pid_t pgid, const Redirects * redirects)
+{
+    int retry;
+    for (retry = 0; retry < 2; retry++)
+    {
+        char * path = hashLookup(args[0]);
+        if (!path)
+        {
+            errno = ENOENT;
+            return -1;
+        }
+
+        if (spawnEngine == SPAWN_ENGINE_FORK)
+            return forkCommand(path, args, fdIn, fdOut, pgid, redirects);
+
+        // the fork server only passes the standard descriptors, opens no files and runs on its own CPUs
+        int server = spawnEngine == SPAWN_ENGINE_SERVER && spawnInheritFds == 0 && (!redirects || redirects->count == 0) && !spawnPlacement;
+        pid_t pid = -1;
+        if (server)
+            pid = forkServerSpawn(path, args, fdIn, fdOut, pgid);
+        if (!server || spawnEngine == SPAWN_ENGINE_POSIX) // also when the fork server was just lost
+            pid = posixSpawnCommand(path, args, fdIn, fdOut, pgid, redirects);
+        if (pid != -1)
+            return pid;
+        if (errno == ENOENT && path != args[0])
+        {
+            hashForget(args[0]);
+            continue;
+        }
+        if (errno == ENOSYS || errno == EAGAIN || errno == ENOMEM)
+            return forkCommand(path, args, fdIn, fdOut, pgid, redirects);
+        return -1;
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+/*
+    * Launch an external command (see launchCommand()), in the placement of spawnPlacement when it is set: the shell's
+    * thread moves there for the launch, so the command inherits it before exec and finds its first pages on its node.
+    * INPUT: array of command's arguments, input and output descriptors (-1 to inherit), process group to join (0 to lead
+    *        a new one, -1 to stay in the shell's), redirections applied in the child (NULL for none)
+    * OUTPUT: pid of the child, -1 with errno set on failure, SPAWN_REDIRECT_FAILED with errno set when a redirection
+    *         could not be applied
+*/
+pid_t spawnCommand(char ** args, int fdIn, int fdOut, pid_t pgid, const Redirects * redirects)
+{
+    if (!spawnPlacement)
+        return launchCommand(args, fdIn, fdOut, pgid, redirects);
+
+    placementEnter(spawnPlacement);
+    pid_t pid = launchCommand(args, fdIn, fdOut, pgid, redirects);
+    placementLeave();
+    return pid;
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include "redirect.h"
+#include "placement.h"
+#include <sys/types.h>
+
+#define SPAWN_ENGINE_POSIX 0 // posix_spawn: vfork-style launch, no page table copy
+#define SPAWN_ENGINE_FORK 1 // classic fork() + execvp(), kept as fallback
+#define SPAWN_ENGINE_SERVER 2 // requests to the fork server, which clones from its own small image
+#define SPAWN_REDIRECT_FAILED -2 // returned by spawnCommand() when a redirection could not be applied in the child
+
+extern int spawnEngine;
+extern int spawnInheritFds;
+extern const Placement * spawnPlacement;
+
+void spawnInit();
+void resetChildSignals();
+pid_t spawnCommand(char ** args, int fdIn, int fdOut, pid_t pgid, const Redirects * redirects);
@@ -2,8 +2,34 @@
 #include <stdio.h>
 #include "utils.h"
 #include "process.h"
-int main(){
-    shLoop();
+#include "launch.h"
+#include "forkserver.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * PLTsh             interactive (or STDIN) mode
+ * PLTsh -c command  run one command line
+ * PLTsh script      run every line of a script file
+ * PLTsh --fork-server FD  internal: the fork server started by "set forkserver=on"
+*/
+int main(int argc, char ** argv){
+    if (argc > 2 && strcmp(argv[1], FORK_SERVER_FLAG) == 0)
+        return forkServerMain(atoi(argv[2]));
+    spawnInit();
+    shInit();
+    if (argc > 1 && strcmp(argv[1], "-c") == 0)
+    {
+        if (argc < 3)
+        {
+            fprintf(stderr, "[Error] -c requires an argument\n");
+            return 2;
+        }
+        return runString(argv[2]);
+    }
+    if (argc > 1)
+        return runScript(argv[1]);
+    return shLoop();
     /*
     char * str = readLine();
     printf("%s\n",str);
@@ -15,5 +41,4 @@ int main(){
         printf("%s\n",*args);
         args++;
     }*/
-    return 0;
 }
\ No newline at end of file
@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+#include "mover.h"
+#include "options.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+/*
+    * Copy with copy_file_range(): file to file, the kernel (or the filesystem) moves the blocks.
+    * INPUT: input and output descriptors, pointer to the running byte count
+    * OUTPUT: 1 when done, 0 if the call is not supported for these descriptors, -1 on error
+*/
+static int moveCopyRange(int fdIn, int fdOut, long long * total)
+{
+    while (1)
+    {
+        ssize_t n = copy_file_range(fdIn, NULL, fdOut, NULL, MOVER_CHUNK, 0);
+        if (n == 0)
+            return 1;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (*total == 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP || errno == EBADF))
+                return 0;
+            return -1;
+        }
+        *total += n;
+    }
+}
+
+/*
+    * Copy with splice(): one side is a pipe, pages are moved between the pipe and the other descriptor.
+    * INPUT: input and output descriptors, pointer to the running byte count
+    * OUTPUT: 1 when done, 0 if the call is not supported for these descriptors, -1 on error
+*/
+static int moveSplice(int fdIn, int fdOut, long long * total)
+{
+    while (1)
+    {
+        ssize_t n = splice(fdIn, NULL, fdOut, NULL, MOVER_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n == 0)
+            return 1;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (*total == 0 && (errno == EINVAL || errno == ENOSYS))
+                return 0;
+            return -1;
+        }
+        *total += n;
+    }
+}
+
+/*
+    * Copy with sendfile(): the input must be a regular (mmap-able) file, the output can be anything.
+    * INPUT: input and output descriptors, pointer to the running byte count
+    * OUTPUT: 1 when done, 0 if the call is not supported for these descriptors, -1 on error
+*/
+static int moveSendfile(int fdIn, int fdOut, long long * total)
+{
+    while (1)
+    {
+        ssize_t n = sendfile(fdOut, fdIn, NULL, MOVER_CHUNK);
+        if (n == 0)
+            return 1;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (*total == 0 && (errno == EINVAL || errno == ENOSYS))
+                return 0;
+            return -1;
+        }
+        *total += n;
+    }
+}
+
+/*
+    * Plain read()/write() loop, used when none of the zero-copy calls apply (terminals, sockets...).
+    * INPUT: input and output descriptors, pointer to the running byte count
+    * OUTPUT: 1 when done, -1 on error
+*/
+static int moveReadWrite(int fdIn, int fdOut, long long * total)
+{
+    char * buffer = malloc(MOVER_CHUNK);
+    if (!buffer)
+        return -1;
+
+    while (1)
+    {
+        ssize_t n = read(fdIn, buffer, MOVER_CHUNK);
+        if (n == 0)
+            break;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            free(buffer);
+            return -1;
+        }
+
+        ssize_t done = 0;
+        while (done < n)
+        {
+            ssize_t w = write(fdOut, buffer + done, n - done);
+            if (w < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                free(buffer);
+                return -1;
+            }
+            done += w;
+        }
+        *total += n;
+    }
+
+    free(buffer);
+    return 1;
+}
+
+/*
+    * Move everything readable from fdIn to fdOut inside the kernel when possible:
+    * copy_file_range between files, splice when a pipe is involved, sendfile from a file,
+    * and a read()/write() loop otherwise.
+    * INPUT: input and output descriptors
+    * OUTPUT: number of bytes moved, -1 with errno set on error
+*/
+long long moveData(int fdIn, int fdOut)
+{
+    struct stat in, out;
+    long long total = 0;
+    int done = 0;
+
+    if (fstat(fdIn, &in) == -1 || fstat(fdOut, &out) == -1)
+        return -1;
+
+    if (S_ISREG(in.st_mode) && S_ISREG(out.st_mode))
+        done = moveCopyRange(fdIn, fdOut, &total);
+    if (done == 0 && (S_ISFIFO(in.st_mode) || S_ISFIFO(out.st_mode)))
+        done = moveSplice(fdIn, fdOut, &total);
+    if (done == 0 && S_ISREG(in.st_mode))
+        done = moveSendfile(fdIn, fdOut, &total);
+    if (done == 0)
+        done = moveReadWrite(fdIn, fdOut, &total);
+
+    return done < 0 ? -1 : total;
+}
+
+/*
+    * Move bytes out of a pipe: splice() when the target accepts it, read()/write() otherwise (a terminal).
+    * INPUT: pipe descriptor, target descriptor, pointer to the number of bytes left (updated even on error, the bytes
+    *        taken from the pipe are counted as moved), buffer of MOVER_CHUNK bytes for the fallback
+    * OUTPUT: 0 if done, -1 with errno set on error
+*/
+static int drainPipe(int pipeFd, int fdOut, size_t * len, char * buffer)
+{
+    int useSplice = 1;
+    while (*len > 0)
+    {
+        ssize_t n;
+        if (useSplice)
+        {
+            n = splice(pipeFd, NULL, fdOut, NULL, *len, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n < 0 && errno == EINVAL)
+            {
+                useSplice = 0;
+                continue;
+            }
+        }
+        else
+            n = read(pipeFd, buffer, *len < MOVER_CHUNK ? *len : MOVER_CHUNK);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+        {
+            errno = EIO; // the bytes counted by tee() must be there
+            return -1;
+        }
+        *len -= n;
+
+        ssize_t done = useSplice ? n : 0;
+        while (done < n)
+        {
+            ssize_t w = write(fdOut, buffer + done, n - done);
+            if (w < 0 && errno != EINTR)
+                return -1;
+            if (w > 0)
+                done += w;
+        }
+    }
+    return 0;
+}
+
+/*
+    * Copy everything read from a pipe to several outputs without bringing it to user memory: every chunk is
+    * duplicated with tee() into one pipe per extra output, then each copy is spliced to its output; the last
+    * output consumes the source pipe itself. An output that fails is replaced by /dev/null so the others go on.
+    * INPUT: source pipe, array of output descriptors, number of outputs
+    * OUTPUT: number of bytes read from the source, -1 with errno set (of the first failure) on error
+*/
+long long teeData(int fdIn, int * fdOuts, int numOuts)
+{
+    int (*copies)[2] = calloc(numOuts, sizeof(int[2]));
+    char * buffer = malloc(MOVER_CHUNK);
+    long long total = 0;
+    int failure = 0;
+    int i;
+
+    if (!copies || !buffer)
+    {
+        free(copies);
+        free(buffer);
+        return -1;
+    }
+    for (i = 0; i < numOuts - 1; i++)
+    {
+        if (makePipe(copies[i]) == -1)
+        {
+            failure = errno;
+            numOuts = i + 1; // the outputs left get nothing
+            break;
+        }
+        // the copy must take a whole chunk of the source in one tee()
+        fcntl(copies[i][1], F_SETPIPE_SZ, fcntl(fdIn, F_GETPIPE_SZ));
+    }
+
+    while (1)
+    {
+        ssize_t n = numOuts > 1 ? tee(fdIn, copies[0][1], MOVER_CHUNK, 0) : splice(fdIn, NULL, fdOuts[0], NULL, MOVER_CHUNK, SPLICE_F_MOVE);
+        if (n == 0)
+            break;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (!failure)
+                failure = errno;
+            break;
+        }
+        if (numOuts == 1)
+        {
+            total += n;
+            continue;
+        }
+
+        for (i = 1; i < numOuts - 1; i++)
+        {
+            ssize_t m;
+            while ((m = tee(fdIn, copies[i][1], n, 0)) < 0 && errno == EINTR);
+            if (m != n)
+            {
+                if (!failure)
+                    failure = m < 0 ? errno : EIO;
+                goto done;
+            }
+        }
+        for (i = 0; i < numOuts; i++)
+        {
+            int source = i < numOuts - 1 ? copies[i][0] : fdIn;
+            size_t left = n;
+            if (drainPipe(source, fdOuts[i], &left, buffer) == -1)
+            {
+                if (!failure)
+                    failure = errno;
+                int devNull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+                if (devNull == -1 || drainPipe(source, devNull, &left, buffer) == -1)
+                    goto done;
+                dup2(devNull, fdOuts[i]);
+                close(devNull);
+            }
+        }
+        total += n;
+    }
+
+done:
+    for (i = 0; i < numOuts - 1; i++)
+    {
+        close(copies[i][0]);
+        close(copies[i][1]);
+    }
+    free(copies);
+    free(buffer);
+    if (failure)
+    {
+        errno = failure;
+        return -1;
+    }
+    return total;
+}
+
+/*
+    * Check if a command only moves data: "cat" whose operands are all files (no options).
+    * INPUT: array of command's arguments, stripped of redirections
+    * OUTPUT: 1 if the command can be served by moveData, 0 otherwise
+*/
+int isMoverCommand(char ** args)
+{
+    int i;
+    if (strcmp(args[0], "cat") != 0)
+        return 0;
+    for (i = 1; args[i]; i++)
+        if (args[i][0] == '-' && args[i][1] != 0)
+            return 0;
+    return 1;
+}
+
+/*
+    * In-shell "cat": move every file (or fdIn when there is none, or for "-") to fdOut.
+    * SIGPIPE is held back while writing so that a consumer leaving early ends the copy, not the shell.
+    * INPUT: NULL-terminated list of file names, input and output descriptors
+    * OUTPUT: exit status, as cat would report it (141 when the reader went away)
+*/
+int catFiles(char ** files, int fdIn, int fdOut)
+{
+    sigset_t pipeSet, savedSet;
+    struct timespec zero = {0, 0};
+    char * fromInput[] = {"-", 0};
+    int status = 0;
+    int i;
+
+    if (files[0] == 0)
+        files = fromInput;
+
+    sigemptyset(&pipeSet);
+    sigaddset(&pipeSet, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &pipeSet, &savedSet);
+
+    for (i = 0; files[i]; i++)
+    {
+        int fd = fdIn;
+        if (strcmp(files[i], "-") != 0)
+        {
+            fd = open(files[i], O_RDONLY | O_CLOEXEC);
+            if (fd == -1)
+            {
+                fprintf(stderr, "cat: %s: %s\n", files[i], strerror(errno));
+                status = 1;
+                continue;
+            }
+        }
+
+        long long moved = moveData(fd, fdOut);
+        int err = errno;
+        if (fd != fdIn)
+            close(fd);
+
+        if (moved < 0)
+        {
+            if (err == EPIPE)
+            {
+                status = 128 + SIGPIPE;
+                break;
+            }
+            fprintf(stderr, "cat: %s: %s\n", files[i], strerror(err));
+            status = 1;
+        }
+    }
+
+    // drop the SIGPIPE raised by the failed write before unblocking it
+    while (sigtimedwait(&pipeSet, NULL, &zero) > 0);
+    sigprocmask(SIG_SETMASK, &savedSet, NULL);
+    return status;
+}
@@ -0,0 +1,7 @@
+#pragma once
+#define MOVER_CHUNK (1 << 20) // bytes requested per splice/sendfile/copy_file_range call
+
+long long moveData(int fdIn, int fdOut);
+long long teeData(int fdIn, int * fdOuts, int numOuts);
+int isMoverCommand(char ** args);
+int catFiles(char ** files, int fdIn, int fdOut);
@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+#include "options.h"
+#include "launch.h"
+#include "forkserver.h"
+#include "cache.h"
+#include "placement.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+long optPipeSize = 0;
+int optTiming = 0;
+long optCacheSize = CACHE_DEFAULT_SIZE;
+int optBatchJobs = 1;
+long optBatchLimit = 0;
+int optAffinity = PLACEMENT_NONE;
+
+/*
+    * Parse a size such as 65536, 256K or 1M.
+    * INPUT: string of the size
+    * OUTPUT: number of bytes, -1 if the string is not a size
+*/
+static long parseSize(char * str)
+{
+    char * end;
+    long value = strtol(str, &end, 10);
+    if (end == str || value < 0)
+        return -1;
+
+    if (*end == 'k' || *end == 'K')
+        value <<= 10, end++;
+    else if (*end == 'm' || *end == 'M')
+        value <<= 20, end++;
+    else if (*end == 'g' || *end == 'G')
+        value <<= 30, end++;
+
+    return *end ? -1 : value;
+}
+
+/*
+    * Read the largest pipe buffer an unprivileged process may request.
+    * INPUT: void
+    * OUTPUT: limit in bytes, -1 if it can not be read
+*/
+static long pipeMaxSize()
+{
+    long value = -1;
+    FILE * f = fopen(PIPE_MAX_SIZE_FILE, "r");
+    if (!f)
+        return -1;
+    if (fscanf(f, "%ld", &value) != 1)
+        value = -1;
+    fclose(f);
+    return value;
+}
+
+/*
+    * Create a close-on-exec pipe and resize its buffer to optPipeSize when it is set.
+    * INPUT: array receiving the read end (fds[0]) and the write end (fds[1])
+    * OUTPUT: 0 on success, -1 with errno set if the pipe could not be created
+    * NOTE: a refused resize (per-user pipe memory limits) keeps the pipe at the kernel default.
+    *       Commands only get the ends dup2()ed onto their STDIN/STDOUT, never the other pipes of the line.
+*/
+int makePipe(int fds[2])
+{
+    if (pipe2(fds, O_CLOEXEC) == -1)
+        return -1;
+    if (optPipeSize > 0)
+        fcntl(fds[1], F_SETPIPE_SZ, (int)optPipeSize);
+    return 0;
+}
+
+/*
+    * Apply "pipesize=SIZE": clamp to the system limit and keep the size the kernel really grants. A size the kernel
+    * refuses leaves the setting as it was.
+    * INPUT: string of the size, "default" or 0 to go back to the kernel default
+    * OUTPUT: 1 if successful, 0 otherwise
+*/
+static int setPipeSize(char * value)
+{
+    long size = strcmp(value, "default") == 0 ? 0 : parseSize(value);
+    if (size < 0)
+    {
+        fprintf(stderr, "[Error] Invalid pipe size: %s\n", value);
+        return 0;
+    }
+    if (size == 0)
+    {
+        optPipeSize = 0;
+        printf("pipesize: kernel default\n");
+        return 1;
+    }
+
+    long max = pipeMaxSize();
+    if (max > 0 && size > max)
+        size = max;
+    if (size > 0x7fffffffL)
+        size = 0x7fffffffL;
+
+    // measure the size granted on a probe pipe: the kernel rounds up to a power of two pages
+    int fds[2];
+    if (pipe(fds) == -1)
+    {
+        perror("[Error] Create pipe failed");
+        return 0;
+    }
+    int granted = fcntl(fds[1], F_SETPIPE_SZ, (int)size);
+    int err = errno;
+    close(fds[0]);
+    close(fds[1]);
+    if (granted == -1)
+    {
+        fprintf(stderr, "[Error] pipesize: %ld: %s\n", size, strerror(err));
+        return 0;
+    }
+
+    // the pipes of the shell get what the kernel granted, not what was asked
+    optPipeSize = granted;
+    printf("pipesize: requested %ld, granted %d (limit %ld)\n", size, granted, max);
+    return 1;
+}
+
+/*
+    * Parse an on/off switch.
+    * INPUT: string of the value
+    * OUTPUT: 1 for on, 0 for off, -1 otherwise
+*/
+static int parseSwitch(char * value)
+{
+    if (strcmp(value, "on") == 0 || strcmp(value, "1") == 0)
+        return 1;
+    if (strcmp(value, "off") == 0 || strcmp(value, "0") == 0)
+        return 0;
+    return -1;
+}
+
+/*
+    * Handle one "name=value" argument of the set built-in.
+    * INPUT: string of the assignment
+    * OUTPUT: 1 if successful, 0 otherwise
+*/
+int setOption(char * assignment)
+{
+    char * eq = strchr(assignment, '=');
+    if (!eq)
+    {
+        fprintf(stderr, "[Error] Usage: set name=value\n");
+        return 0;
+    }
+
+    if (strncmp(assignment, "pipesize", eq - assignment) == 0 && eq - assignment == 8)
+        return setPipeSize(eq + 1);
+    if (strncmp(assignment, "timing", eq - assignment) == 0 && eq - assignment == 6)
+    {
+        int on = parseSwitch(eq + 1);
+        if (on < 0)
+        {
+            fprintf(stderr, "[Error] Usage: set timing=on|off\n");
+            return 0;
+        }
+        optTiming = on;
+        return 1;
+    }
+    if (strncmp(assignment, "cachesize", eq - assignment) == 0 && eq - assignment == 9)
+    {
+        long size = parseSize(eq + 1);
+        if (size < 0)
+        {
+            fprintf(stderr, "[Error] Invalid cache size: %s\n", eq + 1);
+            return 0;
+        }
+        optCacheSize = size;
+        return 1;
+    }
+    if (strncmp(assignment, "forkserver", eq - assignment) == 0 && eq - assignment == 10)
+    {
+        int on = parseSwitch(eq + 1);
+        if (on < 0)
+        {
+            fprintf(stderr, "[Error] Usage: set forkserver=on|off\n");
+            return 0;
+        }
+        if (!on)
+            forkServerStop();
+        return on ? forkServerStart() : 1;
+    }
+
+    if (strncmp(assignment, "batchjobs", eq - assignment) == 0 && eq - assignment == 9)
+    {
+        char * end = "";
+        long jobs = strcmp(eq + 1, "auto") == 0 ? 0 : strtol(eq + 1, &end, 10);
+        if (end == eq + 1 || *end || jobs < 0 || jobs > INT_MAX)
+        {
+            fprintf(stderr, "[Error] Usage: set batchjobs=N|auto\n");
+            return 0;
+        }
+        optBatchJobs = jobs;
+        return 1;
+    }
+
+    if (strncmp(assignment, "batchlimit", eq - assignment) == 0 && eq - assignment == 10)
+    {
+        long size = strcmp(eq + 1, "auto") == 0 ? 0 : parseSize(eq + 1);
+        if (size < 0)
+        {
+            fprintf(stderr, "[Error] Usage: set batchlimit=SIZE|auto\n");
+            return 0;
+        }
+        optBatchLimit = size;
+        return 1;
+    }
+
+    if (strncmp(assignment, "affinity", eq - assignment) == 0 && eq - assignment == 8)
+    {
+        static const char * policies[] = {"none", "compact", "spread"};
+        int i;
+        for (i = 0; i < 3; i++)
+        {
+            if (strcmp(eq + 1, policies[i]) == 0)
+            {
+                optAffinity = i;
+                return 1;
+            }
+        }
+        fprintf(stderr, "[Error] Usage: set affinity=compact|spread|none\n");
+        return 0;
+    }
+
+    fprintf(stderr, "[Error] Unknown option: %.*s\n", (int)(eq - assignment), assignment);
+    return 0;
+}
+
+/*
+    * Print the current value of every option.
+    * INPUT: void
+    * OUTPUT: void
+*/
+void printOptions()
+{
+    if (optPipeSize > 0)
+        printf("pipesize=%ld\n", optPipeSize);
+    else
+        printf("pipesize=default\n");
+    printf("timing=%s\n", optTiming ? "on" : "off");
+    printf("cachesize=%ld\n", optCacheSize);
+    printf("forkserver=%s\n", spawnEngine == SPAWN_ENGINE_SERVER ? "on" : "off");
+    if (optBatchJobs > 0)
+        printf("batchjobs=%d\n", optBatchJobs);
+    else
+        printf("batchjobs=auto\n");
+    if (optBatchLimit > 0)
+        printf("batchlimit=%ld\n", optBatchLimit);
+    else
+        printf("batchlimit=auto\n");
+    printf("affinity=%s\n", optAffinity == PLACEMENT_COMPACT ? "compact" : optAffinity == PLACEMENT_SPREAD ? "spread" : "none");
+}
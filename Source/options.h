@@ -0,0 +1,14 @@
+#pragma once
+#define PIPE_MAX_SIZE_FILE "/proc/sys/fs/pipe-max-size"
+
+extern long optPipeSize; // bytes requested for every pipe the shell creates, 0 keeps the kernel default
+extern int optTiming; // report the resource usage of every command and pipeline stage
+
+extern long optCacheSize; // bytes the cache builtin keeps on disk
+extern int optAffinity; // PLACEMENT_NONE, PLACEMENT_COMPACT or PLACEMENT_SPREAD
+extern int optBatchJobs; // batches of an oversized command run at once, 0 for one per online CPU
+extern long optBatchLimit; // bytes of arguments a batch may take, 0 for what ARG_MAX leaves
+
+int setOption(char * assignment);
+void printOptions();
+int makePipe(int fds[2]);
@@ -0,0 +1,282 @@
+#define _GNU_SOURCE
+#include "parallel.h"
+#include "launch.h"
+#include "mover.h"
+#include "jobs.h"
+#include "process.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+/*
+ * One work item: the command run with one argument, its captured output and its result.
+*/
+typedef struct Task {
+    char * item;
+    pid_t pid;
+    int out; // memfd holding the stdout of the task, -1 once printed
+    int status;
+    int done;
+} Task;
+
+/*
+    * Read the work items from STDIN, one per line.
+    * INPUT: pointer to receive the buffer holding the items, pointer to an integer to receive the number of items
+    * OUTPUT: array of items, pointing inside the buffer
+*/
+static char ** readItems(char ** buffer, int * numItems)
+{
+    size_t cap = READ_CHUNK, len = 0;
+    char * data = malloc(cap);
+    if (!checkMemoryValid(data))
+        exit(EXIT_FAILURE);
+
+    while (1)
+    {
+        // keep one byte for the terminator of the last line
+        if (len + 1 >= cap)
+        {
+            cap *= 2;
+            data = realloc(data, cap);
+            if (!checkMemoryValid(data))
+                exit(EXIT_FAILURE);
+        }
+        ssize_t n = read(STDIN_FILENO, data + len, cap - len - 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len += n;
+    }
+    data[len] = 0;
+
+    // split in place: every non-empty line becomes a string inside data
+    int count = 1, i = 0;
+    size_t pos, start = 0;
+    for (pos = 0; pos < len; pos++)
+        if (data[pos] == '\n')
+            count++;
+    char ** items = malloc((count + 1) * sizeof(char *));
+    if (!checkMemoryValid(items))
+        exit(EXIT_FAILURE);
+
+    for (pos = 0; pos <= len; pos++)
+    {
+        if (pos == len || data[pos] == '\n')
+        {
+            data[pos] = 0;
+            if (pos > start)
+                items[i++] = data + start;
+            start = pos + 1;
+        }
+    }
+    items[i] = 0;
+    *numItems = i;
+    *buffer = data;
+    return items;
+}
+
+/*
+    * Build the argv of a task: the item replaces every {} of the command, or is appended when there is none.
+    * INPUT: command arguments, number of them, the item
+    * OUTPUT: newly allocated argv (the strings are shared)
+*/
+static char ** buildTaskArgs(char ** command, int numCommand, char * item)
+{
+    char ** argv = malloc((numCommand + 2) * sizeof(char *));
+    if (!checkMemoryValid(argv))
+        exit(EXIT_FAILURE);
+
+    int i, replaced = 0;
+    for (i = 0; i < numCommand; i++)
+    {
+        if (strcmp(command[i], "{}") == 0)
+        {
+            argv[i] = item;
+            replaced = 1;
+        }
+        else
+            argv[i] = command[i];
+    }
+    if (!replaced)
+        argv[i++] = item;
+    argv[i] = 0;
+    return argv;
+}
+
+/*
+    * Copy the captured output of a task to STDOUT and release it.
+    * INPUT: pointer to the task
+    * OUTPUT: void
+*/
+static void flushTask(Task * task)
+{
+    if (task->out == -1)
+        return;
+    lseek(task->out, 0, SEEK_SET);
+    moveData(task->out, STDOUT_FILENO);
+    close(task->out);
+    task->out = -1;
+}
+
+/*
+    * "parallel [-j N] [-k] [--fail-fast] command [args...] [::: items...]": run the command once per item on a
+    * pool of at most N child processes (the online CPU count by default). Items come after ::: or, without it,
+    * one per line from STDIN. The stdout of every task is captured and printed as a whole when the task ends,
+    * or in input order with -k. --fail-fast stops launching and terminates the running tasks at the first failure.
+    * INPUT: array of command's arguments, output descriptor (unused: tasks write to STDOUT)
+    * OUTPUT: status of the first task (in input order) that failed, 0 if every task succeeded
+*/
+int builtinParallel(char ** args, int out)
+{
+    long maxJobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int keepOrder = 0, failFast = 0;
+    int i = 1;
+
+    // options
+    for (; args[i] && args[i][0] == '-'; i++)
+    {
+        if (strcmp(args[i], "-j") == 0 && args[i + 1])
+            maxJobs = atol(args[++i]);
+        else if (strcmp(args[i], "-k") == 0)
+            keepOrder = 1;
+        else if (strcmp(args[i], "--fail-fast") == 0)
+            failFast = 1;
+        else
+            break;
+    }
+    if (maxJobs < 1)
+        maxJobs = 1;
+
+    // the command, then the items
+    char ** command = args + i;
+    int numCommand = 0;
+    while (command[numCommand] && strcmp(command[numCommand], ":::") != 0)
+        numCommand++;
+    if (numCommand == 0)
+    {
+        fprintf(stderr, "[Error] Usage: parallel [-j N] [-k] [--fail-fast] command [args...] [::: items...]\n");
+        return 1;
+    }
+
+    int numItems = 0, fromInput = command[numCommand] == 0;
+    char * buffer = 0;
+    char ** items;
+    if (fromInput)
+        items = readItems(&buffer, &numItems);
+    else
+    {
+        items = command + numCommand + 1;
+        numItems = getNumArgs(items);
+    }
+
+    Task * tasks = calloc(numItems + 1, sizeof(Task));
+    if (!checkMemoryValid(tasks))
+        exit(EXIT_FAILURE);
+
+    // tasks do not compete with the shell for the items on STDIN
+    int devNull = fromInput ? open("/dev/null", O_RDONLY | O_CLOEXEC) : -1;
+
+    int next = 0, running = 0, printed = 0, failed = 0, stop = 0;
+    fflush(stdout);
+    while (next < numItems || running > 0)
+    {
+        // fill the pool
+        while (!stop && running < maxJobs && next < numItems)
+        {
+            Task * task = &tasks[next++];
+            task->item = items[next - 1];
+            task->out = memfd_create("parallel", MFD_CLOEXEC);
+            char ** argv = buildTaskArgs(command, numCommand, task->item);
+            task->pid = task->out == -1 ? -1 : spawnCommand(argv, devNull, task->out, -1, 0);
+            free(argv);
+            if (task->pid < 0)
+            {
+                fprintf(stderr, "[Error] parallel: can not run %s %s\n", command[0], task->item);
+                task->status = 127;
+                task->done = 1;
+                failed++;
+            }
+            else
+                running++;
+        }
+        if (running == 0 && (stop || next == numItems))
+            break;
+
+        // collect one task; other children that show up are background jobs
+        if (running > 0)
+        {
+            int status;
+            pid_t pid = waitpid(-1, &status, 0);
+            if (pid < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            Task * task = 0;
+            for (i = next - 1; i >= 0; i--)
+            {
+                if (tasks[i].pid == pid && !tasks[i].done)
+                {
+                    task = &tasks[i];
+                    break;
+                }
+            }
+            if (!task)
+            {
+                jobsUpdate(pid, status);
+                continue;
+            }
+            task->status = decodeStatus(status);
+            task->done = 1;
+            running--;
+
+            if (task->status != 0)
+            {
+                failed++;
+                if (failFast && !stop)
+                {
+                    // stop feeding the pool and terminate the tasks still running
+                    stop = 1;
+                    for (i = 0; i < next; i++)
+                        if (!tasks[i].done && tasks[i].pid > 0)
+                            kill(tasks[i].pid, SIGTERM);
+                }
+            }
+            if (!keepOrder)
+                flushTask(task);
+        }
+
+        // print in input order what is complete
+        while (keepOrder && printed < next && tasks[printed].done)
+            flushTask(&tasks[printed++]);
+    }
+
+    int status = 0;
+    for (i = 0; i < next; i++)
+    {
+        flushTask(&tasks[i]);
+        if (!status && tasks[i].status != 0)
+            status = tasks[i].status;
+    }
+    if (devNull != -1)
+        close(devNull);
+    if (fromInput)
+    {
+        free(buffer);
+        free(items);
+    }
+    free(tasks);
+
+    if (failed)
+        fprintf(stderr, "parallel: %d of %d tasks failed\n", failed, next);
+    return status;
+}
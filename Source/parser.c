@@ -0,0 +1,353 @@
+#include "parser.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Words of the line being parsed and the position of the next one.
+*/
+typedef struct Parser {
+    Arena * arena;
+    char ** tokens;
+    int pos;
+} Parser;
+
+/*
+ * One compiled command line: its text -> tree, with the arena holding both. Chained by bucket.
+*/
+typedef struct AstEntry {
+    char * line;
+    Node * tree; // NULL when the line is a syntax error, remembered as well
+    Arena arena;
+    unsigned long used; // lookup clock of the last use, the smallest is evicted
+    struct AstEntry * next;
+} AstEntry;
+
+static AstEntry * table[AST_CACHE_SIZE];
+static int numEntries = 0;
+static unsigned long useClock = 0;
+
+unsigned long astHits = 0;
+unsigned long astMisses = 0;
+
+static Node * parseList(Parser * p, int inGroup);
+
+/*
+    * Check if a word is a list operator or a parenthesis: it ends a pipeline.
+    * INPUT: the word, NULL at the end of the line
+    * OUTPUT: 1 if it is, 0 otherwise
+*/
+static int isOperator(const char * word)
+{
+    return !word || strcmp(word, ";") == 0 || strcmp(word, "&") == 0 || strcmp(word, "&&") == 0 || strcmp(word, "||") == 0
+        || strcmp(word, "(") == 0 || strcmp(word, ")") == 0;
+}
+
+/*
+    * Check if the next word is a given operator.
+    * INPUT: the parser, the operator
+    * OUTPUT: 1 if it is, 0 otherwise
+*/
+static int nextIs(Parser * p, const char * op)
+{
+    return p->tokens[p->pos] && strcmp(p->tokens[p->pos], op) == 0;
+}
+
+/*
+    * Allocate a node of the tree.
+    * INPUT: the parser, type and children of the node
+    * OUTPUT: the node
+*/
+static Node * newNode(Parser * p, int type, Node * left, Node * right)
+{
+    Node * node = arenaAlloc(p->arena, sizeof(Node));
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    node->words = 0;
+    node->text = 0;
+    node->timed = 0;
+    return node;
+}
+
+/*
+    * Take the words up to the next operator or "|".
+    * INPUT: the parser
+    * OUTPUT: NULL-terminated array of the words, sharing their strings
+*/
+static char ** takeWords(Parser * p)
+{
+    int first = p->pos;
+    while (!isOperator(p->tokens[p->pos]) && !nextIs(p, "|"))
+        p->pos++;
+
+    char ** words = arenaAlloc(p->arena, (p->pos - first + 1) * sizeof(char *));
+    memcpy(words, p->tokens + first, (p->pos - first) * sizeof(char *));
+    words[p->pos - first] = 0;
+    return words;
+}
+
+/*
+    * stage := "(" list ")" redirection... | word...
+    * INPUT: the parser
+    * OUTPUT: the node, NULL on a syntax error
+*/
+static Node * parseStage(Parser * p)
+{
+    if (nextIs(p, "("))
+    {
+        p->pos++;
+        Node * inner = parseList(p, 1);
+        if (!inner || !nextIs(p, ")"))
+            return 0;
+        p->pos++;
+        Node * group = newNode(p, NODE_GROUP, inner, 0);
+        group->words = takeWords(p);
+        return group;
+    }
+
+    Node * node = newNode(p, NODE_PIPELINE, 0, 0);
+    node->words = takeWords(p);
+    return node->words[0] ? node : 0;
+}
+
+/*
+    * pipeline := ["time"] stage ("|" stage)...  Without a group, the words of all the stages and their "|" make one
+    * NODE_PIPELINE for processPipe(); with one, the stages are chained by NODE_PIPE nodes. A "time" followed by
+    * nothing is the name of a command.
+    * INPUT: the parser
+    * OUTPUT: the node, NULL on a syntax error
+*/
+static Node * parsePipeline(Parser * p)
+{
+    char * after = nextIs(p, "time") ? p->tokens[p->pos + 1] : 0;
+    if (after && (strcmp(after, "(") == 0 || (!isOperator(after) && strcmp(after, "|") != 0)))
+    {
+        p->pos++;
+        Node * node = parsePipeline(p);
+        if (node)
+            node->timed = 1;
+        return node;
+    }
+
+    int first = p->pos;
+    Node * stage = parseStage(p);
+    if (!stage)
+        return 0;
+    if (!nextIs(p, "|"))
+        return stage;
+
+    // parse every stage first: the tree depends on whether one of them is a group
+    Node * head = newNode(p, NODE_PIPE, stage, 0);
+    Node * last = head;
+    int groups = stage->type == NODE_GROUP;
+    while (nextIs(p, "|"))
+    {
+        p->pos++;
+        stage = parseStage(p);
+        if (!stage)
+            return 0;
+        groups += stage->type == NODE_GROUP;
+        if (nextIs(p, "|"))
+        {
+            last->right = newNode(p, NODE_PIPE, stage, 0);
+            last = last->right;
+        }
+        else
+            last->right = stage;
+    }
+    if (groups)
+        return head;
+
+    Node * node = newNode(p, NODE_PIPELINE, 0, 0);
+    node->words = arenaAlloc(p->arena, (p->pos - first + 1) * sizeof(char *));
+    memcpy(node->words, p->tokens + first, (p->pos - first) * sizeof(char *));
+    node->words[p->pos - first] = 0;
+    return node;
+}
+
+/*
+    * and-or := pipeline (("&&" | "||") pipeline)...  Both operators have the same precedence, from left to right.
+    * INPUT: the parser
+    * OUTPUT: the node, NULL on a syntax error
+*/
+static Node * parseAndOr(Parser * p)
+{
+    Node * left = parsePipeline(p);
+    while (left && (nextIs(p, "&&") || nextIs(p, "||")))
+    {
+        int type = nextIs(p, "&&") ? NODE_AND : NODE_OR;
+        p->pos++;
+        Node * right = parsePipeline(p);
+        left = right ? newNode(p, type, left, right) : 0;
+    }
+    return left;
+}
+
+/*
+    * list := and-or ((";" | "&") and-or)... [";" | "&"]  An and-or followed by "&" runs in the background.
+    * INPUT: the parser, 1 inside parentheses (the list ends at ")")
+    * OUTPUT: the node, NULL on a syntax error or an empty list
+*/
+static Node * parseList(Parser * p, int inGroup)
+{
+    Node * list = 0;
+    while (p->tokens[p->pos] && !(inGroup && nextIs(p, ")")))
+    {
+        int first = p->pos;
+        Node * item = parseAndOr(p);
+        if (!item)
+            return 0;
+
+        if (nextIs(p, "&"))
+        {
+            // the job is announced and listed with its own words
+            char * saved = p->tokens[p->pos];
+            p->tokens[p->pos] = 0;
+            item = newNode(p, NODE_BACKGROUND, item, 0);
+            item->text = joinArgs(p->arena, p->tokens + first);
+            p->tokens[p->pos++] = saved;
+        }
+        else if (nextIs(p, ";"))
+            p->pos++;
+        else if (p->tokens[p->pos] && !(inGroup && nextIs(p, ")")))
+            return 0;
+
+        list = list ? newNode(p, NODE_SEQUENCE, list, item) : item;
+    }
+    return list;
+}
+
+/*
+    * Parse a normalized command line into its tree. Operators are the tokens ";", "&", "&&", "||", "(" and ")" of
+    * parseArgs(), spaces around them are optional; a quoted operator is a word.
+    * INPUT: arena receiving the tree and its words, the line
+    * OUTPUT: root of the tree, NULL on a syntax error
+*/
+Node * parseCommandLine(Arena * arena, char * line)
+{
+    Parser p;
+    int mode = 0;
+    p.arena = arena;
+    p.tokens = parseArgs(arena, line, &mode);
+    p.pos = 0;
+    if (!p.tokens)
+        return 0;
+
+    // parseArgs() takes a trailing "&" off: it is put back as the operator it is (the array has room for it)
+    if (mode)
+    {
+        int n = getNumArgs(p.tokens);
+        p.tokens[n] = "&";
+        p.tokens[n + 1] = 0;
+    }
+
+    return parseList(&p, 0);
+}
+
+/*
+    * FNV-1a hash of a command line.
+    * INPUT: the line
+    * OUTPUT: bucket index
+*/
+static unsigned int bucketOf(const char * line)
+{
+    unsigned int h = 2166136261u;
+    while (*line)
+    {
+        h ^= (unsigned char)*line++;
+        h *= 16777619u;
+    }
+    return h % AST_CACHE_SIZE;
+}
+
+/*
+    * Drop the least recently used compiled line.
+    * INPUT: void
+    * OUTPUT: void
+*/
+static void evictOldest()
+{
+    AstEntry ** oldest = 0;
+    int i;
+    for (i = 0; i < AST_CACHE_SIZE; i++)
+    {
+        AstEntry ** link;
+        for (link = &table[i]; *link; link = &(*link)->next)
+            if (!oldest || (*link)->used < (*oldest)->used)
+                oldest = link;
+    }
+    if (!oldest)
+        return;
+
+    AstEntry * e = *oldest;
+    *oldest = e->next;
+    arenaFree(&e->arena);
+    free(e);
+    numEntries--;
+}
+
+/*
+    * Get the tree of a command line from the cache of compiled lines, parsing it on a miss. Lines from loops, history
+    * replays or batch files are then never tokenized again. The tree must not be modified.
+    * INPUT: arena of the command line (used for lines too long to be kept), the normalized line
+    * OUTPUT: root of the tree, NULL on a syntax error
+*/
+Node * compileLine(Arena * arena, char * line)
+{
+    size_t len = strlen(line);
+    if (len > AST_CACHE_MAX_LINE)
+    {
+        astMisses++;
+        return parseCommandLine(arena, line);
+    }
+
+    unsigned int b = bucketOf(line);
+    AstEntry * e;
+    for (e = table[b]; e; e = e->next)
+    {
+        if (strcmp(e->line, line) == 0)
+        {
+            e->used = ++useClock;
+            astHits++;
+            return e->tree;
+        }
+    }
+
+    astMisses++;
+    if (numEntries >= AST_CACHE_SIZE)
+        evictOldest();
+    e = malloc(sizeof(AstEntry));
+    if (!checkMemoryValid(e))
+        exit(EXIT_FAILURE);
+    arenaInit(&e->arena);
+    e->line = arenaStrndup(&e->arena, line, len);
+    e->tree = parseCommandLine(&e->arena, e->line);
+    e->used = ++useClock;
+    e->next = table[b];
+    table[b] = e;
+    numEntries++;
+    return e->tree;
+}
+
+/*
+    * Forget every compiled line.
+    * INPUT: void
+    * OUTPUT: void
+*/
+void astCacheClear()
+{
+    int i;
+    for (i = 0; i < AST_CACHE_SIZE; i++)
+    {
+        while (table[i])
+        {
+            AstEntry * e = table[i];
+            table[i] = e->next;
+            arenaFree(&e->arena);
+            free(e);
+        }
+    }
+    numEntries = 0;
+}
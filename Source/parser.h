@@ -0,0 +1,30 @@
+#pragma once
+#include "arena.h"
+#define NODE_PIPELINE 0 // words of a pipeline with its "|" and redirections, run by processParallel()
+#define NODE_SEQUENCE 1 // left ; right
+#define NODE_AND 2 // left && right
+#define NODE_OR 3 // left || right
+#define NODE_BACKGROUND 4 // left &
+#define NODE_GROUP 5 // ( left ) followed by redirections, run in a subshell
+#define NODE_PIPE 6 // left | right, for pipelines with a group among their stages: left is one stage, right the rest
+#define AST_CACHE_SIZE 256 // compiled command lines kept, the least recently used goes first
+#define AST_CACHE_MAX_LINE 4096 // longer lines are parsed for one run only
+
+/*
+ * Node of the tree of a command line. Nodes and words are never modified once built: a compiled line is run many times.
+*/
+typedef struct Node {
+    int type;
+    struct Node * left;
+    struct Node * right;
+    char ** words; // NODE_PIPELINE: its words; NODE_GROUP: its redirections
+    char * text; // NODE_BACKGROUND: the command line of the job
+    int timed; // the pipeline of the node is prefixed with "time"
+} Node;
+
+extern unsigned long astHits;
+extern unsigned long astMisses;
+
+Node * parseCommandLine(Arena * arena, char * line);
+Node * compileLine(Arena * arena, char * line);
+void astCacheClear();
@@ -0,0 +1,440 @@
+#define _GNU_SOURCE
+#include "placement.h"
+#include "options.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+/*
+ * One CPU the shell may run on, with where it sits in the machine.
+*/
+typedef struct Cpu {
+    int cpu;
+    int node;
+    int package;
+    int core; // first CPU of its core: SMT siblings share it
+    int thread; // rank among the siblings of its core
+    int coreRank; // rank of its core inside its node
+} Cpu;
+
+/*
+ * CPUs of the shell in the orders of the two policies, read from sysfs on first use.
+*/
+typedef struct Topology {
+    Cpu * compact; // by node, package, core: siblings next to each other
+    Cpu * spread; // by thread, core rank, node: first one CPU per core, alternating the nodes
+    int numCpus;
+    int numNodes;
+} Topology;
+
+static Topology topology;
+static int loaded = 0;
+static cpu_set_t selfCpus; // CPUs the shell itself may run on, restored after every spawn
+static int selfNode = -1; // node preferred by placementApply(), -1 for the memory policy the shell started with
+static int startMode = MPOL_DEFAULT; // memory policy the shell started with
+static unsigned long startNodes[PLACEMENT_MAX_NODES / (8 * sizeof(unsigned long))];
+static int enteredNode = 0; // placementEnter() changed the memory policy
+static unsigned int numJobs = 0;
+
+/*
+    * Read the first number of a sysfs file ("12" or "12-15,40").
+    * INPUT: path of the file, value if it can not be read
+    * OUTPUT: the number
+*/
+static int readNumber(const char * path, int fallback)
+{
+    int value = fallback;
+    FILE * f = fopen(path, "r");
+    if (!f)
+        return fallback;
+    if (fscanf(f, "%d", &value) != 1)
+        value = fallback;
+    fclose(f);
+    return value;
+}
+
+/*
+    * Parse a CPU list such as "0-3,8,10-11" into a set.
+    * INPUT: the list, the set to fill
+    * OUTPUT: 0 on success, -1 if the list is malformed or names a CPU past PLACEMENT_MAX_CPUS
+*/
+static int parseCpuList(const char * list, cpu_set_t * set)
+{
+    CPU_ZERO(set);
+    while (*list && *list != '\n')
+    {
+        char * end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if (end == list || first < 0)
+            return -1;
+        if (*end == '-')
+        {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first)
+                return -1;
+        }
+        if (last >= PLACEMENT_MAX_CPUS)
+            return -1;
+        for (; first <= last; first++)
+            CPU_SET(first, set);
+
+        list = end;
+        if (*list == ',')
+            list++;
+        else if (*list && *list != '\n')
+            return -1;
+    }
+    return 0;
+}
+
+/*
+    * Compact order: node, package, core, then the CPU number.
+*/
+static int compareCompact(const void * a, const void * b)
+{
+    const Cpu * x = a;
+    const Cpu * y = b;
+    if (x->node != y->node)
+        return x->node - y->node;
+    if (x->package != y->package)
+        return x->package - y->package;
+    if (x->core != y->core)
+        return x->core - y->core;
+    return x->cpu - y->cpu;
+}
+
+/*
+    * Spread order: the first thread of every core before the second ones, cores taken one node after the other.
+*/
+static int compareSpread(const void * a, const void * b)
+{
+    const Cpu * x = a;
+    const Cpu * y = b;
+    if (x->thread != y->thread)
+        return x->thread - y->thread;
+    if (x->coreRank != y->coreRank)
+        return x->coreRank - y->coreRank;
+    if (x->node != y->node)
+        return x->node - y->node;
+    return x->cpu - y->cpu;
+}
+
+/*
+    * Give every CPU of the list the node listed in sysfs that holds it.
+    * INPUT: the CPUs
+    * OUTPUT: number of nodes holding at least one of them
+*/
+static int readNodes(Cpu * cpus, int numCpus)
+{
+    DIR * dir = opendir(PLACEMENT_SYSFS_NODE);
+    struct dirent * entry;
+    char path[MAX_LENGTH];
+    cpu_set_t set;
+    int i, numNodes = 0;
+
+    if (!dir)
+        return 1;
+    while ((entry = readdir(dir)))
+    {
+        int node, found = 0;
+        if (sscanf(entry->d_name, "node%d", &node) != 1)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s/cpulist", PLACEMENT_SYSFS_NODE, entry->d_name);
+        FILE * f = fopen(path, "r");
+        char list[4096];
+        if (!f)
+            continue;
+        if (fgets(list, sizeof(list), f) && parseCpuList(list, &set) == 0)
+        {
+            for (i = 0; i < numCpus; i++)
+            {
+                if (CPU_ISSET(cpus[i].cpu, &set))
+                {
+                    cpus[i].node = node;
+                    found = 1;
+                }
+            }
+        }
+        fclose(f);
+        numNodes += found;
+    }
+    closedir(dir);
+    return numNodes > 0 ? numNodes : 1;
+}
+
+/*
+    * Read the CPUs the shell may run on and their topology, and remember the shell's memory policy.
+    * INPUT: void
+    * OUTPUT: void
+*/
+static void loadTopology()
+{
+    char path[MAX_LENGTH];
+    int i, cpu;
+    if (loaded)
+        return;
+    loaded = 1;
+
+    if (sched_getaffinity(0, sizeof(selfCpus), &selfCpus) == -1)
+    {
+        CPU_ZERO(&selfCpus);
+        CPU_SET(0, &selfCpus);
+    }
+    if (syscall(SYS_get_mempolicy, &startMode, startNodes, PLACEMENT_MAX_NODES, 0, 0) == -1)
+        startMode = MPOL_DEFAULT;
+
+    Cpu * cpus = malloc(2 * CPU_COUNT(&selfCpus) * sizeof(Cpu));
+    if (!checkMemoryValid(cpus))
+        exit(EXIT_FAILURE);
+    int numCpus = 0;
+    for (cpu = 0; cpu < PLACEMENT_MAX_CPUS; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &selfCpus))
+            continue;
+        Cpu * c = &cpus[numCpus++];
+        memset(c, 0, sizeof(Cpu));
+        c->cpu = cpu;
+        snprintf(path, sizeof(path), "%s/cpu%d/topology/core_cpus_list", PLACEMENT_SYSFS_CPU, cpu);
+        c->core = readNumber(path, -1);
+        if (c->core == -1)
+        {
+            snprintf(path, sizeof(path), "%s/cpu%d/topology/thread_siblings_list", PLACEMENT_SYSFS_CPU, cpu);
+            c->core = readNumber(path, cpu);
+        }
+        snprintf(path, sizeof(path), "%s/cpu%d/topology/physical_package_id", PLACEMENT_SYSFS_CPU, cpu);
+        c->package = readNumber(path, 0);
+    }
+    topology.numNodes = readNodes(cpus, numCpus);
+
+    // ranks of the threads in their core and of the cores in their node, read off the compact order
+    qsort(cpus, numCpus, sizeof(Cpu), compareCompact);
+    for (i = 0; i < numCpus; i++)
+    {
+        int sameCore = i > 0 && cpus[i].node == cpus[i-1].node && cpus[i].core == cpus[i-1].core;
+        int sameNode = i > 0 && cpus[i].node == cpus[i-1].node;
+        cpus[i].thread = sameCore ? cpus[i-1].thread + 1 : 0;
+        cpus[i].coreRank = !sameNode ? 0 : sameCore ? cpus[i-1].coreRank : cpus[i-1].coreRank + 1;
+    }
+    topology.compact = cpus;
+    topology.spread = cpus + numCpus;
+    memcpy(topology.spread, cpus, numCpus * sizeof(Cpu));
+    qsort(topology.spread, numCpus, sizeof(Cpu), compareSpread);
+    topology.numCpus = numCpus;
+}
+
+/*
+    * Parse a CPU list into a placement. Memory is preferred from the node of the CPUs when they all sit on one.
+    * INPUT: the list, the placement to fill
+    * OUTPUT: 0 on success, -1 if the list is malformed
+*/
+static int placementParse(const char * list, Placement * p)
+{
+    cpu_set_t set;
+    int i;
+    loadTopology();
+    if (!*list || parseCpuList(list, &set) == -1)
+        return -1;
+
+    memcpy(p->cpus, &set, sizeof(p->cpus));
+    p->node = -1;
+    for (i = 0; i < topology.numCpus && topology.numNodes > 1; i++)
+    {
+        if (!CPU_ISSET(topology.compact[i].cpu, &set))
+            continue;
+        if (p->node != -1 && p->node != topology.compact[i].node)
+        {
+            p->node = -1;
+            break;
+        }
+        p->node = topology.compact[i].node;
+    }
+    return 0;
+}
+
+/*
+    * Take a "@cpus=LIST" prefix off the words of a command. The list is limited to the CPUs the shell may use.
+    * INPUT: NULL-terminated words (shifted in place), the placement to fill
+    * OUTPUT: 1 if the prefix was there, 0 if not, -1 after reporting an invalid list
+*/
+int placementTakePrefix(char ** args, Placement * p)
+{
+    size_t len = strlen(PLACEMENT_PREFIX);
+    cpu_set_t set;
+    if (!args[0] || strncmp(args[0], PLACEMENT_PREFIX, len) != 0)
+        return 0;
+
+    if (placementParse(args[0] + len, p) == -1)
+    {
+        fprintf(stderr, "[Error] Invalid CPU list: %s\n", args[0] + len);
+        return -1;
+    }
+    memcpy(&set, p->cpus, sizeof(set));
+    CPU_AND(&set, &set, &selfCpus);
+    if (CPU_COUNT(&set) == 0)
+    {
+        fprintf(stderr, "[Error] No usable CPU in: %s\n", args[0] + len);
+        return -1;
+    }
+    memcpy(p->cpus, &set, sizeof(p->cpus));
+
+    memmove(args, args + 1, getNumArgs(args) * sizeof(char *));
+    return 1;
+}
+
+/*
+    * Place a stage of a pipeline under the affinity option: stage i takes the i-th CPU of the order of the policy
+    * among the ones the shell may use. Compact puts a producer and its consumer on SMT siblings, then on the next
+    * cores of the same node, so pipe buffers stay in a shared cache; spread gives every stage a core of its own.
+    * INPUT: the placement to fill, index of the stage
+    * OUTPUT: p, NULL when the stage is left to the kernel
+*/
+const Placement * placementForStage(Placement * p, int stage)
+{
+    if (optAffinity == PLACEMENT_NONE)
+        return 0;
+    loadTopology();
+
+    Cpu * order = optAffinity == PLACEMENT_COMPACT ? topology.compact : topology.spread;
+    int i, usable = 0;
+    for (i = 0; i < topology.numCpus; i++)
+        usable += CPU_ISSET(order[i].cpu, &selfCpus) != 0;
+    if (usable < 2)
+        return 0;
+
+    int k = stage % usable;
+    for (i = 0; i < topology.numCpus; i++)
+        if (CPU_ISSET(order[i].cpu, &selfCpus) && k-- == 0)
+            break;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(order[i].cpu, &set);
+    memcpy(p->cpus, &set, sizeof(p->cpus));
+    p->node = topology.numNodes > 1 ? order[i].node : -1;
+    return p;
+}
+
+/*
+    * Place a background job under the affinity option: it gets all the usable CPUs of one node, and its memory from
+    * that node. Spread sends successive jobs to successive nodes, compact keeps them on the first one.
+    * INPUT: the placement to fill
+    * OUTPUT: p, NULL when the job is left to the kernel (no policy, or a single node)
+*/
+const Placement * placementForJob(Placement * p)
+{
+    if (optAffinity == PLACEMENT_NONE)
+        return 0;
+    loadTopology();
+    if (topology.numNodes < 2)
+        return 0;
+
+    // nodes appear grouped in the compact order
+    int i, numNodes = 0, node = -1;
+    for (i = 0; i < topology.numCpus; i++)
+    {
+        if (CPU_ISSET(topology.compact[i].cpu, &selfCpus) && topology.compact[i].node != node)
+        {
+            node = topology.compact[i].node;
+            numNodes++;
+        }
+    }
+    if (numNodes < 2)
+        return 0;
+
+    node = -1;
+
+    int k = optAffinity == PLACEMENT_SPREAD ? numJobs++ % numNodes : 0;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (i = 0; i < topology.numCpus; i++)
+    {
+        Cpu * c = &topology.compact[i];
+        if (!CPU_ISSET(c->cpu, &selfCpus))
+            continue;
+        if (node != c->node)
+        {
+            if (node != -1 && k-- == 0)
+                break;
+            node = c->node;
+            CPU_ZERO(&set);
+        }
+        CPU_SET(c->cpu, &set);
+    }
+    memcpy(p->cpus, &set, sizeof(p->cpus));
+    p->node = node;
+    return p;
+}
+
+/*
+    * Prefer the memory of one node for the calling thread, or go back to the policy the shell started with.
+    * INPUT: the node, -1 for the starting policy
+    * OUTPUT: 0 on success, -1 with errno set otherwise
+*/
+static int preferNode(int node)
+{
+    unsigned long nodes[PLACEMENT_MAX_NODES / (8 * sizeof(unsigned long))];
+    if (node < 0)
+        return syscall(SYS_set_mempolicy, startMode, startNodes, PLACEMENT_MAX_NODES + 1);
+
+    memset(nodes, 0, sizeof(nodes));
+    nodes[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    return syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodes, PLACEMENT_MAX_NODES + 1);
+}
+
+/*
+    * Move the calling process to a placement for good: a subshell running a background job or a pipeline stage.
+    * Commands it starts inherit the placement, and later stage placements choose among its CPUs.
+    * INPUT: the placement
+    * OUTPUT: 0 on success, -1 if the CPUs were refused
+*/
+int placementApply(const Placement * p)
+{
+    cpu_set_t set;
+    loadTopology();
+    memcpy(&set, p->cpus, sizeof(set));
+    if (sched_setaffinity(0, sizeof(set), &set) == -1)
+        return -1;
+    selfCpus = set;
+    if (p->node >= 0 && preferNode(p->node) == 0)
+        selfNode = p->node;
+    return 0;
+}
+
+/*
+    * Switch the calling thread to a placement just before it spawns a command: affinity and memory policy are
+    * inherited through clone() and kept by exec(), so the command starts in place. placementLeave() switches back.
+    * INPUT: the placement
+    * OUTPUT: void
+*/
+void placementEnter(const Placement * p)
+{
+    cpu_set_t set;
+    loadTopology();
+    memcpy(&set, p->cpus, sizeof(set));
+    sched_setaffinity(0, sizeof(set), &set);
+    enteredNode = p->node >= 0 && preferNode(p->node) == 0;
+}
+
+/*
+    * Put the calling thread back on the shell's own CPUs and memory policy after placementEnter(). errno is kept.
+    * INPUT: void
+    * OUTPUT: void
+*/
+void placementLeave()
+{
+    int err = errno;
+    sched_setaffinity(0, sizeof(selfCpus), &selfCpus);
+    if (enteredNode)
+        preferNode(selfNode);
+    enteredNode = 0;
+    errno = err;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#define PLACEMENT_NONE 0 // the kernel places every process
+#define PLACEMENT_COMPACT 1 // pipeline stages on sibling CPUs in order, background jobs on the first node
+#define PLACEMENT_SPREAD 2 // pipeline stages on distinct cores across the nodes, background jobs round-robin over the nodes
+#define PLACEMENT_PREFIX "@cpus=" // command prefix pinning it to a CPU list such as "0-3,8"
+#define PLACEMENT_SYSFS_CPU "/sys/devices/system/cpu"
+#define PLACEMENT_SYSFS_NODE "/sys/devices/system/node"
+#define PLACEMENT_MAX_CPUS 1024 // CPUs a placement can name, as many as a cpu_set_t
+#define PLACEMENT_MAX_NODES 1024 // bits of the node masks given to the memory policy calls
+
+/*
+ * CPUs and memory node a process is started on.
+*/
+typedef struct Placement {
+    unsigned long cpus[PLACEMENT_MAX_CPUS / (8 * sizeof(unsigned long))]; // bit i for CPU i, laid out as a cpu_set_t
+    int node; // node memory is preferably taken from, -1 to keep the shell's memory policy
+} Placement;
+
+int placementTakePrefix(char ** args, Placement * p);
+const Placement * placementForStage(Placement * p, int stage);
+const Placement * placementForJob(Placement * p);
+int placementApply(const Placement * p);
+void placementEnter(const Placement * p);
+void placementLeave();
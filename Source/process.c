@@ -1,392 +1,1294 @@
 #include "process.h"
 #include "utils.h"
+#include "launch.h"
+#include "mover.h"
+#include "options.h"
+#include "hash.h"
+#include "jobs.h"
+#include "parallel.h"
+#include "timing.h"
+#include "history.h"
+#include "builtins.h"
+#include "forkserver.h"
+#include "parser.h"
+#include "expand.h"
+#include "batch.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <string.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
-char OLDPWD[MAX_LENGTH] = "";
 /*
- * Create loop for the shell, process history and exit
+ * Arena of the command line being executed: arguments, pipeline stages and their bookkeeping. Reset after every line.
 */
-void shLoop() 
+static Arena lineArena;
+
+static int runRedirected(char ** args, const Redirects * redirects);
+
+/*
+ * Prepare the shell process: it must survive handing the terminal to a foreground pipeline and taking it back, and reap its background jobs.
+*/
+void shInit()
+{
+    signal(SIGTTOU, SIG_IGN);
+    jobsInit();
+    builtinsInit();
+}
+
+/*
+ * Exit status of the last command line.
+*/
+int lastStatus = 0;
+
+/*
+ * Copy the words of a compiled pipeline for one run: the executor rearranges its argument arrays.
+ * Input: the words
+ * Output: NULL-terminated copy of the array, in the line arena
+*/
+static char ** copyWords(char ** words)
+{
+    int n = getNumArgs(words);
+    char ** args = arenaAlloc(&lineArena, (n + 1) * sizeof(char *));
+    memcpy(args, words, (n + 1) * sizeof(char *));
+    return args;
+}
+
+static int runNode(Node * node, int * exitShell);
+
+/*
+ * Body of a forked subshell: a group applies its redirections to the subshell and runs its list, any other node runs as is.
+ * Input: the node
+ * Output: exit status for the subshell to exit with
+*/
+static int runInSubshell(Node * node)
+{
+    int exitSubshell = 0;
+    if (node->type == NODE_GROUP)
+    {
+        Redirects redirects;
+        char ** words = copyWords(node->words);
+        if (parseRedirects(&lineArena, words, &redirects) == -1 || words[0])
+        {
+            printf("[Error] Syntax Error\n");
+            return 2;
+        }
+        if (redirectApply(&redirects) == -1)
+            return 1;
+        node = node->left;
+    }
+    return runNode(node, &exitSubshell);
+}
+
+/*
+ * Run a node of the tree in a forked subshell: a group "( list )", with its redirections applied in the child, or a
+ * background and-or list, which leads its own process group and is registered in the job table, placed like the jobs of
+ * processParallel().
+ * Input: the node, 1 for a background job, command line of the job
+ * Output: exit status of the subshell (0 when it was sent to the background)
+*/
+static int runSubshell(Node * node, int background, char * text)
+{
+    Placement placement;
+    const Placement * job = background ? placementForJob(&placement) : 0;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("[Error] Can not create new subshell for execution. Command aborted");
+        return 1;
+    }
+    if (pid == 0)
+    {
+        if (background)
+            setpgid(0, 0);
+        resetChildSignals();
+        forkServerDetach();
+        if (job)
+            placementApply(job);
+        exit(runInSubshell(node));
+    }
+
+    if (background)
+    {
+        setpgid(pid, pid);
+        int id = jobsAdd(pid, text);
+        if (isatty(STDIN_FILENO))
+            printf("[%d] %d\n", id, pid);
+        return 0;
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR)
+            return 1;
+    return decodeStatus(status);
+}
+
+/*
+ * Word standing for a group stage in the arguments of a pipeline, recognized by its address: the group itself is passed
+ * beside the arguments, at the index of its stage.
+*/
+static char groupStage[] = "(...)";
+
+static int processSubstitutions(char ** args, Node ** groups);
+static int runPipeline(char ** args, Node ** groups);
+
+/*
+ * Run a pipeline with a group among its stages, such as "(cd dir && make) | tee log": its stages become the arguments
+ * of one pipeline, each group replaced by groupStage, and run by processPipe's engine.
+ * Input: the NODE_PIPE node
+ * Output: exit status of the last stage, the status of every stage kept in pipeStatus
+*/
+static int runPipeNode(Node * node)
+{
+    int numStages = 1, numWords = 0, i = 0;
+    Node * n;
+    for (n = node; n->type == NODE_PIPE; n = n->right)
+    {
+        numStages++;
+        numWords += n->left->type == NODE_GROUP ? 2 : getNumArgs(n->left->words) + 1;
+    }
+    numWords += n->type == NODE_GROUP ? 1 : getNumArgs(n->words);
+
+    char ** args = arenaAlloc(&lineArena, (numWords + 1) * sizeof(char *));
+    Node ** groups = arenaAlloc(&lineArena, numStages * sizeof(Node *));
+    int stage = 0;
+    for (n = node; ; n = n->right)
+    {
+        Node * s = n->type == NODE_PIPE ? n->left : n;
+        groups[stage] = s->type == NODE_GROUP ? s : 0;
+        if (groups[stage])
+            args[i++] = groupStage;
+        else
+        {
+            memcpy(args + i, s->words, getNumArgs(s->words) * sizeof(char *));
+            i += getNumArgs(s->words);
+        }
+        stage++;
+        if (n->type != NODE_PIPE)
+            break;
+        args[i++] = "|";
+    }
+    args[i] = 0;
+    return processSubstitutions(args, groups);
+}
+
+/*
+ * Execute a node of the tree of a command line: "a ; b" runs both, "a && b" runs b if a succeeded, "a || b" if it failed.
+ * Input: the node, pointer to an integer set to 1 when an "exit [n]" command runs
+ * Output: exit status of the node, also kept in lastStatus
+*/
+static int runNode(Node * node, int * exitShell)
+{
+    char ** args;
+    if ((node->timed || (node->type == NODE_BACKGROUND && node->left->timed)) && !timingThisLine)
+    {
+        // "time" prefix: report the resource usage of every command of the pipeline
+        timingThisLine = 1;
+        runNode(node, exitShell);
+        timingThisLine = 0;
+        return lastStatus;
+    }
+
+    switch (node->type)
+    {
+    case NODE_SEQUENCE:
+    case NODE_AND:
+    case NODE_OR:
+        runNode(node->left, exitShell);
+        if (*exitShell || (node->type == NODE_AND && lastStatus != 0) || (node->type == NODE_OR && lastStatus == 0))
+            return lastStatus;
+        return runNode(node->right, exitShell);
+
+    case NODE_BACKGROUND:
+        if (node->left->type == NODE_PIPELINE)
+            return lastStatus = processParallel(copyWords(node->left->words), 1);
+        return lastStatus = runSubshell(node->left, 1, node->text);
+
+    case NODE_GROUP:
+        return lastStatus = runSubshell(node, 0, 0);
+
+    case NODE_PIPE:
+        return lastStatus = runPipeNode(node);
+
+    default:
+        args = copyWords(node->words);
+        // "exit [n]" leaves the shell with n, or the status of the last command
+        if (strcmp(args[0], "exit") == 0 && positionPipe(args) == -1)
+        {
+            *exitShell = 1;
+            if (args[1])
+                lastStatus = atoi(args[1]) & 0xff;
+            return lastStatus;
+        }
+        return lastStatus = processParallel(args, 0);
+    }
+}
+
+/*
+ * Parse and execute one command line, which must already be normalized by normalizeLine(). The tree of the line comes
+ * from the cache of compiled lines when the same text ran before.
+ * Input: the command line, pointer to an integer set to 1 when the line runs "exit [n]"
+ * Output: exit status of the line
+*/
+int runLine(char * command, int * exitShell)
+{
+    // blank lines and comments (including a #! line) do nothing
+    if (command[0] == 0 || command[0] == '#')
+        return lastStatus;
+
+    // Foreground children are waited for explicitly: keep the job reaper away until the line is done
+    jobsBlock();
+
+    Node * tree = compileLine(&lineArena, command);
+    if (!tree)
+    {
+        printf("[Error] Syntax Error\n");
+        lastStatus = 2;
+    }
+    else
+        runNode(tree, exitShell);
+
+    // Release the memory of the whole line at once
+    arenaReset(&lineArena);
+
+    // reap the jobs that ended meanwhile and announce them
+    jobsUnblock();
+    jobsNotify(isatty(STDIN_FILENO));
+    return lastStatus;
+}
+
+/*
+ * Create loop for the shell, process history and exit. The prompt is only shown when STDIN is a terminal.
+ * Output: exit status of the shell
+*/
+int shLoop() 
 {
     char * command = 0;
-    char * last_command = 0;
-    char ** args = 0;
+    int exitShell = 0;
+    int interactive = isatty(STDIN_FILENO);
+
+    // only an interactive shell writes the history file
+    historyInit(interactive);
+
     // Infinte Loop
     do
     {
-        printf("PLTsh> ");
-        // if last command and command refer to the same memory - don't free memory of the history
-        if (last_command != command && last_command)
-            free(last_command);
-        last_command = command;
+        if (interactive)
+        {
+            jobsNotify(1);
+            printf("PLTsh> ");
+            fflush(stdout);
+        }
 
-        // read command
+        // read command, stop at end of input
         command = readLine();
+        if (!command)
+            break;
 
-        // if the command is "exit" -> exit
-        if (strcmp(command,"exit")==0)
+        // history designators (!!, !n, !-n, !prefix, !?substr?) are replaced by the entry they name and echoed
+        if (command[0] == '!')
         {
+            char * expanded = historyExpand(command);
             free(command);
-            if (last_command)
-                free(last_command);
-            break;
+            if (!expanded)
+                continue;
+            command = expanded;
+            printf("%s\n", command);
+            fflush(stdout);
         }
 
-        // if the command is "!!", get the last_command
-        if (strcmp(command,"!!")==0) {
-            free(command);
-            command = last_command;
-            // if there is a command in the history -> echo it, otherwise: error.
-            if (command)
-                printf("%s\n",command);
-            else 
-                printf("No command in the history!\n");
+        historyAdd(command);
+        runLine(command, &exitShell);
+        free(command);
+    }
+    while(!exitShell);
+
+    return lastStatus;
+}
+
+/*
+ * Run the command given with -c.
+ * Input: the command string (modified in place)
+ * Output: exit status of the command
+*/
+int runString(char * command)
+{
+    int exitShell = 0;
+    normalizeLine(command, command, strlen(command));
+    return runLine(command, &exitShell);
+}
+
+/*
+ * Run a script file without prompts. The file is memory-mapped privately and every line is normalized and
+ * terminated in place, so lines are never copied; only a last line without newline is copied to be terminated.
+ * Input: path of the script
+ * Output: exit status of the last command, 127 if the script can not be read
+*/
+int runScript(char * path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        perror(path);
+        if (fd != -1)
+            close(fd);
+        return 127;
+    }
+
+    size_t size = st.st_size;
+    char * data = 0;
+    if (size > 0)
+    {
+        data = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            perror(path);
+            close(fd);
+            return 127;
+        }
+        madvise(data, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    int exitShell = 0;
+    size_t pos = 0;
+    while (pos < size && !exitShell)
+    {
+        char * line = data + pos;
+        char * nl = memchr(line, '\n', size - pos);
+        size_t len = nl ? (size_t)(nl - line) : size - pos;
+        pos += len + 1;
+        if (len > 0 && line[len-1] == '\r')
+            len--;
+
+        if (nl)
+        {
+            normalizeLine(line, line, len);
+            runLine(line, &exitShell);
         }
-        
-        if (command) {
-            // mode to check whether there is a "&" symbol in the arguments
-            int mode = 0;
-            
-            // Parse the command
-            args = parseArgs(command,&mode);
-            
-            // call processParallel 
-            processParallel(args,mode);
-
-            // Free memory of args
-            freeArgs(args);
+        else
+        {
+            // the mapping may end right after the last byte: terminate a copy instead
+            char * last = malloc(len + 1);
+            if (!checkMemoryValid(last))
+                exit(EXIT_FAILURE);
+            normalizeLine(last, line, len);
+            runLine(last, &exitShell);
+            free(last);
         }
+    }
 
+    if (data)
+        munmap(data, size);
+    return lastStatus;
+}
+
+/*
+ * A process substitution of the command line: a child runs the command inside "<(...)" or ">(...)" on one end of a pipe,
+ * the shell keeps the other end open, inheritable, as the /dev/fd/N argument until the line is done.
+*/
+typedef struct Substitution {
+    pid_t pid;
+    int fd;
+} Substitution;
+
+/*
+ * Check if an argument is a process substitution, as joined by parseArgs().
+ * Input: the argument
+ * Output: 1 if it is, 0 otherwise
+*/
+static int isSubstitution(const char * arg)
+{
+    size_t len = strlen(arg);
+    return len > 3 && (arg[0] == '<' || arg[0] == '>') && arg[1] == '(' && arg[len-1] == ')';
+}
+
+/*
+ * Start the child of a process substitution and replace the argument by the /dev/fd/N path of the shell's end.
+ * Input: the substitution to fill, pointer to the argument, the substitutions started before (their ends are closed in the child)
+ * Output: 1 if the child runs, 0 otherwise
+*/
+static int startSubstitution(Substitution * sub, char ** arg, Substitution * started, int numStarted)
+{
+    int output = (*arg)[0] == '>'; // >(cmd): the command reads what is written to /dev/fd/N
+    size_t len = strlen(*arg) - 3;
+    char * inner = arenaStrndup(&lineArena, *arg + 2, len);
+    int fds[2];
+    int i;
+
+    if (normalizeLine(inner, inner, len) == 0)
+    {
+        printf("[Error] Syntax Error\n");
+        return 0;
+    }
+    if (makePipe(fds) == -1)
+    {
+        perror("Create pipe failed");
+        return 0;
     }
-    while(1);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("[Error] Can not create child process. Failed to execute command.");
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    }
+    if (pid == 0)
+    {
+        resetChildSignals();
+        forkServerDetach();
+        timingDisable();
+        for (i = 0; i < numStarted; i++)
+            close(started[i].fd);
+
+        // dup2() leaves the copy inheritable, the pipe itself is O_CLOEXEC
+        dup2(fds[output ? 0 : 1], output ? STDIN_FILENO : STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        int exitShell = 0;
+        Node * tree = parseCommandLine(&lineArena, inner);
+        if (!tree)
+        {
+            printf("[Error] Syntax Error\n");
+            exit(2);
+        }
+        exit(runNode(tree, &exitShell));
+    }
+
+    close(fds[output ? 0 : 1]);
+    sub->pid = pid;
+    sub->fd = fds[output ? 1 : 0];
+    // the command opens /dev/fd/N itself: the descriptor must survive exec
+    fcntl(sub->fd, F_SETFD, 0);
+    *arg = arenaAlloc(&lineArena, 32);
+    snprintf(*arg, 32, "/dev/fd/%d", sub->fd);
+    return 1;
+}
+
+/*
+ * Close the shell's ends of the process substitutions and reap their children. A "<(...)" child still writing gets SIGPIPE,
+ * a ">(...)" child reads end of file and finishes its output before the line is done.
+ * Input: array of substitutions, number of substitutions
+ * Output: void
+*/
+static void finishSubstitutions(Substitution * subs, int numSubs)
+{
+    int i;
+    for (i = 0; i < numSubs; i++)
+        close(subs[i].fd);
+    for (i = 0; i < numSubs; i++)
+        while (waitpid(subs[i].pid, 0, 0) == -1 && errno == EINTR);
+    spawnInheritFds -= numSubs;
 }
 
 /*
- * Process the ampersand (&) operator, creating a new subshell and execute the command within that new subshell. The main shell does not wait for subshell to finish.
+ * Run a command line with its process substitutions: every "<(cmd)" or ">(cmd)" argument is started as a concurrent child
+ * connected through a pipe and passed as /dev/fd/N, then the line runs through runPipeline().
+ * Input: array of command's arguments, the groups of its group stages (NULL when it has none)
+ * Output: exit status of the command line
+*/
+static int processSubstitutions(char ** args, Node ** groups)
+{
+    int numArgs = getNumArgs(args);
+    int numSubs = 0;
+    int i;
+
+    for (i = 0; i < numArgs; i++)
+        numSubs += isSubstitution(args[i]);
+    if (numSubs == 0)
+        return runPipeline(args, groups);
+
+    Substitution * subs = arenaAlloc(&lineArena, numSubs * sizeof(Substitution));
+    int started = 0;
+    for (i = 0; i < numArgs; i++)
+    {
+        if (!isSubstitution(args[i]))
+            continue;
+        if (!startSubstitution(&subs[started], &args[i], subs, started))
+        {
+            spawnInheritFds += started;
+            finishSubstitutions(subs, started);
+            return 1;
+        }
+        started++;
+    }
+
+    spawnInheritFds += numSubs;
+    int status = runPipeline(args, groups);
+    fflush(stdout);
+    finishSubstitutions(subs, numSubs);
+    return status;
+}
+
+/*
+ * Process the ampersand (&) operator, creating a new subshell and execute the command within that new subshell. The main shell does not wait for subshell to finish:
+ * the subshell leads its own process group and is registered in the job table, where the SIGCHLD reaper collects it.
+ * Under the affinity option the job is placed on a node, which the commands it starts inherit.
  * Input: 
  *	(1) char ** args : the white-space-parsed command.
  *	(2) int mode: 1 if '&' was specified and 0 if not.
- * NOTE: Called by shLoop().
+ * Output: exit status of the command (0 when it was sent to the background)
+ * NOTE: Called by runNode().
 */
-void processParallel(char ** args, int mode)
+int processParallel(char ** args, int mode)
 {
-    // NOTE: This function should not be taking mode as an arg, and should be returning an execution status (int).
+    // NOTE: This function should not be taking mode as an arg.
 	// if & exists
 	if (mode == 1) {
+		Placement placement;
+		const Placement * job = placementForJob(&placement);
+		fflush(stdout);
 		pid_t pid = fork();
 		if (pid < 0) {
 			perror("[Error] Can not create new subshell for execution. Command aborted");
-			return;
+			return 1;
 		}
 		else if (pid == 0) {
-			processPipe(args);
-			exit(0);
+			setpgid(0, 0);
+			resetChildSignals();
+			forkServerDetach();
+			if (job)
+				placementApply(job);
+			exit(processSubstitutions(args, 0));
 		}
-		else {
-		
-		}
-	}
-	else {
-		processPipe(args);
+		setpgid(pid, pid);
+		int id = jobsAdd(pid, joinArgs(&lineArena, args));
+		if (isatty(STDIN_FILENO))
+			printf("[%d] %d\n", id, pid);
+		return 0;
 	}
+	return processSubstitutions(args, 0);
+}
+
+/*
+ * Exit status of every stage of the last pipeline, in order.
+*/
+int * pipeStatus = 0;
+int numPipeStatus = 0;
+
+/*
+ * Turn a status returned by waitpid() into a shell exit status (128 + signal for killed processes).
+ * Input: raw wait status
+ * Output: exit status
+*/
+int decodeStatus(int status)
+{
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return 1;
+}
+
+/*
+ * Pick the stage of a pipeline that the shell can serve itself with moveData instead of forking a cat process: "cat" with only file operands,
+ * redirecting at most its STDIN and STDOUT to a single file each.
+ * Input: array of stages, their redirections and number of stages
+ * Output: index of the stage, -1 if there is none
+*/
+static int findMoverStage(char *** stages, Redirects * redirects, int numStages)
+{
+    int i, j;
+    for (i = 0; i < numStages; i++)
+    {
+        if (!isMoverCommand(stages[i]) || redirectMaxFd(&redirects[i]) > STDOUT_FILENO || redirectOutputTargets(&redirects[i]) > 1)
+            continue;
+
+        int hasInput = stages[i][1] != 0;
+        for (j = 0; j < redirects[i].count; j++)
+            if (redirects[i].items[j].fd == STDIN_FILENO)
+                hasInput = 1;
+
+        // the first stage must not read the terminal: the shell does not own it while the pipeline runs
+        if (i > 0 || hasInput || !isatty(STDIN_FILENO))
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Run a "cat" stage inside the shell, applying its redirections to the descriptors it moves data between.
+ * Input: arguments of the stage, its redirections, input and output descriptors given by the pipeline
+ * Output: exit status of the stage
+*/
+static int runMoverStage(char ** stage, const Redirects * redirects, int fdIn, int fdOut)
+{
+    ShellRedirect shell;
+    if (redirectOpen(&lineArena, redirects, fdIn, fdOut, &shell) == -1)
+        return 1;
+
+    int status = catFiles(stage + 1, shell.fd[0], shell.fd[1]);
+    redirectRelease(&shell);
+    return status;
 }
 
 /*
- * Detect and process the pipe (|) operators. Connect the STDOUT of the command to the left of each '|' with STDIN of the command to the right of it, and sequentially execute each command in a new child process.
+ * A builtin stage of a pipeline, run on a helper thread of the shell instead of a forked subshell.
+*/
+typedef struct BuiltinStage {
+    Builtin * builtin;
+    char ** args;
+    int stage; // number of the stage, from 1
+    int fdOut; // owned by the thread, closed when the builtin is done so that the reader sees end of file
+    int status;
+    pthread_t thread;
+} BuiltinStage;
+
+/*
+ * Body of a builtin stage thread. SIGPIPE is blocked in the thread: a reader leaving early makes the write fail with EPIPE instead of killing the shell.
+ * Input: the BuiltinStage
+ * Output: NULL
+*/
+static void * runBuiltinStage(void * arg)
+{
+    BuiltinStage * stage = arg;
+    sigset_t pipeSet;
+    Timing timing;
+
+    sigemptyset(&pipeSet);
+    sigaddset(&pipeSet, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipeSet, 0);
+
+    timingStart(&timing);
+    stage->status = stage->builtin->run(stage->args, stage->fdOut);
+    close(stage->fdOut);
+    if (timingEnabled())
+        timingReportSelf(stage->args[0], stage->stage, &timing);
+    return 0;
+}
+
+/*
+ * Start a builtin stage on its thread, with its redirections applied. Pure builtins never read, so only the output is handed over.
+ * Input: the stage to fill, arguments of the stage, its redirections, output descriptor given by the pipeline
+ * Output: 1 if the thread runs, 0 otherwise (the status of the stage is set)
+*/
+static int startBuiltinStage(BuiltinStage * stage, char ** args, const Redirects * redirects, int fdOut)
+{
+    ShellRedirect shell;
+    if (redirectOpen(&lineArena, redirects, -1, fdOut, &shell) == -1)
+    {
+        stage->status = 1;
+        return 0;
+    }
+
+    stage->args = args;
+    stage->fdOut = fcntl(shell.fd[1], F_DUPFD_CLOEXEC, 0);
+    redirectRelease(&shell);
+    if (stage->fdOut == -1)
+    {
+        perror("[Error] Duplicate file descriptor failed");
+        stage->status = 1;
+        return 0;
+    }
+
+    int err = pthread_create(&stage->thread, 0, runBuiltinStage, stage);
+    if (err != 0)
+    {
+        fprintf(stderr, "[Error] Can not create thread: %s\n", strerror(err));
+        close(stage->fdOut);
+        stage->status = 1;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Detect and process the pipe (|) operators. Build N-1 pipes for the N stages, launch every stage concurrently in one process group and reap them with a single waitpid() loop.
  * Input:
  *	 char **args : the parsed command line. Specifically this command has to be parsed using whitespace, and stripped of the trailing '&'.
- * NOTE: Called by processParallel().
+ * Output: exit status of the last stage. The status of every stage is kept in pipeStatus.
 */
-void processPipe(char ** args)
+int processPipe(char ** args)
+{
+    return runPipeline(args, 0);
+}
+
+/*
+ * Engine of processPipe(). A group stage, groupStage in the arguments, is one more kind of stage: a subshell forked into
+ * the process group of the pipeline, placed and reaped like the others, that runs the group's list.
+ * Input: the parsed command line, the group of every group stage by stage index (NULL when there is none)
+ * Output: exit status of the last stage. The status of every stage is kept in pipeStatus.
+ * NOTE: Called by processSubstitutions().
+*/
+static int runPipeline(char ** args, Node ** groups)
 {
     // find position of | character via positionPipe function.
     int position = positionPipe(args);
     // if don't exist | character => call Function to process Redirect Command
     if (position == -1)
+        return processRedirectCommand(args);
+
+    // Split the arguments into stages; an empty stage is a syntax error
+    int numStages = 0;
+    char *** stages = splitPipeline(&lineArena, args, &numStages);
+    if (!stages)
     {
-        processRedirectCommand(args);
+        printf("[Error] Syntax Error\n");
+        return 2;
     }
-    // if | character is at the first argument => syxtax error
-    else if (position == 0)
+
+    // every stage takes its "@cpus=" prefix and its redirections out of its arguments, then its patterns are expanded.
+    // A stage without prefix is placed by the affinity option, if any.
+    Redirects * redirects = arenaAlloc(&lineArena, numStages * sizeof(Redirects));
+    Placement * placements = arenaAlloc(&lineArena, numStages * sizeof(Placement));
+    const Placement ** placed = arenaAlloc(&lineArena, numStages * sizeof(Placement *));
+    int i, j;
+    for (i = 0; i < numStages; i++)
     {
-        printf("[Error] Syntax Error\n");
-        return;
+        if (groups && groups[i])
+        {
+            // a group applies its own redirections in its subshell
+            redirects[i].items = 0;
+            redirects[i].count = 0;
+            placed[i] = placementForStage(&placements[i], i);
+            continue;
+        }
+        int prefix = placementTakePrefix(stages[i], &placements[i]);
+        if (prefix == -1)
+            return 1;
+        placed[i] = prefix ? &placements[i] : placementForStage(&placements[i], i);
+        if (parseRedirects(&lineArena, stages[i], &redirects[i]) == -1 || !stages[i][0])
+        {
+            printf("[Error] Syntax Error\n");
+            return 2;
+        }
+        stages[i] = expandArgs(&lineArena, stages[i]);
     }
-    else
+
+    // fds[2*i]: read end of pipe i; fds[2*i+1]: write end of pipe i. Pipe i joins stage i and stage i+1.
+    int numFds = 2 * (numStages - 1);
+    int * fds = arenaAlloc(&lineArena, numFds * sizeof(int));
+    pid_t * pids = arenaAlloc(&lineArena, numStages * sizeof(pid_t));
+
+    for (i = 0; i < numStages - 1; i++)
     {
-        // file descriptor. There are file types: fds[0]: read end of pipe; fds[1]: write end of pipe.
-        int fds[2];
-        // make pipe
-        int create_pipe = pipe(fds); 
+        if (makePipe(fds + 2 * i) == -1)
+        {
+            perror("Create pipe failed");
+            for (j = 0; j < 2 * i; j++)
+                close(fds[j]);
+            return 1;
+        }
+    }
 
-        // if make pipe failed
-        if (create_pipe == -1) 
-            { 
-                perror("Create pipe failed");
-                return;
-            }
+    // stages that could not be launched count as failed
+    pipeStatus = realloc(pipeStatus, numStages * sizeof(int));
+    if (!checkMemoryValid(pipeStatus))
+        exit(EXIT_FAILURE);
+    numPipeStatus = numStages;
+    for (i = 0; i < numStages; i++)
+    {
+        pipeStatus[i] = 1;
+        pids[i] = -1;
+    }
 
-            // Get arguments before and after | character
-            char ** argsFirst = parseFirstArgsPipe(args, position);
-            char ** argsSecond = parseSecondArgsPipe(args, position);
-        
-            if (argsFirst && argsSecond)
+    // a "cat" stage is run by the shell itself with moveData, without a process
+    int mover = findMoverStage(stages, redirects, numStages);
+
+    // pure builtins run on threads of the shell, other builtins in a forked subshell, commands are spawned directly.
+    // A thread only takes an output descriptor: a builtin redirecting STDERR, or fanning its output out, needs the subshell.
+    BuiltinStage * threads = arenaAlloc(&lineArena, numStages * sizeof(BuiltinStage));
+    for (i = 0; i < numStages; i++)
+    {
+        Builtin * builtin = findBuiltin(stages[i][0]);
+        int threaded = builtin && builtin->pure && redirectMaxFd(&redirects[i]) <= STDOUT_FILENO && redirectOutputTargets(&redirects[i]) < 2;
+        threads[i].builtin = threaded ? builtin : 0;
+        threads[i].stage = i + 1;
+    }
+
+    Timing timing;
+    timingStart(&timing);
+
+    // Launch every process stage first: a subshell forked later would inherit the descriptors of the threads.
+    // The first process leads the process group of the pipeline.
+    fflush(stdout);
+    pid_t pgid = 0;
+    int launched = 0;
+    for (i = 0; i < numStages; i++)
+    {
+        if (i == mover || threads[i].builtin)
+            continue;
+
+        int fdIn = i > 0 ? fds[2 * (i - 1)] : STDIN_FILENO;
+        int fdOut = i < numStages - 1 ? fds[2 * i + 1] : STDOUT_FILENO;
+        pid_t pid;
+
+        // redirections are applied in the child; several output targets need the fan-out of a subshell, arguments
+        // too large for exec() the batches it runs, a group the list it runs
+        Node * group = groups ? groups[i] : 0;
+        if (!group && !findBuiltin(stages[i][0]) && redirectOutputTargets(&redirects[i]) < 2 && !batchNeeded(stages[i]))
+        {
+            const Placement * saved = spawnPlacement;
+            if (placed[i])
+                spawnPlacement = placed[i];
+            pid = spawnCommand(stages[i], fdIn, fdOut, pgid, &redirects[i]);
+            spawnPlacement = saved;
+            int err = errno;
+            if (pid == SPAWN_REDIRECT_FAILED)
+            {
+                fprintf(stderr, "[Error] Redirect failed: %s\n", strerror(err));
+                continue;
+            }
+            if (pid < 0 && (err == ENOENT || err == EACCES || err == ENOEXEC || err == ENOTDIR))
             {
-                pid_t pid = fork();
-                // error
-		        if (pid < 0) 
+                fprintf(stderr, "[Error] Invalid command.\n");
+                pipeStatus[i] = 127;
+                continue;
+            }
+            errno = err;
+        }
+        else
+        {
+            pid = fork();
+            if (pid == 0)
+            {
+                setpgid(0, pgid);
+                resetChildSignals();
+                forkServerDetach();
+                timingDisable();
+                if (placed[i])
+                    placementApply(placed[i]);
+
+                // read from the previous pipe, write to the next one
+                if (i > 0)
+                    dup2(fdIn, STDIN_FILENO);
+                if (i < numStages - 1)
+                    dup2(fdOut, STDOUT_FILENO);
+                for (j = 0; j < numFds; j++)
                 {
-                    freeArgs(argsFirst);
-                    freeArgs(argsSecond);
-			        perror("[Error] Can not create child process. Failed to execute command.");
-			        return;
-		        }
-		        else if (pid == 0)
-                {     
-                    // duplicates fds[1] to standard output. 
-                    dup2(fds[1], STDOUT_FILENO);
-                    if (close(fds[0]) == -1 || close(fds[1]) == -1)
+                    if (close(fds[j]) == -1)
                     {
                         perror("[Error] Close file descriptor failed");
                         exit(EXIT_FAILURE);
                     }
-                    // process first command 
-                    processRedirectCommand(argsFirst);
-                    exit(0);
                 }
+                exit(group ? runInSubshell(group) : runRedirected(stages[i], &redirects[i]));
+            }
+        }
+        if (pid < 0)
+        {
+            perror("[Error] Can not create child process. Failed to execute command.");
+            break;
+        }
 
-                pid = fork();
-                // error
-                if (pid < 0) 
-                {
-                    freeArgs(argsFirst);
-                    freeArgs(argsSecond);
-			        perror("[Error] Can not create child process. Failed to execute command.");
-			        return;
-		        }
-                else if (pid == 0)
-                {
-                    // duplicates fds[0] to standard input. 
-                    dup2(fds[0],STDIN_FILENO);
-                    if (close(fds[1]) == -1 || close(fds[0]) == -1)
-                    {
-                        perror("[Error] Close file descriptor failed");
-                        exit(EXIT_FAILURE);
-                    }
-                    // process second command 
-                    processRedirectCommand(argsSecond);
-                    exit(0);
-                } 
-                
-                // close file descriptors
-                close(fds[0]);
-                close(fds[1]);
-                
-                // wait for first command
-                wait(0); 
-                // wait for second command
-                wait(0);
-            }   
-        // Delete argsFirst and argsSecond arguments.
-        freeArgs(argsFirst);
-        freeArgs(argsSecond);
-    }
-}
-/*
-   * Identifies and processes the redirection operator ( ">", "<" ). Redirects input or output to files specified in the command.
-   * Input: array of command's arguments
-   * Output: None
-   * NOTE: called by processPipe().
-*/
-void processRedirectCommand(char **args)
-{
-        // get number of command's arguments 
-        int numArgs = getNumArgs(args);
-        int fd_out = 0;
-        int fd_in = 0;
-        // when number of arugments is greater than 2, the command could include the redirection operators. 
-        if (numArgs>2)
+        if (pgid == 0)
+            pgid = pid;
+        setpgid(pid, pgid);
+        pids[i] = pid;
+        launched++;
+    }
+    int failed = i < numStages;
+    if (failed)
+        mover = -1; // launch failed, do not feed a broken pipeline
+
+    // then the builtin stages, each on its own copy of the output descriptor
+    for (i = 0; i < numStages; i++)
+        if (threads[i].builtin && (failed || !startBuiltinStage(&threads[i], stages[i], &redirects[i], i < numStages - 1 ? fds[2 * i + 1] : STDOUT_FILENO)))
+            threads[i].builtin = 0; // nothing to join, the stage stays failed
+
+    // close file descriptors, the children and threads hold their own copies. The mover keeps its two ends.
+    int moverIn = mover > 0 ? fds[2 * (mover - 1)] : STDIN_FILENO;
+    int moverOut = mover >= 0 && mover < numStages - 1 ? fds[2 * mover + 1] : STDOUT_FILENO;
+    for (j = 0; j < numFds; j++)
+        if (mover == -1 || (fds[j] != moverIn && fds[j] != moverOut))
+            close(fds[j]);
+
+    // hand the terminal to the pipeline while it runs in the foreground
+    int interactive = launched > 0 && isatty(STDIN_FILENO);
+    if (interactive)
+        tcsetpgrp(STDIN_FILENO, pgid);
+
+    if (mover != -1)
+    {
+        Timing moverTiming;
+        timingStart(&moverTiming);
+        pipeStatus[mover] = runMoverStage(stages[mover], &redirects[mover], moverIn, moverOut);
+        if (timingEnabled())
+            timingReportSelf(stages[mover][0], mover + 1, &moverTiming);
+        if (moverIn != STDIN_FILENO)
+            close(moverIn);
+        if (moverOut != STDOUT_FILENO)
+            close(moverOut);
+    }
+
+    // wait for the builtin stages
+    for (i = 0; i < numStages; i++)
+    {
+        if (threads[i].builtin)
+        {
+            pthread_join(threads[i].thread, 0);
+            pipeStatus[i] = threads[i].status;
+        }
+    }
+
+    // reap every stage of the process group
+    int remaining = launched;
+    while (remaining > 0)
+    {
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(-pgid, &status, 0, &usage);
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (i = 0; i < numStages; i++)
+        {
+            if (pids[i] == pid)
             {
-                // ">" operator
-                if (strcmp(args[numArgs-2],">")==0) 
-                {
-                        // Create new file
-                        fd_out =creat(args[numArgs-1],S_IRWXU);
-                        
-                        // Error 
-                        if (fd_out==-1)
-                        {
-                            perror("Redirect output failed");
-                            return;
-                        }
-                        
-                        // Save current stdout to turn back latter 
-                        int saved_stdout = dup(STDOUT_FILENO);
-
-                        // Redirect STDOUT to fd_out 
-                        dup2(fd_out,STDOUT_FILENO);
-
-                        // Close file 
-                        if (close(fd_out) == -1)
-                        {
-                            perror("Close output failed");
-                            return;
-                        }    
-
-                        // Delete 2 last arguments then call processSimpleCommand to process a simple command.
-                        free(args[numArgs-1]);
-                        free(args[numArgs-2]);
-                        args[numArgs-2] = 0;
-                        processSimpleCommand(args);
-                        
-                        // Redirect STDOUT to the saved stdout. 
-                        dup2(saved_stdout,STDOUT_FILENO);
-                        
-                        // close
-                        if (close(saved_stdout) == -1)
-                        {
-                            perror("Close output failed");
-                            return;
-                        }   
-                        
-                        return;
-                }
-                // "<" command
-                else if (strcmp(args[numArgs-2],"<")==0)
-                {
-                        // Open file
-                        fd_in =open(args[numArgs-1],O_RDONLY);
-                        
-                        // Error 
-                        if (fd_in==-1)
-                        {
-                            perror("Redirect input failed");
-                            return;
-                        }
-
-                        // Save current stdin to turn back latter 
-                        int saved_stdin = dup(STDIN_FILENO);
-                        
-                        // Redirect STDIN
-                        dup2(fd_in,STDIN_FILENO);
-
-                        // Close file 
-                        if (close(fd_in) == -1)
-                        {
-                            perror("Close input failed");
-                            return;
-                        }
-
-                        // Delete 2 last arguments then call processSimpleCommand to process a simple command.
-                        free(args[numArgs-1]);
-                        free(args[numArgs-2]);
-                        args[numArgs-2] = 0;   
-                        processSimpleCommand(args); 
-                        
-                        // Redirect STDIN to the saved stdin. 
-                        dup2(saved_stdin,STDIN_FILENO);
-                        
-                        // close
-                        if (close(saved_stdin) == -1)
-                        {
-                            perror("Close input failed");
-                            return;
-                        }
-                        return;
+                pipeStatus[i] = decodeStatus(status);
+                if (WIFSIGNALED(status) && WTERMSIG(status) != SIGPIPE)
+                    fprintf(stderr, "[Pipeline] stage %d (%s) killed by signal %d\n", i + 1, stages[i][0], WTERMSIG(status));
+                if (timingEnabled())
+                    timingReportChild(stages[i][0], i + 1, &timing, &usage);
+                remaining--;
+                break;
+            }
+        }
+    }
 
-                }
+    if (interactive)
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+
+    return pipeStatus[numStages - 1];
+}
+/*
+ * Point the shell's standard descriptors, from a given one up to STDERR, at the descriptors of a command run inside it, for
+ * what it prints through stdio. Only the descriptors that differ are swapped; the saved ones are close-on-exec.
+ * Input: the resolved redirections, the first descriptor to swap, array receiving the saved descriptors (-1 when not swapped)
+ * Output: void
+*/
+static void swapStdFds(const ShellRedirect * shell, int first, int saved[3])
+{
+    int fd;
+    for (fd = 0; fd < 3; fd++)
+    {
+        saved[fd] = -1;
+        if (fd < first || shell->fd[fd] == fd)
+            continue;
+        saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (shell->fd[fd] == -1)
+            close(fd);
+        else
+            dup2(shell->fd[fd], fd);
+    }
+}
+
+/*
+ * Put back the descriptors saved by swapStdFds().
+ * Input: the saved descriptors
+ * Output: void
+*/
+static void restoreStdFds(int saved[3])
+{
+    int fd;
+    for (fd = 0; fd < 3; fd++)
+    {
+        if (saved[fd] == -1)
+            continue;
+        dup2(saved[fd], fd);
+        close(saved[fd]);
+    }
+}
+
+/*
+ * Run a command with its descriptors and redirections: builtins and "cat" of plain files inside the shell, on descriptors
+ * opened for them, anything else through the spawn engine with the redirections applied in the child.
+ * Input: array of command's arguments, input and output descriptors (-1 for the shell's own), redirections
+ * Output: exit status of the command
+*/
+static int runSimpleCommand(char ** args, int fdIn, int fdOut, const Redirects * redirects)
+{
+    Timing timing;
+    ShellRedirect shell;
+    int status;
+    timingStart(&timing);
+
+    Builtin * builtin = findBuiltin(args[0]);
+    if (!builtin && !isMoverCommand(args))
+        return executeExternalCommand(args, fdIn, fdOut, redirects);
+
+    if (redirectOpen(&lineArena, redirects, fdIn, fdOut, &shell) == -1)
+        return 1;
+
+    if (builtin)
+        status = executeInternalCommand(args, &shell);
+    else if (args[1] || !isatty(shell.fd[0]))
+    {
+        // "cat" of plain files is served in the shell with zero-copy moves; what it reports goes to its STDERR
+        int saved[3];
+        fflush(stdout);
+        swapStdFds(&shell, STDERR_FILENO, saved);
+        status = catFiles(args + 1, shell.fd[0], shell.fd[1] == STDERR_FILENO && saved[2] != -1 ? saved[2] : shell.fd[1]);
+        restoreStdFds(saved);
+    }
+    else
+    {
+        // a bare cat on the terminal stays external
+        redirectRelease(&shell);
+        return executeExternalCommand(args, fdIn, fdOut, redirects);
+    }
+    redirectRelease(&shell);
+
+    if (timingEnabled())
+        timingReportSelf(args[0], 0, &timing);
+    return status;
+}
+
+/*
+ * The shell side of a command writing to several files: a thread copies the pipe the command writes into to every target.
+*/
+typedef struct FanOut {
+    int fdIn; // read end of the pipe, owned by the thread
+    int * fdOuts;
+    int numOuts;
+    int err; // errno of the first failed copy, 0 if none
+    pthread_t thread;
+} FanOut;
+
+/*
+ * Body of the fan-out thread. SIGPIPE is blocked: a target that stops reading is dropped, the others are still served.
+ * Input: the FanOut
+ * Output: NULL
+*/
+static void * runFanOut(void * arg)
+{
+    FanOut * fanOut = arg;
+    sigset_t pipeSet;
+
+    sigemptyset(&pipeSet);
+    sigaddset(&pipeSet, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipeSet, 0);
+
+    fanOut->err = teeData(fanOut->fdIn, fanOut->fdOuts, fanOut->numOuts) == -1 ? errno : 0;
+    close(fanOut->fdIn);
+    return 0;
+}
+
+/*
+ * Run a command whose output goes to several files ("cmd > a > b"). The command writes into a pipe, the shell duplicates the stream with tee() and splice() so it never passes through user memory.
+ * Input: array of command's arguments, its redirections, number of files on STDOUT
+ * Output: exit status of the command, 1 if a target could not be opened or written
+*/
+static int processFanOutCommand(char ** args, const Redirects * redirects, int targets)
+{
+    int * fdOuts = arenaAlloc(&lineArena, targets * sizeof(int));
+    Redirects others;
+    int fds[2];
+    int i, numOuts = 0, status;
+    FanOut fanOut;
+
+    // the shell writes the files on STDOUT itself, the other redirections go to the command
+    others.items = arenaAlloc(&lineArena, redirects->count * sizeof(Redirect));
+    others.count = 0;
+    for (i = 0; i < redirects->count; i++)
+    {
+        const Redirect * r = &redirects->items[i];
+        if (!(r->fd == STDOUT_FILENO && r->path && r->flags != O_RDONLY))
+        {
+            others.items[others.count++] = *r;
+            continue;
+        }
+        fdOuts[numOuts] = open(r->path, r->flags | O_CLOEXEC, REDIRECT_MODE);
+        if (fdOuts[numOuts] == -1)
+        {
+            perror("Redirect output failed");
+            while (numOuts-- > 0)
+                close(fdOuts[numOuts]);
+            return 1;
         }
-        
-    // if there is no redirection command, just call processSimleCommand
-    processSimpleCommand(args);
+        numOuts++;
+    }
+    if (makePipe(fds) == -1)
+    {
+        perror("Create pipe failed");
+        for (i = 0; i < numOuts; i++)
+            close(fdOuts[i]);
+        return 1;
+    }
+
+    fanOut.fdIn = fds[0];
+    fanOut.fdOuts = fdOuts;
+    fanOut.numOuts = numOuts;
+    int err = pthread_create(&fanOut.thread, 0, runFanOut, &fanOut);
+    if (err != 0)
+    {
+        fprintf(stderr, "[Error] Can not create thread: %s\n", strerror(err));
+        close(fds[0]);
+        close(fds[1]);
+        for (i = 0; i < numOuts; i++)
+            close(fdOuts[i]);
+        return 1;
+    }
 
+    // the command writes into the pipe; once it is done the shell's write end goes and the thread sees end of file
+    status = runSimpleCommand(args, -1, fds[1], &others);
+    close(fds[1]);
+    pthread_join(fanOut.thread, 0);
+
+    for (i = 0; i < numOuts; i++)
+        close(fdOuts[i]);
+    if (fanOut.err != 0)
+    {
+        fprintf(stderr, "[Error] Redirect output failed: %s\n", strerror(fanOut.err));
+        if (status == 0)
+            status = 1;
+    }
+    return status;
 }
 
 /*
- * Process a simple command ( without any redirection, pipe,...). Process both Internal and External Commands
+ * Run a command with its redirection list, already taken out of its arguments.
+ * Input: array of command's arguments, its redirections
+ * Output: exit status of the command
+ * NOTE: called by processRedirectCommand() and by the subshell of a pipeline stage.
+*/
+static int runRedirected(char ** args, const Redirects * redirects)
+{
+    // redirections without a command only create (or check) their files
+    if (!args[0])
+    {
+        ShellRedirect shell;
+        if (redirectOpen(&lineArena, redirects, -1, -1, &shell) == -1)
+            return 1;
+        redirectRelease(&shell);
+        return 0;
+    }
+
+    // "cmd > a > b": the output goes to every file
+    int targets = redirectOutputTargets(redirects);
+    if (targets > 1)
+        return processFanOutCommand(args, redirects, targets);
+    return runSimpleCommand(args, -1, -1, redirects);
+}
+
+/*
+ * Identifies and processes the redirection operators ("<", ">", ">>", "2>", "2>&1", "n<&m", ...). The redirections are
+ * taken out of the arguments into a list that is applied in the child of an external command, through spawn file actions,
+ * so the shell's own descriptors are never touched. A leading "@cpus=LIST" word places the command on those CPUs.
  * Input: array of command's arguments
- * Output: None
- * NOTE: called by processRedirectCommand().
+ * Output: exit status of the command, 2 on a syntax error
+ * NOTE: called by processPipe().
 */
-void processSimpleCommand(char **args)
+int processRedirectCommand(char **args)
 {
-    int status = executeInternalCommand(args);
-	if (status == -1) {
-		// No built-in command available -> Outsource it.
-		executeExternalCommand(args);
-	}
+    Redirects redirects;
+    Placement placement;
+    int placed = placementTakePrefix(args, &placement);
+    if (placed == -1)
+        return 1;
+    if (parseRedirects(&lineArena, args, &redirects) == -1 || (placed && !args[0]))
+    {
+        printf("[Error] Syntax Error\n");
+        return 2;
+    }
+
+    // "@cpus=LIST cmd": every process the command starts runs on those CPUs
+    const Placement * saved = spawnPlacement;
+    if (placed)
+        spawnPlacement = &placement;
+    int status = runRedirected(expandArgs(&lineArena, args), &redirects);
+    spawnPlacement = saved;
+    return status;
 }
 
-/* process and call execvp().
- * Input: The external command, more specifically its arguments.
- * NOTE: Called by processSimpleCommand().
+/*
+ * Process a simple command ( without any redirection, pipe,...). Process both Internal and External Commands
+ * Input: array of command's arguments, output descriptor (-1 for the shell's own)
+ * Output: exit status of the command
+ * NOTE: called by the cache builtin.
 */
-void executeExternalCommand(char ** args)
+int processSimpleCommand(char **args, int fdOut)
 {
-    pid_t pid = fork(); // clones the program, produces a child process from a parent process
-    if (pid < 0) {
-        // fork failed
-        fprintf(stderr, "[Error] Can not create child process. Failed to execute command.\n");
+    static const Redirects none = {0, 0};
+    return runSimpleCommand(args, -1, fdOut, &none);
+}
+
+/* Launch an external command through the spawn engine and wait for it.
+ * Input: The external command, more specifically its arguments; input and output descriptors (-1 for the shell's own)
+ *        and the redirections applied in the child.
+ * Output: exit status of the command, 127 if it could not be launched, 1 if a redirection failed.
+ * NOTE: Called by processSimpleCommand(). Arguments larger than ARG_MAX are run in batches by runBatched().
+*/
+int executeExternalCommand(char ** args, int fdIn, int fdOut, const Redirects * redirects)
+{
+    int status = 0;
+    struct rusage usage;
+    Timing timing;
+    // arguments exec() would refuse are split into batches, as xargs does
+    if (batchNeeded(args))
+        return runBatched(&lineArena, args, fdIn, fdOut, redirects);
+    timingStart(&timing);
+    pid_t pid = spawnCommand(args, fdIn, fdOut, -1, redirects);
+    if (pid == -1 && errno == E2BIG)
+        return runBatched(&lineArena, args, fdIn, fdOut, redirects);
+    if (pid == SPAWN_REDIRECT_FAILED) {
+        fprintf(stderr, "[Error] Redirect failed: %s\n", strerror(errno));
+        return 1;
     }
-    else if (pid == 0) {            // children process
-        int exeStatus = execvp(args[0], args);
-        if (exeStatus < 0) {
+    if (pid < 0) {
+        if (errno == ENOENT || errno == EACCES || errno == ENOEXEC || errno == ENOTDIR)
             fprintf(stderr, "[Error] Invalid command.\n");
-            exit(1);// this one is crucial, without it the child process will not terminate
-        }
-    }
-    else {
-        while (wait(NULL) != pid);  // wait for child process
+        else
+            fprintf(stderr, "[Error] Can not create child process. Failed to execute command.\n");
+        return 127;
     }
+    while (wait4(pid, &status, 0, &usage) < 0)  // wait for child process
+        if (errno != EINTR)
+            return 1;
+    if (timingEnabled())
+        timingReportChild(args[0], 0, &timing, &usage);
+    return decodeStatus(status);
 }
 
 /*
  * Execute command that is built-in in the shell itself, for example 'cd'.
- * Input: The built-in command.
+ * Pure builtins write to their output descriptor directly; the others print through stdio, so the shell's STDIN and STDOUT
+ * are swapped for the time of the call. "exec" without a command keeps its redirections for the rest of the shell.
+ * Input: The built-in command, its resolved redirections.
+ * Output: exit status of the built-in, -1 if the command is not one (or was disabled with "enable -n").
  * NOTE: Called by processSimpleCommand().
 */
-int executeInternalCommand(char ** args)
-{
-	/*
-	NOTE: this part is supposed to take care of !! and exit, but Phuc moved it to the main loop.
-	I will handle this later.
-	*/
-	// handle 'cd' 
-    if (strcmp(args[0],"cd") == 0) {
-		char savedPwd[MAX_LENGTH]; // save a current directory
-		char *path;
-
-		// set the correct path
-		if (args[1] == NULL) {
-			// cd without arguments jumps to the home directory
-			path = getenv("HOME");
-		}
-		else if (strcmp(args[1], "-") == 0) {
-			// cd - returns to the previous working directory
-			if (strcmp(OLDPWD, "") == 0) {
-				perror("[Error] No previous working directory.\n");
-				return 0; // cd unsucessful
-			}
-			else printf("%s\n", OLDPWD); // echo the previous path
-			path = OLDPWD;
-		}
-		else path = args[1];
-
-		strcpy(savedPwd, getenv("PWD"));
-		// call chdir()
-		if (chdir(path) != 0) {
-			perror("[Error] No such file or directory.\n");
-			return 0;// cd unsuccessful
-		} 
-		strcpy(OLDPWD, savedPwd); // save new directory
-		return 1; // cd successful
-	}
+int executeInternalCommand(char ** args, const ShellRedirect * shell)
+{
+	Builtin * builtin = findBuiltin(args[0]);
+	int saved[3];
+	if (!builtin)
+		return -1; // No matching built-in command
 
-	return -1; // No matching built-in command
+	// builtins write to the descriptor directly: what printf() buffered must go out first, and their own printf() right after
+	fflush(stdout);
+	swapStdFds(shell, builtin->pure ? STDERR_FILENO : STDIN_FILENO, saved);
+	// "1>&2 2>file": the output named the shell's STDERR before it was swapped
+	int out = shell->fd[1];
+	if (out >= 0 && out < 3 && saved[out] != -1)
+		out = saved[out];
+	int status = builtin->run(args, builtin->pure ? out : STDOUT_FILENO);
+	fflush(stdout);
+
+	if (strcmp(args[0], "exec") == 0 && !args[1])
+	{
+		int fd;
+		for (fd = 0; fd < 3; fd++)
+			if (saved[fd] != -1)
+				close(saved[fd]);
+		return status;
+	}
+	restoreStdFds(saved);
+	return status;
 }
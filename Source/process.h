@@ -1,8 +1,18 @@
 #pragma once
-void shLoop();
-void processParallel(char ** args, int mode); 
-void processPipe(char ** args);
-void processSimpleCommand(char **args);
-void processRedirectCommand(char **args);
-void executeExternalCommand(char ** args);
-int executeInternalCommand(char ** args);
+#include "redirect.h"
+void shInit();
+int shLoop();
+int runLine(char * command, int * exitShell);
+int runString(char * command);
+int runScript(char * path);
+int processParallel(char ** args, int mode); 
+int processPipe(char ** args);
+int processSimpleCommand(char **args, int fdOut);
+int processRedirectCommand(char **args);
+int executeExternalCommand(char ** args, int fdIn, int fdOut, const Redirects * redirects);
+int executeInternalCommand(char ** args, const ShellRedirect * shell);
+int decodeStatus(int status);
+
+extern int * pipeStatus;
+extern int numPipeStatus;
+extern int lastStatus;
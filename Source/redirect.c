@@ -0,0 +1,252 @@
+#include "redirect.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+    * Parse a descriptor number: decimal digits only, at most INT_MAX.
+    * INPUT: start and end of the digits
+    * OUTPUT: the descriptor, -1 if the text is not a descriptor
+*/
+static int parseFd(const char * start, const char * end)
+{
+    char * stop;
+    if (start == end || !isdigit((unsigned char)*start))
+        return -1;
+    errno = 0;
+    long fd = strtol(start, &stop, 10);
+    if (errno == ERANGE || stop != end || fd > INT_MAX)
+        return -1;
+    return (int)fd;
+}
+
+/*
+    * Find the last redirection setting a descriptor among the first ones of a list.
+    * INPUT: redirection list, number of redirections to search, descriptor
+    * OUTPUT: index of the redirection, -1 if none sets the descriptor
+*/
+static int redirectFind(const Redirects * redirects, int count, int fd)
+{
+    int i;
+    for (i = count - 1; i >= 0; i--)
+        if (redirects->items[i].fd == fd)
+            return i;
+    return -1;
+}
+
+/*
+    * Take the redirections out of the arguments of a command. A redirection is a word made of an optional descriptor
+    * number and an operator ("<", ">", ">>", "<&", ">&"); its target follows in the same word or is the next word.
+    * A quoted "<" is an argument: quotes are still there, targets lose theirs (the arguments lose them in expandArgs()).
+    * A copy of a descriptor above STDERR must name one an earlier redirection of the command set: the shell's own
+    * descriptors (history file, fork server...) are never handed out.
+    * INPUT: arena of the command line, arguments (compacted in place), list to fill
+    * OUTPUT: 0 on success, -1 on a syntax error (missing target, "&" followed by something else than a number or "-",
+    *         a descriptor above INT_MAX, a copy of a descriptor above STDERR the command did not set)
+*/
+int parseRedirects(Arena * arena, char ** args, Redirects * redirects)
+{
+    int numArgs = getNumArgs(args);
+    int i, kept = 0;
+
+    redirects->items = arenaAlloc(arena, (numArgs + 1) * sizeof(Redirect));
+    redirects->count = 0;
+    for (i = 0; i < numArgs; i++)
+    {
+        char * word = args[i];
+        char * p = word;
+        while (isdigit((unsigned char)*p))
+            p++;
+
+        // an argument, or a process substitution left as is
+        if ((*p != '<' && *p != '>') || p[1] == '(')
+        {
+            args[kept++] = word;
+            continue;
+        }
+
+        Redirect * r = &redirects->items[redirects->count++];
+        r->fd = p > word ? parseFd(word, p) : (*p == '<' ? STDIN_FILENO : STDOUT_FILENO);
+        if (r->fd == -1)
+            return -1;
+        r->flags = *p == '<' ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC;
+        r->source = -1;
+        r->path = 0;
+        if (p[0] == '>' && p[1] == '>')
+        {
+            r->flags = O_WRONLY | O_CREAT | O_APPEND;
+            p++;
+        }
+        p++;
+
+        int copy = *p == '&';
+        if (copy)
+            p++;
+        char * target = *p ? p : args[++i];
+        if (!target)
+            return -1;
+
+        if (!copy)
+            r->path = unquoteWord(arena, target);
+        else if (strcmp(target, "-") != 0)
+        {
+            r->source = parseFd(target, target + strlen(target));
+            if (r->source == -1 || (r->source > STDERR_FILENO && redirectFind(redirects, redirects->count - 1, r->source) == -1))
+                return -1;
+        }
+    }
+    args[kept] = 0;
+    return 0;
+}
+
+/*
+    * Count the files the standard output is sent to: more than one ("cmd > a > b") fans the output out to every file.
+    * INPUT: redirection list
+    * OUTPUT: number of output files on STDOUT
+*/
+int redirectOutputTargets(const Redirects * redirects)
+{
+    int i, targets = 0;
+    for (i = 0; i < redirects->count; i++)
+        if (redirects->items[i].fd == STDOUT_FILENO && redirects->items[i].path && redirects->items[i].flags != O_RDONLY)
+            targets++;
+    return targets;
+}
+
+/*
+    * Highest descriptor a redirection list sets: a command running on a thread of the shell can only take STDIN and STDOUT.
+    * INPUT: redirection list
+    * OUTPUT: the descriptor, -1 for an empty list
+*/
+int redirectMaxFd(const Redirects * redirects)
+{
+    int i, max = -1;
+    for (i = 0; i < redirects->count; i++)
+        if (redirects->items[i].fd > max)
+            max = redirects->items[i].fd;
+    return max;
+}
+
+/*
+    * Apply a redirection list to the calling process. Only for a forked child: the descriptors are replaced for good.
+    * INPUT: redirection list
+    * OUTPUT: 0 on success, -1 after reporting the failure
+*/
+int redirectApply(const Redirects * redirects)
+{
+    int i;
+    for (i = 0; i < redirects->count; i++)
+    {
+        const Redirect * r = &redirects->items[i];
+        if (r->path)
+        {
+            int fd = open(r->path, r->flags, REDIRECT_MODE);
+            if (fd == -1)
+            {
+                perror(r->flags == O_RDONLY ? "Redirect input failed" : "Redirect output failed");
+                return -1;
+            }
+            if (fd != r->fd)
+            {
+                dup2(fd, r->fd);
+                close(fd);
+            }
+        }
+        else if (r->source == -1)
+            close(r->fd);
+        else if (dup2(r->source, r->fd) == -1)
+        {
+            perror("[Error] Duplicate file descriptor failed");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+    * Add a redirection list to the file actions of posix_spawn(): the files are opened in the child, the shell never touches them.
+    * INPUT: file actions, redirection list
+    * OUTPUT: 0 on success, an error number otherwise
+*/
+int redirectAddActions(posix_spawn_file_actions_t * actions, const Redirects * redirects)
+{
+    int i, err = 0;
+    for (i = 0; i < redirects->count && err == 0; i++)
+    {
+        const Redirect * r = &redirects->items[i];
+        if (r->path)
+            err = posix_spawn_file_actions_addopen(actions, r->fd, r->path, r->flags, REDIRECT_MODE);
+        else if (r->source == -1)
+            err = posix_spawn_file_actions_addclose(actions, r->fd);
+        else
+            err = posix_spawn_file_actions_adddup2(actions, r->source, r->fd);
+    }
+    return err;
+}
+
+/*
+    * Resolve the redirections of a command run inside the shell. Files are opened close-on-exec; descriptors above
+    * STDERR mean nothing to such a command, their files are only created, and a copy of one takes what the command
+    * set it to, never the shell's descriptor of that number.
+    * INPUT: arena of the command line, redirection list, input and output descriptors of the command (-1 for the
+    *        shell's own), the result to fill
+    * OUTPUT: 0 on success, -1 after reporting the failure (nothing is left open)
+*/
+int redirectOpen(Arena * arena, const Redirects * redirects, int fdIn, int fdOut, ShellRedirect * shell)
+{
+    int i;
+    int * resolved = arenaAlloc(arena, (redirects->count + 1) * sizeof(int));
+    shell->fd[0] = fdIn == -1 ? STDIN_FILENO : fdIn;
+    shell->fd[1] = fdOut == -1 ? STDOUT_FILENO : fdOut;
+    shell->fd[2] = STDERR_FILENO;
+    shell->opened = arenaAlloc(arena, (redirects->count + 1) * sizeof(int));
+    shell->numOpened = 0;
+
+    for (i = 0; i < redirects->count; i++)
+    {
+        const Redirect * r = &redirects->items[i];
+        int fd;
+        if (r->path)
+        {
+            fd = open(r->path, r->flags | O_CLOEXEC, REDIRECT_MODE);
+            if (fd == -1)
+            {
+                perror(r->flags == O_RDONLY ? "Redirect input failed" : "Redirect output failed");
+                redirectRelease(shell);
+                return -1;
+            }
+            shell->opened[shell->numOpened++] = fd;
+        }
+        else if (r->source == -1)
+            fd = -1;
+        else if (r->source < 3)
+            fd = shell->fd[r->source];
+        else
+            fd = resolved[redirectFind(redirects, i, r->source)]; // parseRedirects() made sure it is set
+
+        resolved[i] = fd;
+        if (r->fd < 3)
+            shell->fd[r->fd] = fd;
+    }
+    return 0;
+}
+
+/*
+    * Close the files opened by redirectOpen().
+    * INPUT: the resolved redirections
+    * OUTPUT: void
+*/
+void redirectRelease(ShellRedirect * shell)
+{
+    int i;
+    for (i = 0; i < shell->numOpened; i++)
+        close(shell->opened[i]);
+    shell->numOpened = 0;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include "arena.h"
+#include <spawn.h>
+#define REDIRECT_MODE S_IRWXU // permissions of a file created by ">" or ">>", as creat() used before
+
+/*
+ * One redirection of a command, applied in the order written: "n< file", "n> file" and "n>> file" open a file on
+ * descriptor fd, "n<&m" and "n>&m" make fd a copy of m, "n>&-" closes fd.
+*/
+typedef struct Redirect {
+    int fd; // descriptor of the command
+    int flags; // open() flags of the file
+    int source; // descriptor copied, -1 to close fd; unused for a file
+    char * path; // file, 0 for a copy or a close
+} Redirect;
+
+/*
+ * Redirection list of a command, taken out of its arguments by parseRedirects().
+*/
+typedef struct Redirects {
+    Redirect * items;
+    int count;
+} Redirects;
+
+/*
+ * STDIN, STDOUT and STDERR of a command run inside the shell (builtin, in-shell cat) after its redirections. Files are
+ * opened close-on-exec next to the shell's own descriptors, which are never replaced.
+*/
+typedef struct ShellRedirect {
+    int fd[3];
+    int * opened; // files opened for the command, closed by redirectRelease()
+    int numOpened;
+} ShellRedirect;
+
+int parseRedirects(Arena * arena, char ** args, Redirects * redirects);
+int redirectOutputTargets(const Redirects * redirects);
+int redirectMaxFd(const Redirects * redirects);
+int redirectApply(const Redirects * redirects);
+int redirectAddActions(posix_spawn_file_actions_t * actions, const Redirects * redirects);
+int redirectOpen(Arena * arena, const Redirects * redirects, int fdIn, int fdOut, ShellRedirect * shell);
+void redirectRelease(ShellRedirect * shell);
@@ -0,0 +1,569 @@
+#include "scan.h"
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+#define CLASS_SPACE 1
+#define CLASS_TAB 2
+#define CLASS_QUOTE 4
+#define CLASS_OP 8
+
+typedef void (*Classifier)(const char * p, ScanMasks * masks);
+
+static const unsigned char charClass[256] = {
+    [' '] = CLASS_SPACE, ['\t'] = CLASS_SPACE | CLASS_TAB,
+    ['\''] = CLASS_QUOTE, ['"'] = CLASS_QUOTE, ['\\'] = CLASS_QUOTE,
+    ['|'] = CLASS_OP, ['<'] = CLASS_OP, ['>'] = CLASS_OP, ['&'] = CLASS_OP, [';'] = CLASS_OP, ['('] = CLASS_OP, [')'] = CLASS_OP,
+};
+
+const char * scanEngine = 0;
+
+/*
+    * Gather bit k of the eight bytes of a word into an 8-bit mask: the multiplication moves bit k of byte j to bit 56 + j.
+    * INPUT: eight class bytes, the class bit
+    * OUTPUT: the mask
+*/
+static uint64_t gatherBits(uint64_t classes, int k)
+{
+    return ((classes >> k & 0x0101010101010101ull) * 0x0102040810204080ull) >> 56;
+}
+
+/*
+    * Classify a block 8 bytes at a time: the class bits of the bytes come from a table and are packed in one word.
+    * scanTokens() and scanNormalize() do not use it: without vectors, a walk of the bytes beats building masks.
+    * INPUT: SCAN_BLOCK bytes, masks to fill
+    * OUTPUT: void
+*/
+static void classifyScalar(const char * p, ScanMasks * masks)
+{
+    const unsigned char * b = (const unsigned char *)p;
+    int i;
+    masks->space = masks->tab = masks->quote = masks->op = 0;
+    for (i = 0; i < SCAN_BLOCK; i += 8)
+    {
+        uint64_t classes = (uint64_t)charClass[b[i]] | (uint64_t)charClass[b[i+1]] << 8
+            | (uint64_t)charClass[b[i+2]] << 16 | (uint64_t)charClass[b[i+3]] << 24
+            | (uint64_t)charClass[b[i+4]] << 32 | (uint64_t)charClass[b[i+5]] << 40
+            | (uint64_t)charClass[b[i+6]] << 48 | (uint64_t)charClass[b[i+7]] << 56;
+        if (!classes)
+            continue;
+        masks->space |= gatherBits(classes, 0) << i;
+        masks->tab |= gatherBits(classes, 1) << i;
+        masks->quote |= gatherBits(classes, 2) << i;
+        masks->op |= gatherBits(classes, 3) << i;
+    }
+}
+
+#ifdef SCAN_X86
+/*
+    * Classify a block 16 bytes at a time: one comparison per character of a class, the results packed by movemask.
+    * INPUT: SCAN_BLOCK bytes, masks to fill
+    * OUTPUT: void
+*/
+static void classifySse2(const char * p, ScanMasks * masks)
+{
+    int i;
+    masks->space = masks->tab = masks->quote = masks->op = 0;
+    for (i = 0; i < SCAN_BLOCK; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+#define EQ(c) _mm_cmpeq_epi8(v, _mm_set1_epi8(c))
+        __m128i tab = EQ('\t');
+        __m128i space = _mm_or_si128(EQ(' '), tab);
+        __m128i quote = _mm_or_si128(_mm_or_si128(EQ('\''), EQ('"')), EQ('\\'));
+        __m128i op = _mm_or_si128(_mm_or_si128(_mm_or_si128(EQ('|'), EQ('<')), _mm_or_si128(EQ('>'), EQ('&'))),
+            _mm_or_si128(_mm_or_si128(EQ(';'), EQ('(')), EQ(')')));
+#undef EQ
+        masks->space |= (uint64_t)(unsigned int)_mm_movemask_epi8(space) << i;
+        masks->tab |= (uint64_t)(unsigned int)_mm_movemask_epi8(tab) << i;
+        masks->quote |= (uint64_t)(unsigned int)_mm_movemask_epi8(quote) << i;
+        masks->op |= (uint64_t)(unsigned int)_mm_movemask_epi8(op) << i;
+    }
+}
+
+/*
+    * Same as classifySse2(), 32 bytes at a time.
+    * INPUT: SCAN_BLOCK bytes, masks to fill
+    * OUTPUT: void
+*/
+__attribute__((target("avx2")))
+static void classifyAvx2(const char * p, ScanMasks * masks)
+{
+    int i;
+    masks->space = masks->tab = masks->quote = masks->op = 0;
+    for (i = 0; i < SCAN_BLOCK; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+#define EQ(c) _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))
+        __m256i tab = EQ('\t');
+        __m256i space = _mm256_or_si256(EQ(' '), tab);
+        __m256i quote = _mm256_or_si256(_mm256_or_si256(EQ('\''), EQ('"')), EQ('\\'));
+        __m256i op = _mm256_or_si256(_mm256_or_si256(_mm256_or_si256(EQ('|'), EQ('<')), _mm256_or_si256(EQ('>'), EQ('&'))),
+            _mm256_or_si256(_mm256_or_si256(EQ(';'), EQ('(')), EQ(')')));
+#undef EQ
+        masks->space |= (uint64_t)(unsigned int)_mm256_movemask_epi8(space) << i;
+        masks->tab |= (uint64_t)(unsigned int)_mm256_movemask_epi8(tab) << i;
+        masks->quote |= (uint64_t)(unsigned int)_mm256_movemask_epi8(quote) << i;
+        masks->op |= (uint64_t)(unsigned int)_mm256_movemask_epi8(op) << i;
+    }
+}
+#endif
+
+static void classifyFirst(const char * p, ScanMasks * masks);
+static Classifier classify = classifyFirst;
+
+/*
+    * Name of the fastest classifier the CPU supports.
+    * INPUT: void
+    * OUTPUT: the name
+*/
+static const char * bestEngine()
+{
+#ifdef SCAN_X86
+    return __builtin_cpu_supports("avx2") ? "avx2" : "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+/*
+    * Choose the classifier of command lines.
+    * INPUT: "avx2", "sse2", "scalar", or NULL for SCAN_ENGINE_ENV, else the fastest one the CPU supports
+    * OUTPUT: 1 on success, 0 if the engine is unknown or not supported here (the current one is kept)
+*/
+int scanSelect(const char * engine)
+{
+    Classifier chosen = 0;
+    if (!engine)
+        engine = getenv(SCAN_ENGINE_ENV);
+    if (!engine)
+        engine = bestEngine();
+#ifdef SCAN_X86
+    if (strcmp(engine, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+        chosen = classifyAvx2;
+    else if (strcmp(engine, "sse2") == 0)
+        chosen = classifySse2;
+#endif
+    if (strcmp(engine, "scalar") == 0)
+        chosen = classifyScalar;
+    if (!chosen)
+        return 0;
+
+    classify = chosen;
+    scanEngine = engine;
+    return 1;
+}
+
+/*
+    * Check if command lines are scanned byte by byte, choosing the engine on the first call.
+    * INPUT: void
+    * OUTPUT: 1 for the scalar engine, 0 for a vector classifier
+*/
+static int scanBytewise()
+{
+    if (!scanEngine && !scanSelect(0))
+        scanSelect(bestEngine());
+    return classify == classifyScalar;
+}
+
+/*
+    * Classifier in place until the first line is scanned: it picks the real one.
+    * INPUT: SCAN_BLOCK bytes, masks to fill
+    * OUTPUT: void
+*/
+static void classifyFirst(const char * p, ScanMasks * masks)
+{
+    if (!scanSelect(0))
+        scanSelect(bestEngine());
+    classify(p, masks);
+}
+
+/*
+    * Classify the block of a line starting at base. A short last block is padded with zero bytes, which are in no class.
+    * INPUT: line, its length, offset of the block, masks to fill
+    * OUTPUT: void
+*/
+void scanClassify(const char * line, size_t len, size_t base, ScanMasks * masks)
+{
+    if (base + SCAN_BLOCK <= len)
+    {
+        classify(line + base, masks);
+        return;
+    }
+
+    char tail[SCAN_BLOCK];
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, line + base, len - base);
+    classify(tail, masks);
+}
+
+/*
+    * Check if the bytes of a word are all digits: "2" in "2>" is the descriptor of the redirection.
+    * INPUT: the word, its length
+    * OUTPUT: 1 if they are, 0 otherwise
+*/
+static int allDigits(const char * word, size_t len)
+{
+    size_t i;
+    for (i = 0; i < len; i++)
+        if (word[i] < '0' || word[i] > '9')
+            return 0;
+    return len > 0;
+}
+
+/*
+ * State of scanTokens() between two bytes that can start or end a token.
+*/
+typedef struct TokenScan {
+    const char * line;
+    size_t len;
+    unsigned int * offsets;
+    int numTokens;
+    int inToken;
+    int quote; // the opening quote character
+    int depth; // parentheses of a substitution
+    size_t start; // first byte of the current token
+    size_t skip; // bytes before it are already consumed
+} TokenScan;
+
+/*
+    * Record a token.
+    * INPUT: the scan, start and end of the token
+    * OUTPUT: void
+*/
+static inline void addToken(TokenScan * t, size_t start, size_t end)
+{
+    t->offsets[2 * t->numTokens] = start;
+    t->offsets[2 * t->numTokens++ + 1] = end;
+}
+
+/*
+    * Handle one byte that can start or end a token: a space, a quote, an operator or the first byte of a word.
+    * INPUT: the scan, offset of the byte (not below skip)
+    * OUTPUT: void
+*/
+static inline void tokenEvent(TokenScan * t, size_t i)
+{
+    const char * line = t->line;
+    char c = line[i];
+
+    // between quotes only the closing quote matters, and a backslash between double quotes
+    if (t->quote)
+    {
+        if (c == t->quote)
+            t->quote = 0;
+        else if (c == '\\' && t->quote == '"')
+            t->skip = i + 2;
+        return;
+    }
+    if (t->depth > 0)
+    {
+        if (c == '(')
+            t->depth++;
+        else if (c == ')')
+            t->depth--;
+        else if (c == '\'' || c == '"')
+            t->quote = c;
+        else if (c == '\\')
+            t->skip = i + 2;
+        return;
+    }
+
+    if (c == ' ' || c == '\t')
+    {
+        if (t->inToken)
+            addToken(t, t->start, i);
+        t->inToken = 0;
+        return;
+    }
+
+    if (charClass[(unsigned char)c] == CLASS_OP)
+    {
+        size_t end = i + 1;
+        if ((c == '<' || c == '>') && !t->inToken && end < t->len && line[end] == '(')
+        {
+            t->inToken = 1;
+            t->start = i;
+            t->depth = 1;
+            t->skip = end + 1;
+            return;
+        }
+        if (!((c == '<' || c == '>') && t->inToken && allDigits(line + t->start, i - t->start)))
+        {
+            if (t->inToken)
+                addToken(t, t->start, i);
+            t->start = i;
+        }
+        if (end < t->len && ((c == '>' && (line[end] == '>' || line[end] == '&')) || (c == '<' && line[end] == '&')
+            || (c == '&' && line[end] == '&') || (c == '|' && line[end] == '|')))
+            end++;
+        addToken(t, t->start, end);
+        t->inToken = 0;
+        t->skip = end;
+        return;
+    }
+
+    // first byte of a word, a quote or a backslash
+    if (!t->inToken)
+    {
+        t->inToken = 1;
+        t->start = i;
+    }
+    if (c == '\'' || c == '"')
+        t->quote = c;
+    else if (c == '\\')
+        t->skip = i + 2;
+}
+
+/*
+    * Token walk of the scalar engine: every byte is looked at.
+    * INPUT: the scan
+    * OUTPUT: void
+*/
+static void tokensBytewise(TokenScan * t)
+{
+    const char * line = t->line;
+    unsigned int * offsets = t->offsets;
+    size_t base, len = t->len;
+
+    // a plain byte only matters when it starts a word (a skipped one is always inside a token), a space outside
+    // quotes when it ends one. The current token is kept in locals, the scan state only synced for other events.
+    int inToken = 0, numTokens = 0;
+    size_t start = 0;
+    for (base = 0; base < len; base++)
+    {
+        unsigned char cls = charClass[(unsigned char)line[base]];
+        if (!cls)
+        {
+            if (!inToken)
+            {
+                inToken = 1;
+                start = base;
+            }
+            continue;
+        }
+        if (base < t->skip)
+            continue;
+        if ((cls & CLASS_SPACE) && !t->quote && !t->depth)
+        {
+            if (inToken)
+            {
+                offsets[2 * numTokens] = start;
+                offsets[2 * numTokens++ + 1] = base;
+            }
+            inToken = 0;
+            continue;
+        }
+        t->inToken = inToken;
+        t->start = start;
+        t->numTokens = numTokens;
+        tokenEvent(t, base);
+        inToken = t->inToken;
+        start = t->start;
+        numTokens = t->numTokens;
+    }
+    t->inToken = inToken;
+    t->start = start;
+    t->numTokens = numTokens;
+}
+
+/*
+    * Token walk of the vector classifiers: only the bytes of the masks are visited.
+    * INPUT: the scan
+    * OUTPUT: void
+*/
+static void tokensBlocks(TokenScan * t)
+{
+    size_t base;
+    uint64_t carry = 1; // the byte before the line counts as a space
+    for (base = 0; base < t->len; base += SCAN_BLOCK)
+    {
+        ScanMasks m;
+        scanClassify(t->line, t->len, base, &m);
+        uint64_t valid = t->len - base >= SCAN_BLOCK ? ~(uint64_t)0 : ((uint64_t)1 << (t->len - base)) - 1;
+        uint64_t boundary = m.space | m.op;
+        uint64_t starts = ~boundary & ((boundary << 1) | carry);
+        uint64_t events = (m.space | m.quote | m.op | starts) & valid;
+        carry = boundary >> (SCAN_BLOCK - 1);
+
+        while (events)
+        {
+            size_t i = base + __builtin_ctzll(events);
+            events &= events - 1;
+            if (i >= t->skip)
+                tokenEvent(t, i);
+        }
+    }
+}
+
+/*
+    * Split a command line into its tokens in one pass. Only the bytes that can start or end a token are handled: spaces,
+    * quotes and operators, plus the first byte of each word (a byte after a space or an operator). A vector classifier
+    * finds them with shifts of the masks of each block; the scalar engine looks at every byte, as the loop before it did.
+    * Tokens are:
+    *   words, quotes and backslashes kept (a quoted space or operator does not split, the quotes are removed later);
+    *   operators "|", "||", "&", "&&", ";", "(", ")", even when not surrounded by spaces;
+    *   redirections "<", ">", ">>", "<&", ">&", with the descriptor number written just before ("2>", "2>&");
+    *   process substitutions "<(...)" and ">(...)" up to the matching parenthesis, spaces included.
+    * INPUT: line, its length, array receiving the start and end of every token (room for 2 * len values)
+    * OUTPUT: number of tokens, -1 on an unterminated quote or process substitution
+*/
+int scanTokens(const char * line, size_t len, unsigned int * offsets)
+{
+    TokenScan t;
+    memset(&t, 0, sizeof(t));
+    t.line = line;
+    t.len = len;
+    t.offsets = offsets;
+    if (scanBytewise())
+        tokensBytewise(&t);
+    else
+        tokensBlocks(&t);
+
+    if (t.quote || t.depth > 0)
+        return -1;
+    if (t.inToken)
+        addToken(&t, t.start, len);
+    return t.numTokens;
+}
+
+/*
+    * scanNormalize() of the scalar engine: one byte at a time, the plain ones copied with a single table lookup.
+    * INPUT: destination (may be the source itself), source line, its length
+    * OUTPUT: length of the normalized line, the destination is terminated
+*/
+static size_t normalizeBytewise(char * dst, const char * src, size_t len)
+{
+    size_t n = 0, kept = 0, i; // kept: length of dst after the last escaped byte
+    int quote = 0;
+    int space = 1; // the last byte written is an unescaped space, or nothing is written yet: spaces are dropped
+    for (i = 0; i < len; i++)
+    {
+        char c = src[i];
+        unsigned char cls = charClass[(unsigned char)c];
+        if (!cls)
+        {
+            dst[n++] = c;
+            space = 0;
+            continue;
+        }
+        if (quote)
+        {
+            dst[n++] = c;
+            if (c == quote)
+                quote = 0;
+            else if (c == '\\' && quote == '"')
+            {
+                if (i + 1 < len)
+                    dst[n++] = src[++i];
+                kept = n;
+            }
+            continue;
+        }
+        if (cls & CLASS_SPACE)
+        {
+            if (!space)
+                dst[n++] = ' ';
+            space = 1;
+            continue;
+        }
+        dst[n++] = c;
+        space = 0;
+        if (c == '\\')
+        {
+            // the escaped byte goes with its backslash
+            if (i + 1 < len)
+                dst[n++] = src[++i];
+            kept = n;
+        }
+        else if (c == '\'' || c == '"')
+            quote = c;
+    }
+    if (n > 0 && dst[n-1] == ' ' && n != kept)
+        n--;
+    dst[n] = 0;
+    return n;
+}
+
+/*
+    * scanNormalize() of the vector classifiers: the runs between events are copied whole.
+    * INPUT: destination (may be the source itself), source line, its length
+    * OUTPUT: length of the normalized line, the destination is terminated
+*/
+static size_t normalizeBlocks(char * dst, const char * src, size_t len)
+{
+    size_t n = 0, pos = 0, skip = 0, kept = 0, base; // kept: length of dst after the last escaped byte
+    int quote = 0;
+    uint64_t carry = 1; // the byte before the line counts as a space
+
+    for (base = 0; base < len; base += SCAN_BLOCK)
+    {
+        ScanMasks m;
+        scanClassify(src, len, base, &m);
+        uint64_t events = m.quote | m.tab | (m.space & ((m.space << 1) | carry));
+        carry = m.space >> (SCAN_BLOCK - 1);
+
+        while (events)
+        {
+            size_t i = base + __builtin_ctzll(events);
+            events &= events - 1;
+            if (i < skip)
+                continue;
+            char c = src[i];
+
+            if (quote && c != quote && !(c == '\\' && quote == '"'))
+                continue;
+
+            // the bytes since the last event are copied as they are
+            memmove(dst + n, src + pos, i - pos);
+            n += i - pos;
+            pos = i + 1;
+
+            if (c == ' ' || c == '\t')
+            {
+                if (n > 0 && (dst[n-1] != ' ' || n == kept))
+                    dst[n++] = ' ';
+                continue;
+            }
+
+            dst[n++] = c;
+            if (c == '\\')
+            {
+                // the escaped byte goes with its backslash
+                if (i + 1 < len)
+                    dst[n++] = src[i + 1];
+                pos = skip = i + 2;
+                kept = n;
+            }
+            else if (c == quote)
+                quote = 0;
+            else
+                quote = c;
+        }
+    }
+
+    if (len > pos)
+    {
+        memmove(dst + n, src + pos, len - pos);
+        n += len - pos;
+    }
+    if (n > 0 && dst[n-1] == ' ' && n != kept)
+        n--;
+    dst[n] = 0;
+    return n;
+}
+
+/*
+    * Copy a line while erasing the meaningless spaces: leading, trailing and consecutive ones, tabs counting as spaces.
+    * Quoted and escaped bytes are copied as they are. Only quotes, tabs and spaces following a space stop the copy: a line
+    * with single spaces between its words is copied whole. The scalar engine copies byte by byte instead.
+    * INPUT: destination (may be the source itself), source line, its length
+    * OUTPUT: length of the normalized line, the destination is terminated
+*/
+size_t scanNormalize(char * dst, const char * src, size_t len)
+{
+    return scanBytewise() ? normalizeBytewise(dst, src, len) : normalizeBlocks(dst, src, len);
+}
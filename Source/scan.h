@@ -0,0 +1,22 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#define SCAN_BLOCK 64 // bytes classified at a time, one bit each in the masks
+#define SCAN_ENGINE_ENV "PLTSH_SCAN" // forces the classifier: "avx2", "sse2" or "scalar"
+
+/*
+ * Classes of the bytes of one block of a command line: bit i is byte i of the block.
+*/
+typedef struct ScanMasks {
+    uint64_t space; // ' ' and '\t'
+    uint64_t tab; // '\t' alone
+    uint64_t quote; // '\'', '"' and '\\'
+    uint64_t op; // '|', '<', '>', '&', ';', '(' and ')'
+} ScanMasks;
+
+extern const char * scanEngine;
+
+int scanSelect(const char * engine);
+void scanClassify(const char * line, size_t len, size_t base, ScanMasks * masks);
+int scanTokens(const char * line, size_t len, unsigned int * offsets);
+size_t scanNormalize(char * dst, const char * src, size_t len);
@@ -0,0 +1,19 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#define SHA256_SIZE 32 // bytes of a digest, 64 hex characters
+
+/*
+ * Running SHA-256 computation (FIPS 180-4).
+*/
+typedef struct Sha256 {
+    uint32_t state[8];
+    uint64_t length; // bytes hashed so far
+    size_t used; // bytes waiting in block
+    unsigned char block[64];
+} Sha256;
+
+void sha256Init(Sha256 * s);
+void sha256Update(Sha256 * s, const void * data, size_t len);
+void sha256Final(Sha256 * s, unsigned char digest[SHA256_SIZE]);
+void sha256Hex(const unsigned char digest[SHA256_SIZE], char hex[2 * SHA256_SIZE + 1]);
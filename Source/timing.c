@@ -0,0 +1,96 @@
+#define _GNU_SOURCE
+#include "timing.h"
+#include "options.h"
+#include <stdio.h>
+
+int timingThisLine = 0;
+
+/*
+    * Check whether commands of the current line must report their resource usage.
+    * INPUT: void
+    * OUTPUT: 1 with "set timing=on" or a "time" prefix, 0 otherwise
+*/
+int timingEnabled()
+{
+    return optTiming || timingThisLine;
+}
+
+/*
+    * Stop reporting in a forked stage subshell: the shell that waits for it reports the stage as a whole.
+    * INPUT: void
+    * OUTPUT: void
+*/
+void timingDisable()
+{
+    optTiming = 0;
+    timingThisLine = 0;
+}
+
+/*
+    * Record the start of a measurement.
+    * INPUT: pointer to the measurement
+    * OUTPUT: void
+*/
+void timingStart(Timing * t)
+{
+    clock_gettime(CLOCK_MONOTONIC, &t->start);
+    getrusage(RUSAGE_THREAD, &t->self);
+}
+
+/*
+    * Seconds between two timevals.
+*/
+static double tvDiff(struct timeval * a, struct timeval * b)
+{
+    return (a->tv_sec - b->tv_sec) + (a->tv_usec - b->tv_usec) / 1e6;
+}
+
+/*
+    * Print one usage line on STDERR.
+    * INPUT: command name, stage number (0 for a simple command), start of the measurement, usage to print
+    * OUTPUT: void
+*/
+static void printUsage(char * name, int stage, Timing * t, struct rusage * ru, struct rusage * base)
+{
+    struct timespec now;
+    struct timeval zero = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double real = (now.tv_sec - t->start.tv_sec) + (now.tv_nsec - t->start.tv_nsec) / 1e9;
+
+    if (stage > 0)
+        fprintf(stderr, "[time] stage %d (%s):", stage, name);
+    else
+        fprintf(stderr, "[time] %s:", name);
+    fprintf(stderr, " real %.3fs user %.3fs sys %.3fs maxrss %ldKB ctxsw %ld/%ld faults %ld/%ld\n",
+        real,
+        tvDiff(&ru->ru_utime, base ? &base->ru_utime : &zero),
+        tvDiff(&ru->ru_stime, base ? &base->ru_stime : &zero),
+        ru->ru_maxrss,
+        ru->ru_nvcsw - (base ? base->ru_nvcsw : 0),
+        ru->ru_nivcsw - (base ? base->ru_nivcsw : 0),
+        ru->ru_majflt - (base ? base->ru_majflt : 0),
+        ru->ru_minflt - (base ? base->ru_minflt : 0));
+}
+
+/*
+    * Report a child reaped with wait4(): wall time since the start, CPU, max RSS, voluntary/involuntary
+    * context switches and major/minor page faults.
+    * INPUT: command name, stage number (0 for a simple command), start of the measurement, usage from wait4()
+    * OUTPUT: void
+*/
+void timingReportChild(char * name, int stage, Timing * t, struct rusage * ru)
+{
+    printUsage(name, stage, t, ru, 0);
+}
+
+/*
+    * Report work done inside the shell (built-ins, in-shell data moves) as the growth of the usage of the calling thread.
+    * INPUT: command name, stage number (0 for a simple command), start of the measurement
+    * OUTPUT: void
+*/
+void timingReportSelf(char * name, int stage, Timing * t)
+{
+    struct rusage now;
+    getrusage(RUSAGE_THREAD, &now);
+    printUsage(name, stage, t, &now, &t->self);
+}
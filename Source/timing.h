@@ -0,0 +1,19 @@
+#pragma once
+#include <time.h>
+#include <sys/resource.h>
+
+/*
+ * Start point of a measurement: wall clock and the usage of the calling shell thread (for work done in-process).
+*/
+typedef struct Timing {
+    struct timespec start;
+    struct rusage self;
+} Timing;
+
+extern int timingThisLine; // set while a line prefixed with "time" runs
+
+int timingEnabled();
+void timingDisable();
+void timingStart(Timing * t);
+void timingReportChild(char * name, int stage, Timing * t, struct rusage * ru);
+void timingReportSelf(char * name, int stage, Timing * t);
@@ -1,7 +1,10 @@
 #include "utils.h"
+#include "scan.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
 
 /*
     * Check if a pointer is NULL or not, throw error when NULL
@@ -20,151 +23,164 @@ int checkMemoryValid(void * p)
 
 
 /*
-    * Read a command from the screen and erase the meaningless spaces.
+    * Input buffer of readLine: bytes [start, end) have been read from STDIN but not returned yet.
+*/
+static char * inputBuf = 0;
+static size_t inputCap = 0, inputStart = 0, inputEnd = 0;
+static int inputEof = 0;
+
+/*
+    * Copy a line while erasing the meaningless spaces: leading, trailing and consecutive ones. Tabs count as spaces,
+    * quoted and escaped spaces are kept.
+    * INPUT: destination (may be the source itself), source line, length of the source
+    * OUTPUT: length of the normalized line, the destination is terminated
+*/
+size_t normalizeLine(char * dst, const char * src, size_t len)
+{
+    return scanNormalize(dst, src, len);
+}
+
+/*
+    * Read a command from STDIN and erase the meaningless spaces. Input is read with read() in large chunks into
+    * a buffer reused across calls, which grows geometrically so lines have no length limit. A trailing CR (CRLF input) is dropped.
     * INPUT: void
-    * OUTPUT: pointer to the read command.
+    * OUTPUT: pointer to the read command, NULL at end of input.
 */
 char * readLine()
 {
-    int arrSize = BUFFER_SIZE; // size of string array
-    int n = 0; // length of string
-    char c; // temporary character
-
-    // allocate memory for the string 
-    char * str = malloc(sizeof(char)*arrSize);
-    
-    // check if succefully allocate
-    if (!checkMemoryValid(str))
-        exit(EXIT_FAILURE);   
-
-    // loop to read character by character
+    char * nl;
     while (1)
     {
-        // read a character
-        c = getchar();
+        // a complete line is already buffered
+        nl = memchr(inputBuf + inputStart, '\n', inputEnd - inputStart);
+        if (nl || inputEof)
+            break;
 
-        // end of string character
-        if (c==EOF || c == '\n') 
+        // move the pending bytes to the front, grow the buffer when it is full
+        if (inputStart > 0)
         {
-            if (n != 0 && str[n-1]==' ') 
-                n--;
-            str[n] = 0;
-            break;
+            memmove(inputBuf, inputBuf + inputStart, inputEnd - inputStart);
+            inputEnd -= inputStart;
+            inputStart = 0;
         }
-        else
+        if (inputEnd == inputCap)
         {
-            if (c ==' ' && n == 0) continue; // ignore leading space
-            if (c ==' ' && str[n-1] ==' ') continue; // ignore consecutive space 
-            str[n++] = c;
-        }
-
-        if (n>=arrSize) // check whether we need to expand ther arrSize
-        {   
-            // Increase the array size
-            arrSize += BUFFER_SIZE;
-            
-            // Check if the command is too long??
-            if (arrSize>MAX_LENGTH)
-            {
-                fprintf(stderr,"PLTsh> Command is too long\n");
-                free(str);
-                exit(EXIT_FAILURE);
-            }
-
-            // expand the string and check 
-            str = realloc(str,sizeof(char) * arrSize);
-            if (!checkMemoryValid(str))
+            inputCap = inputCap ? inputCap * 2 : READ_CHUNK;
+            inputBuf = realloc(inputBuf, inputCap);
+            if (!checkMemoryValid(inputBuf))
                 exit(EXIT_FAILURE);
         }
+
+        ssize_t n = read(STDIN_FILENO, inputBuf + inputEnd, inputCap - inputEnd);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            inputEof = 1;
+        else
+            inputEnd += n;
     }
+
+    // nothing left at end of input
+    if (!nl && inputStart == inputEnd)
+        return 0;
+
+    char * line = inputBuf + inputStart;
+    size_t len = nl ? (size_t)(nl - line) : inputEnd - inputStart;
+    inputStart += nl ? len + 1 : len;
+    if (len > 0 && line[len-1] == '\r')
+        len--;
+
+    char * str = malloc(len + 1);
+    if (!checkMemoryValid(str))
+        exit(EXIT_FAILURE);
+    normalizeLine(str, line, len);
     return str;
 }
 
 
+/*
+    * Start and end offsets of the tokens of the line being parsed, kept between calls.
+*/
+static unsigned int * tokenOffsets = 0;
+static size_t tokenCap = 0;
+
    /*
     *   Parse string of command to array of arguments and identify the mode of the command: 0 if the command does not include '&' and 1 otherwise.
-    *   INPUT: pointer to string, pointer to an interger to receive the mode of the command
-    *   OUTPUT: array of arguments
+    *   The line is split by scanTokens(): operators need no spaces around them and quoted words keep their quotes.
+    *   The array and the arguments, one after the other in a single buffer, are allocated from the arena of the command line.
+    *   INPUT: pointer to the arena, pointer to string, pointer to an interger to receive the mode of the command
+    *   OUTPUT: array of arguments (with room for one more), NULL on an unterminated quote
     */
-char ** parseArgs(char * str, int * mode)
+char ** parseArgs(Arena * arena, char * str, int * mode)
 {
-    int idx = 0,prev_idx = 0; // iterator
-    int numArgs = 0; // number of arguments
-    char **args = 0; // result
+    size_t len = strlen(str);
+    int idx, numArgs;
+    *mode = 0;
 
-    // Iterate throught the string
-    while (str[idx])
+    if (2 * len + 2 > tokenCap)
     {
-        if (str[idx] == ' ') // if see a space 
-        {
-            // Increase number of arguments
-            numArgs++; 
-            args = realloc(args, numArgs * sizeof(char *));
-
-            // check memory
-            if (!checkMemoryValid(args))
-                exit(EXIT_FAILURE);
-
-            // Copy substring in *str to the new argument
-            args[numArgs - 1] = malloc(idx - prev_idx+1);
-            if (!checkMemoryValid(args[numArgs - 1]))
-                exit(EXIT_FAILURE);
-            memcpy(args[numArgs-1], (str+prev_idx), idx - prev_idx);
-
-            // end of string
-            args[numArgs-1][idx-prev_idx] = 0;
-
-            // update prev_idx
-            prev_idx = idx+1;
-
-        }
-        idx++;
+        tokenCap = 2 * len + 2;
+        free(tokenOffsets);
+        tokenOffsets = malloc(tokenCap * sizeof(unsigned int));
+        if (!checkMemoryValid(tokenOffsets))
+            exit(EXIT_FAILURE);
     }
+    numArgs = scanTokens(str, len, tokenOffsets);
+    if (numArgs < 0)
+        return 0;
 
-    // Update the last argument
-    numArgs++;
-    args = realloc(args, (numArgs) * sizeof(char *));
-    if (!checkMemoryValid(args))
-        exit(EXIT_FAILURE);
-    args[numArgs - 1] = malloc(idx - prev_idx+1);
-    memcpy(args[numArgs-1], (str+prev_idx), idx - prev_idx);
-    args[numArgs-1][idx-prev_idx] = 0;
-
-    // if the last argument is "&"
-    if (strcmp(args[numArgs-1],"&")==0)
+    char ** args = arenaAlloc(arena, (numArgs + 2) * sizeof(char *));
+    char * buffer = arenaAlloc(arena, len + numArgs + 1);
+    for (idx = 0; idx < numArgs; idx++)
     {
-        // assign the last element of the array to 0
-        *mode = 1;
-        free(args[numArgs-1]);
-        args[numArgs-1] = 0;
-    }
-    else 
-    {
-        // allocate one more element of the array and assign it to 0
-        *mode = 0;
-        numArgs++;
-        args = realloc(args, (numArgs) * sizeof(char *));
-        if (!checkMemoryValid(args))
-            exit(EXIT_FAILURE);
-        args[numArgs-1] = 0;
+        size_t n = tokenOffsets[2 * idx + 1] - tokenOffsets[2 * idx];
+        memcpy(buffer, str + tokenOffsets[2 * idx], n);
+        buffer[n] = 0;
+        args[idx] = buffer;
+        buffer += n + 1;
     }
 
+    // if the last argument is "&", drop it from the array
+    *mode = numArgs > 0 && strcmp(args[numArgs-1],"&") == 0;
+    if (*mode)
+        numArgs--;
+    args[numArgs] = 0;
+
     return args;
 }
 
-
-/* Free memory of every element in the array of arguments
-   INPUT: array of command's arguments
-   OUTPUT: None
+/*
+    * Remove the quotes of a word: '...' is taken as is, "..." as is but for \" \\ \$ and \` , and a backslash outside
+    * quotes keeps the next byte. Called once, when the words of a command are final.
+    * INPUT: arena of the command line, the word
+    * OUTPUT: the word itself if it has no quote, a new string otherwise
 */
-void freeArgs(char ** args){
-    char ** temp = args;
-    while (*args)
+char * unquoteWord(Arena * arena, char * word)
+{
+    if (!strpbrk(word, "'\"\\"))
+        return word;
+
+    char * out = arenaAlloc(arena, strlen(word) + 1);
+    char * p = out;
+    char quote = 0;
+    for (; *word; word++)
     {
-        free(*args);
-        args++;
+        if (quote == '\'')
+        {
+            if (*word == '\'')
+                quote = 0;
+            else
+                *p++ = *word;
+        }
+        else if (*word == '\\' && word[1] && (!quote || strchr("\"\\$`", word[1])))
+            *p++ = *++word;
+        else if (*word == '"' || (*word == '\'' && !quote))
+            quote = quote ? 0 : *word;
+        else
+            *p++ = *word;
     }
-    free(temp);
+    *p = 0;
+    return out;
 }
 
 
@@ -210,62 +226,97 @@ int positionPipe(char** args)
 
 /*
     *  Get arguments before | character from args
-    *  Input: array of command's arguments and position of argument which contains | character
-    *  Output: array of arguments which are before |
+    *  Input: pointer to the arena, array of command's arguments and position of argument which contains | character
+    *  Output: array of arguments which are before |, sharing the strings of args
 */
-char** parseFirstArgsPipe(char ** args, int position)
+char** parseFirstArgsPipe(Arena * arena, char ** args, int position)
 {
-    int i = 0;
-    char** argsFirst = 0;
+    char** argsFirst = arenaAlloc(arena, (position + 1) * sizeof(char*));
 
-    // loop to copy data from args which before | to argsFrist corresponding
-    while (i != position)
-    {
-        // allocation for argsFirst
-        argsFirst = (char**)realloc(argsFirst, (i + 1) * sizeof(char*));
-        if (!checkMemoryValid(argsFirst))
-            exit(EXIT_FAILURE);
-
-        // allocation for elements of argsFirst
-        argsFirst[i] = (char*)malloc(sizeof(char) * (strlen(args[i])+1));
-        argsFirst[i] = strdup(args[i]);
-        i++;
-    }
-    
-    // allocation for NULL character
-    argsFirst = (char**)realloc(argsFirst, (i + 1) * sizeof(char*));
-    argsFirst[i] = 0;
+    // copy the arguments before | to argsFirst
+    memcpy(argsFirst, args, position * sizeof(char*));
+    argsFirst[position] = 0;
 
     return argsFirst;
 }
 
 /*
     *  Get arguments after | character from args
-    *  Input: array of command's arguments and position of argument which contains | character
-    *  Output: array of arguments which are after |
+    *  Input: pointer to the arena, array of command's arguments and position of argument which contains | character
+    *  Output: array of arguments which are after |, sharing the strings of args
 */
-char** parseSecondArgsPipe(char ** args, int position)
+char** parseSecondArgsPipe(Arena * arena, char ** args, int position)
 {
-    int i = 0;
-    char** argsSecond = 0;
-    
-    // loop to copy data from args which after | to argsSecond corresponding
-    while (args[position + i + 1] != 0)
+    int numArgs = getNumArgs(args + position + 1);
+    char** argsSecond = arenaAlloc(arena, (numArgs + 1) * sizeof(char*));
+
+    // copy the arguments after | to argsSecond
+    memcpy(argsSecond, args + position + 1, (numArgs + 1) * sizeof(char*));
+
+    return argsSecond;
+}
+
+/*
+    *  Split arguments on every | character into the stages of a pipeline
+    *  Input: pointer to the arena, array of command's arguments and pointer to an integer to receive the number of stages
+    *  Output: array of stages (each one an array of arguments), NULL if a stage is empty (syntax error)
+*/
+char*** splitPipeline(Arena * arena, char ** args, int * numStages)
+{
+    int start = 0, i = 0;
+    int n = 1;
+    char*** stages = 0;
+
+    // Count the stages first so the array is allocated once
+    for (i = 0; args[i]; i++)
+        if (strcmp(args[i], "|") == 0)
+            n++;
+    stages = arenaAlloc(arena, n * sizeof(char**));
+
+    n = 0;
+    for (i = 0; ; i++)
     {
-        // allocation for argsSecond
-        argsSecond = (char**) realloc(argsSecond, (i + 1) * sizeof(char*));
-        if (!checkMemoryValid(argsSecond))
-            exit(EXIT_FAILURE);
+        // end of a stage: a | character or the end of the arguments
+        if (args[i] == 0 || strcmp(args[i], "|") == 0)
+        {
+            // empty stage => syntax error
+            if (i == start)
+                return 0;
 
-        // allocation for elements of argsSecond
-        argsSecond[i] = (char*)malloc(sizeof(char) * (strlen(args[position + i + 1])+1));
-        argsSecond[i] = strdup(args[position + i + 1]);
-        i++;
+            stages[n++] = parseFirstArgsPipe(arena, args + start, i - start);
+
+            if (args[i] == 0)
+                break;
+            start = i + 1;
+        }
     }
-    
-    // allocation for NULL character
-    argsSecond = (char**) realloc(argsSecond, (i + 1) * sizeof(char*));
-    argsSecond[i] = 0;
 
-    return argsSecond;
-}
\ No newline at end of file
+    *numStages = n;
+    return stages;
+}
+
+/*
+    *  Join arguments with single spaces, e.g. to show a command line again
+    *  Input: pointer to the arena, array of command's arguments
+    *  Output: the joined string
+*/
+char* joinArgs(Arena * arena, char ** args)
+{
+    size_t len = 1;
+    int i;
+    for (i = 0; args[i]; i++)
+        len += strlen(args[i]) + 1;
+
+    char* str = arenaAlloc(arena, len);
+    char* p = str;
+    for (i = 0; args[i]; i++)
+    {
+        if (i > 0)
+            *p++ = ' ';
+        size_t n = strlen(args[i]);
+        memcpy(p, args[i], n);
+        p += n;
+    }
+    *p = 0;
+    return str;
+}
@@ -1,14 +1,19 @@
 #pragma once
-#define BUFFER_SIZE 16 // Buffer size to read command from the screen.
-#define MAX_LENGTH 512 // Maximum length of the command.
+#include "arena.h"
+#include <stddef.h>
+#define READ_CHUNK 65536 // Initial size of the input buffer, bytes requested from read() at a time.
+#define MAX_LENGTH 512 // Maximum length of a sysfs path built by the shell.
 
 char * readLine();
-char ** parseArgs(char * str, int* mode);
-void freeArgs(char ** args);
+size_t normalizeLine(char * dst, const char * src, size_t len);
+char ** parseArgs(Arena * arena, char * str, int* mode);
+char * unquoteWord(Arena * arena, char * word);
 int checkMemoryValid (void * p);
 int getNumArgs(char ** args);
 int isInternal(char **args);
 int positionPipe(char** args);
-char** parseFirstArgsPipe(char ** args, int position);
-char** parseSecondArgsPipe(char ** args, int position);
+char** parseFirstArgsPipe(Arena * arena, char ** args, int position);
+char** parseSecondArgsPipe(Arena * arena, char ** args, int position);
+char*** splitPipeline(Arena * arena, char ** args, int * numStages);
 
+char* joinArgs(Arena * arena, char ** args);
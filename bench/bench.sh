@@ -0,0 +1,226 @@
+#!/bin/sh
+# End-to-end benchmarks of a PLTsh binary. Every result is one JSON object per line on stdout:
+#   {"bench":"...","value":X,"unit":"..."}
+# Usage: bench/bench.sh path/to/PLTsh [scale]
+# Exits with 1 when a check fails (jobs left as zombies), after its JSON line.
+# The scale (default 1) multiplies every workload size.
+
+SH=${1:?usage: bench.sh path/to/PLTsh [scale]}
+SCALE=${2:-1}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+now() { date +%s.%N; }
+
+# report NAME VALUE UNIT
+report() { printf '{"bench":"%s","value":%s,"unit":"%s"}\n' "$1" "$2" "$3"; }
+
+# rate COUNT START END: operations per second
+rate() { echo "$1 $2 $3" | awk '{ printf "%.1f", $1 / ($3 - $2) }'; }
+
+# latency COUNT START END: microseconds per operation
+latency() { echo "$1 $2 $3" | awk '{ printf "%.2f", ($3 - $2) * 1000000 / $1 }'; }
+
+# repeat COUNT LINE: a script with COUNT copies of LINE
+repeat() { awk -v n="$1" -v l="$2" 'BEGIN { for (i = 0; i < n; i++) print l }'; }
+
+# commands/sec through executeExternalCommand, for each spawn engine
+N=$((2000 * SCALE))
+repeat $N /bin/true > "$TMP/true.sh"
+for engine in posix fork; do
+    start=$(now)
+    PLTSH_SPAWN=$engine "$SH" "$TMP/true.sh"
+    report "external_commands_$engine" "$(rate $N "$start" "$(now)")" "commands/s"
+done
+
+# launch latency against the shell's RSS, for each engine: a first line with many arguments grows the
+# shell (line arena, script mapping), the in-shell cat reads its /proc/self/status, then N launches follow.
+# The same script without the launches is timed and subtracted.
+N=$((1000 * SCALE))
+for mb in 0 64 256; do
+    args=$((mb * 1024 * 1024 / 8))
+    awk -v n=$args 'BEGIN { printf ":"; for (i = 0; i < n; i++) printf " xxxxxx"; print "" }' > "$TMP/grow.sh"
+    echo "cat /proc/self/status > $TMP/status" >> "$TMP/grow.sh"
+    { cat "$TMP/grow.sh"; repeat $N /bin/true; } > "$TMP/launch.sh"
+    for engine in posix fork server; do
+        start=$(now)
+        PLTSH_SPAWN=$engine "$SH" "$TMP/grow.sh"
+        base=$(echo "$start $(now)" | awk '{ print $2 - $1 }')
+        start=$(now)
+        PLTSH_SPAWN=$engine "$SH" "$TMP/launch.sh"
+        rss=$(awk '/^VmRSS/ { print $2 }' "$TMP/status")
+        us=$(echo "$start $(now) $base $N" | awk '{ printf "%.2f", ($2 - $1 - $3) * 1000000 / $4 }')
+        printf '{"bench":"launch_latency_%s","value":%s,"unit":"us/command","shell_rss_kb":%s}\n' "$engine" "$us" "$rss"
+    done
+done
+
+# latency of a redirected external command: the files are opened by spawn file actions in the child
+N=$((2000 * SCALE))
+repeat $N "/bin/true < /dev/null > $TMP/out 2>&1" > "$TMP/redirect.sh"
+start=$(now)
+"$SH" "$TMP/redirect.sh"
+report "redirected_external_latency" "$(latency $N "$start" "$(now)")" "us/command"
+
+# lines/sec of the batch mode on a built-in that does nothing
+N=$((200000 * SCALE))
+repeat $N "cd ." > "$TMP/builtin.sh"
+start=$(now)
+"$SH" "$TMP/builtin.sh"
+report "batch_builtin_lines" "$(rate $N "$start" "$(now)")" "lines/s"
+
+# per-command latency of the hot utilities as builtins, then as external binaries (enable -n)
+N=$((20000 * SCALE))
+for cmd in "true" "echo hello world" "pwd" "test -f $TMP/true.sh" "printf %s-%d a 1"; do
+    name=${cmd%% *}
+    repeat $N "$cmd > /dev/null" > "$TMP/hot.sh"
+    start=$(now)
+    "$SH" "$TMP/hot.sh"
+    report "builtin_${name}_latency" "$(latency $N "$start" "$(now)")" "us/command"
+    { echo "enable -n $name"; repeat $((N / 10)) "$cmd > /dev/null"; } > "$TMP/hot.sh"
+    start=$(now)
+    "$SH" "$TMP/hot.sh"
+    report "external_${name}_latency" "$(latency $((N / 10)) "$start" "$(now)")" "us/command"
+done
+
+# lines/sec through readLine on STDIN (comment lines are read and skipped)
+N=$((1000000 * SCALE))
+repeat $N "# a comment line fed through stdin" > "$TMP/comments.sh"
+start=$(now)
+"$SH" < "$TMP/comments.sh"
+report "stdin_readline_lines" "$(rate $N "$start" "$(now)")" "lines/s"
+
+# MB/s through processPipe with 2, 4 and 8 stages
+MB=$((1024 * SCALE))
+for stages in 2 4 8; do
+    line="head -c ${MB}M /dev/zero"
+    i=2
+    while [ $i -lt $stages ]; do
+        line="$line | /bin/cat"
+        i=$((i + 1))
+    done
+    line="$line | wc -c"
+    start=$(now)
+    "$SH" -c "$line" > /dev/null
+    report "pipeline_${stages}_stages" "$(rate $MB "$start" "$(now)")" "MB/s"
+done
+
+# MB/s of a 4-stage pipeline under each affinity policy: left to the kernel, stages on sibling CPUs, stages on
+# distinct cores across the nodes
+MB=$((1024 * SCALE))
+for policy in none compact spread; do
+    printf 'set affinity=%s\nhead -c %dM /dev/zero | /bin/cat | /bin/cat | wc -c\n' $policy $MB > "$TMP/affinity.sh"
+    start=$(now)
+    "$SH" "$TMP/affinity.sh" > /dev/null
+    report "pipeline_4_stages_affinity_$policy" "$(rate $MB "$start" "$(now)")" "MB/s"
+done
+
+# short pipelines/sec: a builtin stage on a thread feeding a spawned command, then both external
+N=$((5000 * SCALE))
+for line in "echo hello | /usr/bin/wc -c" "/bin/echo hello | /usr/bin/wc -c"; do
+    repeat $N "$line > /dev/null" > "$TMP/short.sh"
+    start=$(now)
+    "$SH" "$TMP/short.sh"
+    report "short_pipeline_$(case $line in /*) echo external;; *) echo builtin;; esac)" "$(rate $N "$start" "$(now)")" "pipelines/s"
+done
+
+# MB/s of a cat stage served in the shell against /bin/cat
+MB=$((512 * SCALE))
+head -c ${MB}M /dev/zero > "$TMP/big"
+for cat in cat /bin/cat; do
+    start=$(now)
+    "$SH" -c "$cat $TMP/big | wc -c" > /dev/null
+    report "cat_file_pipe_$(basename $cat)_$([ $cat = cat ] && echo shell || echo external)" "$(rate $MB "$start" "$(now)")" "MB/s"
+done
+
+# MB/s written to two files: the shell fanning out with tee()/splice() ("> a > b"), then coreutils tee
+MB=$((2048 * SCALE))
+rm -f "$TMP/big"
+for line in "head -c ${MB}M /dev/zero > $TMP/a > $TMP/b" "head -c ${MB}M /dev/zero | tee $TMP/a > $TMP/b"; do
+    start=$(now)
+    "$SH" -c "$line"
+    report "fan_out_2_files_$(case $line in *tee*) echo tee;; *) echo shell;; esac)" "$(rate $MB "$start" "$(now)")" "MB/s"
+    rm -f "$TMP/a" "$TMP/b"
+done
+
+# comparison of two sorted files: through temp files, then with process substitution
+seq $((2000000 * SCALE)) | awk '{ print ($1 * 7919) % 1000003 }' > "$TMP/left"
+seq $((2000000 * SCALE)) | awk '{ print ($1 * 104729) % 1000003 }' > "$TMP/right"
+printf '%s\n' "sort $TMP/left > $TMP/left.sorted" "sort $TMP/right > $TMP/right.sorted" "cmp $TMP/left.sorted $TMP/right.sorted > /dev/null" > "$TMP/temp.sh"
+start=$(now)
+"$SH" "$TMP/temp.sh"
+report "compare_sorted_temp_files" "$(latency 1 "$start" "$(now)")" "us/comparison"
+start=$(now)
+"$SH" -c "cmp <(sort $TMP/left) <(sort $TMP/right) > /dev/null"
+report "compare_sorted_substitution" "$(latency 1 "$start" "$(now)")" "us/comparison"
+
+# cache builtin: a sort over an unchanged file, run plainly, then through the cache (one miss, then hits)
+N=$((20 * SCALE))
+seq $((1000000 * SCALE)) | awk '{ print ($1 * 7919) % 1000003 }' > "$TMP/numbers"
+export PLTSH_CACHE_DIR="$TMP/cache"
+repeat $N "sort -n $TMP/numbers > /dev/null" > "$TMP/sort.sh"
+start=$(now)
+"$SH" "$TMP/sort.sh" < /dev/null
+report "sort_uncached" "$(latency $N "$start" "$(now)")" "us/command"
+echo "cache sort -n $TMP/numbers > /dev/null" > "$TMP/miss.sh"
+start=$(now)
+"$SH" "$TMP/miss.sh" < /dev/null
+report "sort_cache_miss" "$(latency 1 "$start" "$(now)")" "us/command"
+repeat $N "cache sort -n $TMP/numbers > /dev/null" > "$TMP/hit.sh"
+start=$(now)
+"$SH" "$TMP/hit.sh" < /dev/null
+report "sort_cache_hit" "$(latency $N "$start" "$(now)")" "us/command"
+unset PLTSH_CACHE_DIR
+
+# glob expansion in a directory of many entries: the first expansion reads it with getdents64(), the
+# next ones match against the cached listing; then a "**" walk of a tree of 100 directories
+N=$((20 * SCALE))
+mkdir "$TMP/glob"
+awk -v n=$((100000 * SCALE)) -v d="$TMP/glob" 'BEGIN { for (i = 0; i < n; i++) printf "%s/f%07d.dat\n", d, i }' | xargs touch
+touch -d 2000-01-01 "$TMP/glob"
+echo ": $TMP/glob/*99*" > "$TMP/glob1.sh"
+start=$(now)
+"$SH" "$TMP/glob1.sh"
+report "glob_100k_entries_first" "$(latency 1 "$start" "$(now)")" "us/expansion"
+repeat $N ": $TMP/glob/*99*" > "$TMP/globN.sh"
+start=$(now)
+"$SH" "$TMP/globN.sh"
+report "glob_100k_entries_cached" "$(latency $N "$start" "$(now)")" "us/expansion"
+awk -v d="$TMP/tree" 'BEGIN { for (i = 0; i < 10; i++) for (j = 0; j < 10; j++) print d "/" i "/" j }' | xargs mkdir -p
+awk -v d="$TMP/tree" -v n=$((50 * SCALE)) 'BEGIN { for (i = 0; i < 10; i++) for (j = 0; j < 10; j++) for (k = 0; k < n; k++) print d "/" i "/" j "/f" k ".c" }' | xargs touch
+echo ": $TMP/tree/**/*.c" > "$TMP/globstar.sh"
+start=$(now)
+"$SH" "$TMP/globstar.sh"
+report "globstar_100_dirs" "$(latency 1 "$start" "$(now)")" "us/expansion"
+
+# a command over the 100k entries is larger than ARG_MAX: the shell splits it into batches, run one after the
+# other, then all at once
+echo "ls -d $TMP/glob/* > /dev/null" > "$TMP/batch1.sh"
+start=$(now)
+"$SH" "$TMP/batch1.sh"
+report "batched_argv_100k_sequential" "$(latency 1 "$start" "$(now)")" "us/command"
+printf 'set batchjobs=auto\nls -d %s/glob/* > /dev/null\n' "$TMP" > "$TMP/batchN.sh"
+start=$(now)
+"$SH" "$TMP/batchN.sh"
+report "batched_argv_100k_parallel" "$(latency 1 "$start" "$(now)")" "us/command"
+
+# background job launch rate, then the zombies left once the jobs are done: the shell is sampled
+# from outside while it runs the last line of the script
+N=$((10000 * SCALE))
+repeat $N "true &" > "$TMP/jobs.sh"
+echo "touch $TMP/launched" >> "$TMP/jobs.sh"
+echo "sleep 1" >> "$TMP/jobs.sh"
+echo "sleep 2" >> "$TMP/jobs.sh"
+start=$(now)
+"$SH" "$TMP/jobs.sh" &
+pid=$!
+while [ ! -e "$TMP/launched" ]; do sleep 0.05; done
+report "background_jobs" "$(rate $N "$start" "$(now)")" "jobs/s"
+sleep 1.5
+zombies=$(ps -e -o ppid=,stat= | awk -v p=$pid '$1 == p && $2 ~ /^Z/' | wc -l)
+wait $pid
+report "background_jobs_zombies" "$zombies" "processes"
+# jobs the shell did not reap are a leak, not a slow result: the run fails
+if [ "$zombies" -ne 0 ]; then
+    echo "[Error] background_jobs_zombies: $zombies jobs left unreaped" >&2
+    exit 1
+fi
@@ -0,0 +1,542 @@
+/*
+ * Microbenchmarks of the parsing path: readLine, parseArgs, positionPipe, the pipe splitters and the command line parser.
+ * The tokenizer runs with every classifier of scan.c next to the byte-at-a-time code it replaced (suffix _bytewise).
+ * parseArgs and the pipe splitters also run as they were before the per-line arena (suffix _heap): a realloc() of the
+ * array and a malloc() per token, freed after every line, so allocs_per_op compares the two side by side.
+ * readParse reads a file of command lines and tokenizes each of them: with readLine() and parseArgs() under every engine
+ * of scan.c, and with the original getchar() readLine() and malloc() parseArgs() (suffix _original).
+ * Every result is printed as one JSON object per line:
+ *   {"bench":"parseArgs","ops":N,"ns_per_op":X,"allocs_per_op":Y}
+ * Allocations are counted by wrapping malloc/realloc/calloc at link time (-Wl,--wrap=...).
+*/
+#include "utils.h"
+#include "arena.h"
+#include "parser.h"
+#include "scan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static volatile unsigned long allocCount = 0; // volatile: the compiler assumes malloc() leaves the globals of this file unchanged
+
+void * __real_malloc(size_t size);
+void * __real_realloc(void * p, size_t size);
+void * __real_calloc(size_t n, size_t size);
+
+void * __wrap_malloc(size_t size)
+{
+    allocCount++;
+    return __real_malloc(size);
+}
+
+void * __wrap_realloc(void * p, size_t size)
+{
+    allocCount++;
+    return __real_realloc(p, size);
+}
+
+void * __wrap_calloc(size_t n, size_t size)
+{
+    allocCount++;
+    return __real_calloc(n, size);
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char * name, long ops, double seconds, unsigned long allocs)
+{
+    printf("{\"bench\":\"%s\",\"ops\":%ld,\"ns_per_op\":%.1f,\"allocs_per_op\":%.2f}\n",
+        name, ops, seconds * 1e9 / ops, (double)allocs / ops);
+}
+
+/*
+ * Build a command line of numArgs words, with a | every pipeEvery words.
+*/
+static char * makeLine(int numArgs, int pipeEvery)
+{
+    char * line = malloc(numArgs * 16 + 1);
+    char * p = line;
+    int i;
+    for (i = 0; i < numArgs; i++)
+    {
+        if (i > 0)
+            *p++ = ' ';
+        if (pipeEvery && i % pipeEvery == pipeEvery - 1)
+            p += sprintf(p, "|");
+        else
+            p += sprintf(p, "arg%d", i);
+    }
+    *p = 0;
+    return line;
+}
+
+/*
+ * parseArgs(), parseFirstArgsPipe(), parseSecondArgsPipe() and splitPipeline() as they were before arena.c: the array grows
+ * by one realloc() per token and every token is copied with malloc() (the splitters also leaked a malloc() overwritten
+ * by strdup(), counted here but freed so the benchmark does not grow).
+*/
+static char ** heapParseArgs(char * str, int * mode)
+{
+    int idx = 0, prev = 0, numArgs = 0;
+    char ** args = 0;
+    while (1)
+    {
+        if (str[idx] == ' ' || str[idx] == 0)
+        {
+            args = realloc(args, ++numArgs * sizeof(char *));
+            args[numArgs - 1] = malloc(idx - prev + 1);
+            memcpy(args[numArgs - 1], str + prev, idx - prev);
+            args[numArgs - 1][idx - prev] = 0;
+            prev = idx + 1;
+            if (str[idx] == 0)
+                break;
+        }
+        idx++;
+    }
+    *mode = strcmp(args[numArgs - 1], "&") == 0;
+    if (*mode)
+    {
+        free(args[numArgs - 1]);
+        args[numArgs - 1] = 0;
+        return args;
+    }
+    args = realloc(args, ++numArgs * sizeof(char *));
+    args[numArgs - 1] = 0;
+    return args;
+}
+
+static void heapFreeArgs(char ** args)
+{
+    char ** p;
+    for (p = args; *p; p++)
+        free(*p);
+    free(args);
+}
+
+static char ** heapCopyArgs(char ** args, int count)
+{
+    char ** copy = 0;
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        copy = realloc(copy, (i + 1) * sizeof(char *));
+        size_t len = strlen(args[i]) + 1;
+        free(malloc(len)); // the leaked block
+        copy[i] = memcpy(malloc(len), args[i], len); // strdup(), whose malloc() --wrap does not see
+    }
+    copy = realloc(copy, (i + 1) * sizeof(char *));
+    copy[i] = 0;
+    return copy;
+}
+
+static char ** heapParseFirstArgsPipe(char ** args, int position)
+{
+    return heapCopyArgs(args, position);
+}
+
+static char ** heapParseSecondArgsPipe(char ** args, int position)
+{
+    return heapCopyArgs(args + position + 1, getNumArgs(args + position + 1));
+}
+
+static char *** heapSplitPipeline(char ** args, int * numStages)
+{
+    int start = 0, i, n = 0;
+    char *** stages = 0;
+    for (i = 0; ; i++)
+    {
+        if (args[i] == 0 || strcmp(args[i], "|") == 0)
+        {
+            stages = realloc(stages, (n + 1) * sizeof(char **));
+            stages[n++] = heapCopyArgs(args + start, i - start);
+            if (args[i] == 0)
+                break;
+            start = i + 1;
+        }
+    }
+    *numStages = n;
+    return stages;
+}
+
+static void benchHeapParseArgs(const char * name, int numArgs, long ops)
+{
+    char * line = makeLine(numArgs, 0);
+    int mode;
+    long i;
+
+    unsigned long allocs = allocCount;
+    double start = now();
+    for (i = 0; i < ops; i++)
+        heapFreeArgs(heapParseArgs(line, &mode));
+    report(name, ops, now() - start, allocCount - allocs);
+    free(line);
+}
+
+static void benchParseArgs(const char * name, int numArgs, long ops)
+{
+    Arena arena;
+    char * line = makeLine(numArgs, 0);
+    int mode;
+    long i;
+    arenaInit(&arena);
+
+    unsigned long allocs = allocCount;
+    double start = now();
+    for (i = 0; i < ops; i++)
+    {
+        parseArgs(&arena, line, &mode);
+        arenaReset(&arena);
+    }
+    report(name, ops, now() - start, allocCount - allocs);
+    arenaFree(&arena);
+    free(line);
+}
+
+/*
+ * normalizeLine() and parseArgs() as they were before scan.c: every byte is looked at, once per pass.
+*/
+static size_t bytewiseNormalize(char * dst, const char * src, size_t len)
+{
+    size_t i, n = 0;
+    for (i = 0; i < len; i++)
+    {
+        char c = src[i] == '\t' ? ' ' : src[i];
+        if (c == ' ' && (n == 0 || dst[n-1] == ' '))
+            continue;
+        dst[n++] = c;
+    }
+    if (n != 0 && dst[n-1] == ' ')
+        n--;
+    dst[n] = 0;
+    return n;
+}
+
+static char ** bytewiseParseArgs(Arena * arena, char * str)
+{
+    int idx, prev = 0, numArgs = 1;
+    for (idx = 0; str[idx]; idx++)
+        if (str[idx] == ' ')
+            numArgs++;
+    char ** args = arenaAlloc(arena, (numArgs + 1) * sizeof(char *));
+    numArgs = 0;
+    for (idx = 0; ; idx++)
+    {
+        if (str[idx] == ' ' || str[idx] == 0)
+        {
+            args[numArgs++] = arenaStrndup(arena, str + prev, idx - prev);
+            prev = idx + 1;
+            if (str[idx] == 0)
+                break;
+        }
+    }
+    args[numArgs] = 0;
+    return args;
+}
+
+/*
+ * Normalize then tokenize a line of numArgs words, the way readLine() and parseArgs() see it. Words are separated by
+ * one space, or by a space, a space and a tab when spaced is set.
+*/
+static void benchScan(int numArgs, int spaced, long ops)
+{
+    const char * engines[] = {"scalar", "sse2", "avx2"};
+    char * words = makeLine(numArgs, 0);
+    size_t len = strlen(words) * 3;
+    char * line = malloc(len + 1);
+    char * work = malloc(len + 1);
+    char name[64];
+    Arena arena;
+    int mode;
+    size_t i, n = 0;
+    long op;
+    arenaInit(&arena);
+
+    for (i = 0; words[i]; i++)
+    {
+        line[n++] = words[i];
+        if (words[i] == ' ' && spaced)
+        {
+            line[n++] = ' ';
+            line[n++] = '\t';
+        }
+    }
+    line[n] = 0;
+
+    unsigned long allocs = allocCount;
+    double start = now();
+    for (op = 0; op < ops; op++)
+    {
+        bytewiseNormalize(work, line, n);
+        bytewiseParseArgs(&arena, work);
+        arenaReset(&arena);
+    }
+    snprintf(name, sizeof(name), "tokenize_%dargs%s_bytewise", numArgs, spaced ? "_spaced" : "");
+    report(name, ops, now() - start, allocCount - allocs);
+
+    for (i = 0; i < sizeof(engines) / sizeof(engines[0]); i++)
+    {
+        if (!scanSelect(engines[i]))
+            continue;
+        allocs = allocCount;
+        start = now();
+        for (op = 0; op < ops; op++)
+        {
+            normalizeLine(work, line, n);
+            parseArgs(&arena, work, &mode);
+            arenaReset(&arena);
+        }
+        snprintf(name, sizeof(name), "tokenize_%dargs%s_%s", numArgs, spaced ? "_spaced" : "", engines[i]);
+        report(name, ops, now() - start, allocCount - allocs);
+    }
+
+    scanSelect(0);
+    arenaFree(&arena);
+    free(words);
+    free(line);
+    free(work);
+}
+
+static void benchPipeline(long ops)
+{
+    Arena arena;
+    char * line = makeLine(63, 8); // 8 stages of 7 words
+    int mode, numStages;
+    long i;
+    arenaInit(&arena);
+
+    double start = now();
+    unsigned long allocs = allocCount;
+    for (i = 0; i < ops; i++)
+    {
+        char ** args = parseArgs(&arena, line, &mode);
+        if (positionPipe(args) < 0)
+            abort();
+        arenaReset(&arena);
+    }
+    report("positionPipe_8stages", ops, now() - start, allocCount - allocs);
+
+    start = now();
+    allocs = allocCount;
+    for (i = 0; i < ops; i++)
+    {
+        char ** args = parseArgs(&arena, line, &mode);
+        int position = positionPipe(args);
+        parseFirstArgsPipe(&arena, args, position);
+        parseSecondArgsPipe(&arena, args, position);
+        arenaReset(&arena);
+    }
+    report("pipeSplitters_8stages", ops, now() - start, allocCount - allocs);
+
+    start = now();
+    allocs = allocCount;
+    for (i = 0; i < ops; i++)
+    {
+        char ** args = parseArgs(&arena, line, &mode);
+        if (!splitPipeline(&arena, args, &numStages))
+            abort();
+        arenaReset(&arena);
+    }
+    report("splitPipeline_8stages", ops, now() - start, allocCount - allocs);
+
+    // the same two paths before the arena
+    start = now();
+    allocs = allocCount;
+    for (i = 0; i < ops; i++)
+    {
+        char ** args = heapParseArgs(line, &mode);
+        int position = positionPipe(args);
+        heapFreeArgs(heapParseFirstArgsPipe(args, position));
+        heapFreeArgs(heapParseSecondArgsPipe(args, position));
+        heapFreeArgs(args);
+    }
+    report("pipeSplitters_8stages_heap", ops, now() - start, allocCount - allocs);
+
+    start = now();
+    allocs = allocCount;
+    for (i = 0; i < ops; i++)
+    {
+        char ** args = heapParseArgs(line, &mode);
+        char *** stages = heapSplitPipeline(args, &numStages);
+        int j;
+        for (j = 0; j < numStages; j++)
+            heapFreeArgs(stages[j]);
+        free(stages);
+        heapFreeArgs(args);
+    }
+    report("splitPipeline_8stages_heap", ops, now() - start, allocCount - allocs);
+
+    arenaFree(&arena);
+    free(line);
+}
+
+static void benchCompileLine(long ops)
+{
+    Arena arena;
+    char line[] = "cd src && make -j8 > build.log 2>&1 || tail -n 20 build.log | grep error ; echo done";
+    long i;
+    arenaInit(&arena);
+
+    unsigned long allocs = allocCount;
+    double start = now();
+    for (i = 0; i < ops; i++)
+    {
+        if (!parseCommandLine(&arena, line))
+            abort();
+        arenaReset(&arena);
+    }
+    report("parseCommandLine", ops, now() - start, allocCount - allocs);
+
+    allocs = allocCount;
+    start = now();
+    for (i = 0; i < ops; i++)
+        if (!compileLine(&arena, line))
+            abort();
+    report("compileLine_cached", ops, now() - start, allocCount - allocs);
+
+    astCacheClear();
+    arenaFree(&arena);
+}
+
+static void benchReadLine(long lines)
+{
+    FILE * f = tmpfile();
+    long i;
+    for (i = 0; i < lines; i++)
+        fprintf(f, "  echo   line %ld  with some   arguments \r\n", i);
+    fflush(f);
+    rewind(f);
+    dup2(fileno(f), STDIN_FILENO);
+
+    unsigned long allocs = allocCount;
+    double start = now();
+    char * line;
+    long n = 0;
+    while ((line = readLine()) != NULL)
+    {
+        free(line);
+        n++;
+    }
+    report("readLine", n, now() - start, allocCount - allocs);
+    fclose(f);
+}
+
+/*
+ * readLine() as it was before the block reads: one getchar() per byte, spaces erased on the fly, the buffer grown by
+ * 64 bytes at a time. It returns NULL at end of input, where the original returned empty lines forever.
+*/
+static char * originalReadLine()
+{
+    int arrSize = 64, n = 0, c;
+    char * str = malloc(arrSize);
+    while (1)
+    {
+        c = getchar();
+        if (c == EOF && n == 0)
+        {
+            free(str);
+            return 0;
+        }
+        if (c == EOF || c == '\n')
+        {
+            if (n != 0 && str[n-1] == ' ')
+                n--;
+            str[n] = 0;
+            return str;
+        }
+        if (c == ' ' && (n == 0 || str[n-1] == ' '))
+            continue;
+        str[n++] = c;
+        if (n >= arrSize)
+        {
+            arrSize += 64;
+            str = realloc(str, arrSize);
+        }
+    }
+}
+
+/*
+ * Read and tokenize every line of the file on STDIN, in a child process: readLine() keeps its end of input.
+ * engine is a scan.c engine, or NULL for the original code.
+*/
+static void benchReadParse(FILE * f, const char * engine)
+{
+    char name[64];
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid != 0)
+    {
+        waitpid(pid, 0, 0);
+        return;
+    }
+
+    rewind(f);
+    dup2(fileno(f), STDIN_FILENO);
+    if (engine && !scanSelect(engine))
+        exit(0);
+
+    Arena arena;
+    char * line;
+    int mode;
+    long n = 0;
+    arenaInit(&arena);
+    unsigned long allocs = allocCount;
+    double start = now();
+    if (engine)
+    {
+        while ((line = readLine()) != NULL)
+        {
+            parseArgs(&arena, line, &mode);
+            arenaReset(&arena);
+            free(line);
+            n++;
+        }
+    }
+    else
+    {
+        while ((line = originalReadLine()) != NULL)
+        {
+            if (line[0])
+                heapFreeArgs(heapParseArgs(line, &mode));
+            free(line);
+            n++;
+        }
+    }
+    snprintf(name, sizeof(name), "readParse_%s", engine ? engine : "original");
+    report(name, n, now() - start, allocCount - allocs);
+    fflush(stdout);
+    exit(0);
+}
+
+int main(int argc, char ** argv)
+{
+    long scale = argc > 1 ? atol(argv[1]) : 1;
+    benchParseArgs("parseArgs_8args", 8, 1000000 * scale);
+    benchHeapParseArgs("parseArgs_8args_heap", 8, 1000000 * scale);
+    benchParseArgs("parseArgs_1000args", 1000, 10000 * scale);
+    benchHeapParseArgs("parseArgs_1000args_heap", 1000, 10000 * scale);
+    benchScan(8, 0, 1000000 * scale);
+    benchScan(1000, 0, 10000 * scale);
+    benchScan(1000, 1, 10000 * scale);
+    benchPipeline(500000 * scale);
+    benchCompileLine(1000000 * scale);
+    FILE * f = tmpfile();
+    long i;
+    for (i = 0; i < 1000000 * scale; i++)
+        fprintf(f, "  ls   -l  --color=never   /usr/lib/dir%ld  file%ld.txt   \n", i % 100, i);
+    fflush(f);
+    benchReadParse(f, 0);
+    benchReadParse(f, "scalar");
+    benchReadParse(f, "sse2");
+    benchReadParse(f, "avx2");
+    fclose(f);
+    benchReadLine(1000000 * scale);
+    return 0;
+}
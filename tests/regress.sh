@@ -0,0 +1,207 @@
+#!/bin/sh
+# Regression tests of a PLTsh binary. Every case runs one command line with -c and compares what it prints
+# (STDOUT and STDERR together); a failing case prints a FAIL line and makes the script exit with 1.
+# Usage: tests/regress.sh path/to/PLTsh
+
+SH=${1:?usage: regress.sh path/to/PLTsh}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+failed=0
+
+# check NAME EXPECTED LINE
+check() {
+    out=$("$SH" -c "$3" 2>&1)
+    if [ "$out" != "$2" ]; then
+        printf 'FAIL %s\n  expected: %s\n  got:      %s\n' "$1" "$2" "$out"
+        failed=1
+    fi
+}
+
+# check_match NAME PATTERN LINE: the output matches a case pattern instead of a fixed text
+check_match() {
+    out=$("$SH" -c "$3" 2>&1)
+    case $out in
+        $2) ;;
+        *) printf 'FAIL %s\n  expected: %s\n  got:      %s\n' "$1" "$2" "$out"; failed=1 ;;
+    esac
+}
+
+# check_status NAME EXPECTED LINE: the exit status of the shell instead of its output
+check_status() {
+    "$SH" -c "$3" > /dev/null 2>&1
+    got=$?
+    if [ "$got" != "$2" ]; then
+        printf 'FAIL %s\n  expected status: %s\n  got:             %s\n' "$1" "$2" "$got"
+        failed=1
+    fi
+}
+
+# check_input NAME EXPECTED LINES: the lines are piped to the shell instead of given with -c
+check_input() {
+    out=$(printf '%s\n' "$3" | "$SH" 2>&1)
+    if [ "$out" != "$2" ]; then
+        printf 'FAIL %s\n  expected: %s\n  got:      %s\n' "$1" "$2" "$out"
+        failed=1
+    fi
+}
+
+# descriptor numbers out of range are syntax errors, never indexes into the descriptor table
+check "redirect_fd_overflow" "[Error] Syntax Error" "echo hi 4294967295>$TMP/zz"
+[ -e "$TMP/zz" ] && { echo "FAIL redirect_fd_overflow: $TMP/zz was created"; failed=1; }
+check "redirect_negative_source" "[Error] Syntax Error" "echo hi >&-5"
+check "redirect_close" "hi" "echo hi 2>&-"
+
+# a copy of a descriptor above STDERR only takes one the command set itself, never one of the shell's
+check "redirect_shell_fd" "[Error] Syntax Error" "echo hi >&3"
+check "redirect_shell_fd_external" "[Error] Syntax Error" "sh -c 'echo hi' >&4"
+check "redirect_own_fd" "hi" "echo hi 5>$TMP/own >&5; cat $TMP/own"
+check "redirect_own_fd_external" "hi" "sh -c 'echo hi' 5>$TMP/own2 >&5; cat $TMP/own2"
+
+# a group is a stage of a pipeline like any command
+check "group_pipe_stage" "2" "(echo a; echo b) | wc -l"
+check "group_pipe_last_stage" "HI" "echo hi | (tr a-z A-Z)"
+check "group_pipe_statuses" "3 4" "(exit 3) | (exit 4); pipestatus"
+check "group_pipe_mover_stage" "x
+y" "(echo x) | cat | (cat; echo y)"
+check "group_pipe_substitution" "sub
+a" "(echo a) | cat <(echo sub) -"
+check_match "group_pipe_timed" 'a?\[time\] stage 2 (cat)*\[time\] stage 1 (*' "time (echo a) | cat"
+
+# wait, fg and parallel return the status of the job or task, not a success flag
+check_status "wait_job_status" 3 'sh -c "exit 3" & wait %1'
+check_status "wait_current_job_status" 4 'sh -c "exit 4" & wait %%'
+check_status "wait_no_such_job" 127 "wait %9"
+check_status "parallel_status" 5 'parallel sh -c "exit 5" ::: a'
+check_status "parallel_first_failure" 2 'parallel -k -j 1 sh -c "exit {}" ::: 0 2 6'
+check_status "parallel_success" 0 'parallel true ::: a b c'
+
+# "time" prefixes any pipeline of the line, not only the first word
+check_match "time_after_sequence" '\[time\] sleep: real *' "true; time sleep 0.1"
+check_match "time_after_or" 'x?\[time\] echo: real *' "false || time echo x"
+check_match "time_in_group" 'g?\[time\] echo: real *' "(time echo g)"
+check_match "time_pipeline_stages" '\[time\] stage 1 (true)*\[time\] stage 2 (true)*' "time true | true"
+check_match "time_untimed_rest" '\[time\] true: real *[0-9]
+a' "time true; echo a"
+check "time_as_word" "time x" "echo time x"
+
+# cd keeps PWD and OLDPWD from getcwd(): an unset PWD or a path longer than any fixed buffer is fine
+out=$(env -u PWD "$SH" -c "cd $TMP; pwd" 2>&1)
+[ "$out" = "$TMP" ] || { printf 'FAIL cd_without_pwd\n  got: %s\n' "$out"; failed=1; }
+long=$TMP
+for i in 1 2 3 4 5 6 7 8 9 10; do long=$long/directory_name_of_sixty_characters_to_make_the_path_long_$i; done
+mkdir -p "$long"
+check "cd_long_path" "$long" "cd $long; cd $TMP; cd -"
+check "cd_dash" "$TMP
+$TMP" "cd $TMP; cd /; cd -; pwd"
+check "cd_missing" "[Error] cd: $TMP/none: No such file or directory" "cd $TMP/none"
+
+# cache: a miss runs the command on a file of the store, the shell's STDOUT stays put; a changed operand is a new key
+echo one > "$TMP/cached"
+out=$(PLTSH_CACHE_DIR="$TMP/store" "$SH" -c "cache cat $TMP/cached; echo after; cache cat $TMP/cached; cache stats" < /dev/null 2>&1)
+case "$out" in
+    "one
+after
+one
+"*"hits: 1 "*"misses: 1, stored: 1"*) ;;
+    *) printf 'FAIL cache_miss_then_hit\n  got: %s\n' "$out"; failed=1 ;;
+esac
+out=$(PLTSH_CACHE_DIR="$TMP/store" "$SH" -c "echo two > $TMP/cached; cache cat $TMP/cached; cache stats" < /dev/null 2>&1)
+case "$out" in
+    "two
+"*"hits: 0 "*"misses: 1"*) ;;
+    *) printf 'FAIL cache_invalidate\n  got: %s\n' "$out"; failed=1 ;;
+esac
+
+# globbing: quotes and backslashes keep a pattern literal, hidden files need a leading '.', a pattern without match stays
+G=$TMP/glob
+mkdir -p "$G/a/b" "$G/c" "$G/d"
+touch "$G/a/b/x.c" "$G/c/y.c" "$G/z.c" "$G/w.h" "$G/.hidden.c" "$G/a/.hidden.c"
+check "glob_star" "$G/z.c" "echo $G/*.c"
+check "glob_quoted" "$G/*.c" "echo '$G/*.c'"
+check "glob_escaped" "$G/*.c" "echo $G/\\*.c"
+check "glob_hidden" "$G/.hidden.c" "echo $G/.*.c"
+check "glob_negated_bracket" "$G/a $G/c $G/d $G/z.c" "echo $G/[!w]*"
+check "glob_dirs_only" "$G/a/ $G/c/ $G/d/" "echo $G/*/"
+check "glob_recursive" "$G/a/b/x.c $G/c/y.c $G/z.c" "echo $G/**/*.c"
+check "glob_recursive_dirs" "$G/a/ $G/a/b/ $G/c/ $G/d/" "echo $G/**/"
+check "glob_no_match" "$G/*.none" "echo $G/*.none"
+# listings cached by the walker threads are dropped when their directory changes
+find "$G" -type d -exec touch -d '5 seconds ago' {} +
+check "glob_recursive_cache" "$G/a/b/x.c $G/c/y.c $G/z.c
+$G/a/b/n.c $G/a/b/x.c $G/c/y.c $G/z.c" "echo $G/**/*.c; touch $G/a/b/n.c; echo $G/**/*.c"
+
+# pipesize keeps the size the kernel granted, rounded up to a power of two pages
+check_match "pipesize_granted" "*pipesize=8192*" "set pipesize=5000; set"
+
+# batch: with a small argument limit the operands are split into several execs, the fixed words repeated in each;
+# the status is the one of the first batch that failed
+B=$TMP/batch
+mkdir -p "$B/dest" "$B/big"
+for i in 01 02 03 04 05 06 07 08 09 10 11 12 13 14 15 16 17 18 19 20; do : > "$B/f$i.c"; done
+check "batch_count" "10
+10" "cd $B; set batchlimit=200; sh -c 'echo \$#' sh *.c"
+check "batch_fixed_words" "f01.c dest/ 7
+f07.c dest/ 7
+f13.c dest/ 7
+f19.c dest/ 3" "cd $B; set batchlimit=200; sh -c 'for a; do last=\$a; done; echo \$1 \$last \$#' sh *.c dest/"
+check "batch_cp_dest" "20" "cd $B; set batchlimit=200; cp *.c dest/; ls dest | wc -l"
+check_status "batch_later_failure" 4 "cd $B; set batchlimit=200; sh -c 'for a; do [ \$a = f15.c ] && exit 4; done; exit 0' sh *.c"
+check_status "batch_first_failure" 3 "cd $B; set batchlimit=200; sh -c 'for a; do [ \$a = f15.c ] && exit 4; [ \$a = f02.c ] && exit 3; done; exit 0' sh *.c"
+check_status "batch_too_long" 126 "cd $B; set batchlimit=60; sh -c 'exit 0' sh *.c"
+# a limit above what exec() takes: the batch exec() refuses with E2BIG is halved until it fits (ARG_MAX is 128k here)
+i=0
+while [ $i -lt 2000 ]; do i=$((i + 1)); printf '%s/file_with_a_rather_long_name_to_fill_the_argument_list_quickly_%04d\n' "$B/big" $i; done | xargs touch
+out=$(ulimit -s 512; "$SH" -c "cd $B; set batchlimit=1M; sh -c 'echo \$#' sh big/*" 2>&1)
+[ "$out" = "1000
+1000" ] || { printf 'FAIL batch_e2big_halving\n  got: %s\n' "$out"; failed=1; }
+
+# command lists: ";" runs every command, "&&" and "||" follow the status of the last one, a group is one command
+check "list_sequence" "a
+b" "echo a; echo b"
+check "list_and" "a
+b" "echo a && echo b"
+check "list_and_failed" "" "false && echo b"
+check "list_or" "b" "false || echo b"
+check "list_or_success" "a" "echo a || echo b"
+check "list_and_or_chain" "c" "false && echo a || echo c"
+check "list_group_status" "b" "(true; false) || echo b"
+check "list_group_and" "g
+h
+i" "(echo g; echo h) && echo i"
+check "list_syntax_error" "[Error] Syntax Error" "echo a &&"
+
+# history designators of a script read from STDIN are replaced and echoed
+check_input "history_substring" "one
+echo one
+one" "echo one
+!?ne?"
+check_input "history_substring_open" "alpha one
+beta two
+echo alpha one
+alpha one" "echo alpha one
+echo beta two
+!?lph"
+check_input "history_not_found" "a
+[Error] !?zzz: event not found" "echo a
+!?zzz?"
+check_input "history_previous" "a
+echo a
+a" "echo a
+!!"
+
+# redirection lists are applied in the order written
+check "redirect_both_to_file" "out
+err" "sh -c 'echo out; echo err >&2' > $TMP/both 2>&1; cat $TMP/both"
+check "redirect_err_to_pipe_only" "err" "sh -c 'echo out; echo err >&2' 2>&1 > /dev/null"
+check "redirect_fan_out" "x
+x" "echo x > $TMP/fan1 > $TMP/fan2; cat $TMP/fan1 $TMP/fan2"
+check "redirect_append_input" "a
+a" "echo a > $TMP/app; cat < $TMP/app >> $TMP/app2; cat < $TMP/app >> $TMP/app2; cat $TMP/app2"
+
+# jobs: a background job is listed while it runs, killed and waited for by its number
+check_match "jobs_running" '\[1\]+ Running *sleep 1' "sleep 1 & jobs; kill %1"
+check_status "jobs_kill_wait" 143 "sleep 5 & kill %1; wait %1"
+check_status "jobs_fg" 2 'sh -c "exit 2" & fg %1'
+
+[ $failed -eq 0 ] && echo "all tests passed"
+exit $failed